@@ -33,11 +33,14 @@
 
 #include "mod_whisper.h"
 #include "websock_glue.h"
+#include "whisper_batch.h"
+#include "whisper_slot.h"
 
 struct whisper_globals whisper_globals;
 
 switch_mutex_t *MUTEX = NULL;
 switch_event_node_t *NODE = NULL;
+switch_event_node_t *ANSWER_NODE = NULL;
 
 SWITCH_MODULE_LOAD_FUNCTION(mod_whisper_load);
 SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_whisper_shutdown);
@@ -46,57 +49,219 @@ SWITCH_MODULE_DEFINITION(mod_whisper, mod_whisper_load, mod_whisper_shutdown, mo
 
 /* ASR interface */ 
 
+/* the transition table documented in mod_whisper.h */
+static const struct {
+	uint32_t need;
+	uint32_t deny;
+	uint32_t set;
+	uint32_t clear;
+} whisper_transitions[] = {
+	[WHISPER_T_RESET] = { 0, 0, ASRFLAG_READY, ~0U },
+	[WHISPER_T_PAUSE] = { 0, 0, 0, ~0U },
+	[WHISPER_T_INPUT_TIMERS] = { 0, ASRFLAG_INPUT_TIMERS, ASRFLAG_INPUT_TIMERS, 0 },
+	[WHISPER_T_NO_INPUT_TIMERS] = { 0, 0, 0, ASRFLAG_INPUT_TIMERS },
+	[WHISPER_T_START_OF_SPEECH] = { ASRFLAG_READY, ASRFLAG_START_OF_SPEECH, ASRFLAG_START_OF_SPEECH, 0 },
+	[WHISPER_T_END_OF_SPEECH] = { ASRFLAG_READY, 0, ASRFLAG_RESULT_PENDING, ASRFLAG_READY },
+	[WHISPER_T_PARTIAL] = { ASRFLAG_START_OF_SPEECH, ASRFLAG_RESULT_PENDING | ASRFLAG_RESULT_READY | ASRFLAG_RETURNED_RESULT, ASRFLAG_PARTIAL_READY, 0 },
+	[WHISPER_T_FAST_PARTIAL] = { ASRFLAG_RESULT_PENDING, ASRFLAG_RESULT_READY | ASRFLAG_RETURNED_RESULT, ASRFLAG_PARTIAL_READY, 0 },
+	[WHISPER_T_RETURN_PARTIAL] = { ASRFLAG_PARTIAL_READY, 0, 0, ASRFLAG_PARTIAL_READY },
+	[WHISPER_T_RESULT] = { 0, ASRFLAG_RESULT_TIMEOUT | ASRFLAG_FAST_RESULT, ASRFLAG_RESULT_READY, ASRFLAG_RESULT_PENDING | ASRFLAG_PARTIAL_READY },
+	[WHISPER_T_FAST_RESULT] = { ASRFLAG_RESULT_PENDING, ASRFLAG_RESULT_READY | ASRFLAG_RESULT_TIMEOUT, ASRFLAG_RESULT_READY | ASRFLAG_FAST_RESULT, ASRFLAG_RESULT_PENDING | ASRFLAG_PARTIAL_READY },
+	[WHISPER_T_NOINPUT_TIMEOUT] = { ASRFLAG_INPUT_TIMERS, ASRFLAG_START_OF_SPEECH | ASRFLAG_RESULT_READY | ASRFLAG_NOINPUT_TIMEOUT, ASRFLAG_NOINPUT_TIMEOUT, 0 },
+	[WHISPER_T_SPEECH_TIMEOUT] = { ASRFLAG_START_OF_SPEECH, ASRFLAG_TIMEOUT | ASRFLAG_RESULT_READY | ASRFLAG_NOINPUT_TIMEOUT, ASRFLAG_TIMEOUT, 0 },
+	[WHISPER_T_RESULT_TIMEOUT] = { ASRFLAG_RESULT_PENDING, 0, ASRFLAG_RESULT_TIMEOUT, ASRFLAG_RESULT_PENDING },
+	[WHISPER_T_RETURN_START] = { ASRFLAG_START_OF_SPEECH, ASRFLAG_RETURNED_START_OF_SPEECH, ASRFLAG_RETURNED_START_OF_SPEECH, 0 },
+	[WHISPER_T_RETURN_RESULT] = { 0, ASRFLAG_RETURNED_RESULT, ASRFLAG_RETURNED_RESULT, ASRFLAG_READY }
+};
+
+/* lock free, writes made before a successful transition are visible to whoever observes its state */
+switch_bool_t whisper_transition(whisper_t *context, whisper_transition_t transition)
+{
+	uint32_t old = __atomic_load_n(&context->flags, __ATOMIC_RELAXED), next;
+
+	do {
+		if ((old & whisper_transitions[transition].need) != whisper_transitions[transition].need || (old & whisper_transitions[transition].deny)) {
+			return SWITCH_FALSE;
+		}
+		next = (old & ~whisper_transitions[transition].clear) | whisper_transitions[transition].set;
+	} while (!__atomic_compare_exchange_n(&context->flags, &old, next, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	return SWITCH_TRUE;
+}
+
+/* timer wheel callbacks: wheel thread, wheel locked, so nothing but the transition and a log line */
+static void whisper_noinput_expired(whisper_timer_t *timer, void *data)
+{
+	whisper_t *context = (whisper_t *) data;
+
+	if (whisper_transition(context, WHISPER_T_NOINPUT_TIMEOUT)) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "NO INPUT TIMEOUT %dms\n", context->no_input_timeout);
+	}
+}
+
+static void whisper_speech_expired(whisper_timer_t *timer, void *data)
+{
+	whisper_t *context = (whisper_t *) data;
+
+	/* whisper_feed ends the utterance on its next frame */
+	if (whisper_transition(context, WHISPER_T_SPEECH_TIMEOUT)) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "SPEECH TIMEOUT %dms\n", context->speech_timeout);
+	}
+}
+
+static void whisper_result_expired(whisper_timer_t *timer, void *data)
+{
+	whisper_t *context = (whisper_t *) data;
+
+	if (whisper_transition(context, WHISPER_T_RESULT_TIMEOUT)) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "RESULT TIMEOUT %dms\n", context->result_timeout);
+	}
+}
+
+static void whisper_cancel_timers(whisper_t *context)
+{
+	whisper_timer_cancel(&context->noinput_timer);
+	whisper_timer_cancel(&context->speech_timer);
+	whisper_timer_cancel(&context->result_timer);
+}
+
+/* counted from no_input_time, so changing the timeout after the timers started keeps their origin */
+static void whisper_arm_noinput(whisper_t *context)
+{
+	switch_time_t elapsed = (switch_micro_time_now() - context->no_input_time) / 1000;
+
+	if (!(whisper_state(context) & ASRFLAG_INPUT_TIMERS) || context->no_input_timeout < 0) {
+		whisper_timer_cancel(&context->noinput_timer);
+		return;
+	}
+
+	whisper_timer_arm(&context->noinput_timer, elapsed < context->no_input_timeout ? (uint32_t) (context->no_input_timeout - elapsed) : 0);
+}
+
 static void whisper_reset_vad(whisper_t *context)
 {
 	if (context->vad) {
 		switch_vad_reset(context->vad);
 	}
-	context->flags = 0;
+	whisper_cancel_timers(context);
 	context->result_text = "";
 	context->result_confidence = 87.3;
-	switch_set_flag(context, ASRFLAG_READY);
+	context->result = NULL;
+	context->last_partial = 0;
+	context->routed = 0;
+	context->replaying = 0;
+	context->refining = 0;
+	__atomic_store_n(&context->refined, 0, __ATOMIC_RELEASE);
 	context->no_input_time = switch_micro_time_now();
+	whisper_onset_reset(&context->onset);
+	whisper_transition(context, WHISPER_T_RESET);
 	if (context->start_input_timers) {
-		switch_set_flag(context, ASRFLAG_INPUT_TIMERS);
+		whisper_transition(context, WHISPER_T_INPUT_TIMERS);
+		whisper_arm_noinput(context);
 	}
 }
 
-static switch_status_t whisper_open(switch_asr_handle_t *ah, const char *codec, int rate, const char *dest, switch_asr_flag_t *flags)
+/* the named profile, the default one (top level settings) when empty or unknown */
+static whisper_profile_t *whisper_profile_find(const char *name)
+{
+	whisper_profile_t *profile;
+
+	if (!zstr(name)) {
+		for (profile = whisper_globals.profiles; profile; profile = profile->next) {
+			if (!strcasecmp(profile->name, name)) {
+				return profile;
+			}
+		}
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unknown whisper profile %s, using the default\n", name);
+	}
+
+	return whisper_globals.default_profile;
+}
+
+/* chunk sizes are configured in ms and kept in bytes of the stream actually sent */
+static uint32_t whisper_chunk_bytes(whisper_t *context, uint32_t ms)
+{
+	uint32_t bytes = context->rate / 1000 * ms * 2 * context->channels;
+
+	return switch_min(switch_max(bytes, 2 * context->channels), context->ring_size / 2);
+}
+
+/* per handle settings, also what a reattached context goes back to */
+static void whisper_asr_defaults(whisper_t *context)
+{
+	context->thresh = 400;
+	context->silence_ms = 700;
+	context->voice_ms = 60;
+	context->start_input_timers = 1;
+	context->no_input_timeout = 5000;
+	context->speech_timeout = 10000;
+	context->result_timeout = 0;
+	context->return_json = whisper_globals.return_json;
+	context->partial_interval = PARTIAL_MS;
+	context->event_channel_data = whisper_globals.event_channel_data;
+
+	context->hpf = whisper_globals.hpf;
+	whisper_hpf_reset(&context->hpf);
+	context->ns = whisper_globals.ns;
+	whisper_ns_reset(&context->ns);
+	context->agc = whisper_globals.agc;
+	whisper_agc_reset(&context->agc);
+	context->onset = whisper_globals.onset;
+
+	switch_vad_set_mode(context->vad, -1);
+	switch_vad_set_param(context->vad, "thresh", context->thresh);
+	switch_vad_set_param(context->vad, "silence_ms", context->silence_ms);
+	switch_vad_set_param(context->vad, "voice_ms", context->voice_ms);
+	switch_vad_set_param(context->vad, "debug", 1);
+}
+
+/* allocates the buffers, connects and sets up VAD, shared by the ASR interface and whisper_transcribe */
+switch_status_t whisper_asr_setup(whisper_t *context, switch_memory_pool_t *pool, uint32_t rate, const char *profile_name)
 {
-	whisper_t *context;
 	char *asr_server = NULL;
 	switch_status_t status = SWITCH_STATUS_SUCCESS;
 
-
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "asr_open attempt on CLOSED asr handle\n");
-		return SWITCH_STATUS_FALSE;
+	context->pool = pool;
+	context->rate = rate;
+	context->result_back = 0;
+	context->result_mid = 1;
+	context->result_front = 2;
+	if (!context->channels) {
+		context->channels = 1;
 	}
 
-	if (!(context = (whisper_t *) switch_core_alloc(ah->memory_pool, sizeof(*context)))) {
-		return SWITCH_STATUS_MEMERR;
-	}
+	context->profile = whisper_profile_find(profile_name);
+	context->send_mode = context->profile->send_mode;
 
-	context->pool = ah->memory_pool;
+	/* a batch ring holds a whole utterance, allocated once here and reused for every turn */
+	context->ring_size = AUDIO_RING_SIZE;
+	if (context->send_mode == WHISPER_SEND_BATCH) {
+		context->ring_size = switch_max(context->ring_size, (switch_size_t) rate / 1000 * context->profile->batch_max_ms * 2 * context->channels);
+	}
 
-	ah->private_info = context;
-	codec = "L16";
-	ah->codec = switch_core_strdup(ah->memory_pool, codec);
+	context->chunk_min = whisper_chunk_bytes(context, context->profile->chunk_min_ms);
+	context->chunk_max = whisper_chunk_bytes(context, context->profile->chunk_max_ms);
+	context->chunk_bytes = switch_min(switch_max(whisper_chunk_bytes(context, context->profile->chunk_ms), context->chunk_min), context->chunk_max);
+	context->chunk_adaptive = context->profile->chunk_adaptive;
 
-	asr_server = switch_core_strdup(whisper_globals.pool, whisper_globals.asr_server_url);
+	asr_server = switch_core_strdup(pool, context->profile->asr_server_url);
 
-	if (rate > 16000) {
-		ah->native_rate = 16000;
-	}
+	switch_mutex_init(&context->mutex, SWITCH_MUTEX_NESTED, pool);
 
-	switch_mutex_init(&context->mutex, SWITCH_MUTEX_NESTED, whisper_globals.pool);
+	whisper_timer_init(&context->noinput_timer, whisper_noinput_expired, context);
+	whisper_timer_init(&context->speech_timer, whisper_speech_expired, context);
+	whisper_timer_init(&context->result_timer, whisper_result_expired, context);
 
-	if (switch_buffer_create_dynamic(&context->audio_buffer, AUDIO_BLOCK_SIZE, AUDIO_BLOCK_SIZE, 0) != SWITCH_STATUS_SUCCESS) {
+	/* the mirror lets the lws thread send the largest chunk straight out of the ring */
+	if (whisper_ring_create(&context->audio_ring, context->ring_size, context->chunk_max, pool) != SWITCH_STATUS_SUCCESS ||
+		whisper_ring_create(&context->ctl_ring, CTL_RING_SIZE, 0, pool) != SWITCH_STATUS_SUCCESS ||
+		!(context->tx_buf = switch_core_alloc(pool, LWS_PRE + context->chunk_max)) ||
+		!(context->results = switch_core_alloc(pool, 3 * sizeof(whisper_result_t)))) {
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Failed to create the audio buffer\n");
 		return SWITCH_STATUS_MEMERR;
 	}
 
-	status = ws_asr_setup_connection(asr_server, context, whisper_globals.pool);
+	status = ws_asr_setup_connection(asr_server, context, pool);
 
 	if (status != SWITCH_STATUS_SUCCESS) {
 		whisper_fire_event(context, "whisper::asr_connection_error");
@@ -104,478 +269,2082 @@ static switch_status_t whisper_open(switch_asr_handle_t *ah, const char *codec,
 		return status;
 	}
 
-	context->thresh = 400;
-	context->silence_ms = 700;
-	context->voice_ms = 60;
-	context->start_input_timers = 1;
-	context->no_input_timeout = 5000;
-	context->speech_timeout = 10000;
-
-	context->vad = switch_vad_init(ah->native_rate, 1);
-	switch_vad_set_mode(context->vad, -1);
-	switch_vad_set_param(context->vad, "thresh", context->thresh);
-	switch_vad_set_param(context->vad, "silence_ms", context->silence_ms);
-	switch_vad_set_param(context->vad, "voice_ms", context->voice_ms);
-	switch_vad_set_param(context->vad, "debug", 1);
+	context->vad = switch_vad_init(rate, 1);
+	whisper_asr_defaults(context);
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "ASR opened\n");
+	if (!zstr(whisper_globals.record_sent_audio)) {
+		context->capture = whisper_capture_open(whisper_globals.record_sent_audio, context->channel_uuid, rate, context->channels);
+	}
 
-	whisper_reset_vad(context);
+	/* low priority batch jobs back off while calls are using the inference tier */
+	if (!context->offline) {
+		__atomic_add_fetch(&whisper_globals.live_sessions, 1, __ATOMIC_RELAXED);
+		context->live = 1;
+	}
 
 	return status;
 }
 
-static switch_status_t whisper_load_grammar(switch_asr_handle_t *ah, const char *grammar, const char *name)
+void whisper_asr_teardown(whisper_t *context)
 {
-	whisper_t *context = (whisper_t *)ah->private_info;
-	char req_string[100];
+	/* cancelled first, a callback running now has returned once cancel does */
+	whisper_cancel_timers(context);
 
-	ks_json_t *req = ks_json_create_object();
+	/* not under context->mutex, the lws thread may need it to finish before it can be joined */
+	ws_asr_close_connection(context);
 
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_open attempt on CLOSED asr handle\n");
-		return SWITCH_STATUS_FALSE;
+	if (context->fast) {
+		whisper_asr_teardown(context->fast);
 	}
 
-	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "load grammar %s\n", grammar);
-	context->grammar = switch_core_strdup(ah->memory_pool, grammar);
+	if (context->live) {
+		__atomic_sub_fetch(&whisper_globals.live_sessions, 1, __ATOMIC_RELAXED);
+		context->live = 0;
+	}
 
-	snprintf(req_string, sizeof(req_string), "{\"grammar\": \"%s\"}", grammar);
-	
-	ks_json_add_string_to_object(req, "grammar", grammar);
-	strcpy(req_string, ks_json_print_unformatted(req));
+	switch_mutex_lock(context->mutex);
+
+	if (context->vad) {
+		switch_vad_destroy(&context->vad);
+	}
 
+	whisper_capture_close(&context->capture);
 
-	if (ws_send_text(context->wsi, req_string) != SWITCH_STATUS_SUCCESS) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to send grammar to websocket server\n");
+	switch_mutex_unlock(context->mutex);
+}
+
+/* teardown, and the context's own pool with it when it had one */
+void whisper_asr_free(whisper_t *context)
+{
+	switch_memory_pool_t *pool = context->reuse_pool;
+
+	whisper_asr_teardown(context);
+
+	if (pool) {
+		switch_core_destroy_memory_pool(&pool);
 	}
-	
-	return SWITCH_STATUS_SUCCESS;
 }
 
-static switch_status_t whisper_unload_grammar(switch_asr_handle_t *ah, const char *name)
+/* tells the server how often to send partials, 0 for none */
+static void whisper_partial_request(whisper_t *context)
 {
-	return SWITCH_STATUS_SUCCESS;
+	const char *req = switch_core_sprintf(context->pool, "{\"partial\": %u}", context->partial ? context->partial_interval : 0);
+
+	if (context->started != WS_STATE_STARTED || ws_asr_queue_text(context, req) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "Unable to ask the server for partials\n");
+	}
 }
 
-static switch_status_t whisper_close(switch_asr_handle_t *ah, switch_asr_flag_t *flags)
+/* {"language": <hint>}, an empty hint lets the server detect the language again */
+static void whisper_language_request(whisper_t *context)
 {
-	whisper_t *context = (whisper_t *)ah->private_info;
-	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	switch_stream_handle_t stream = { 0 };
 
-	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "ASR close!\n");
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Double ASR close!\n");
-		return SWITCH_STATUS_FALSE;
+	SWITCH_STANDARD_STREAM(stream);
+	stream.write_function(&stream, "{\"language\": ");
+	whisper_json_write_string(&stream, context->language, strlen(context->language));
+	stream.write_function(&stream, "}");
+
+	if (context->started != WS_STATE_STARTED || ws_asr_queue_text(context, switch_core_strdup(context->pool, (char *) stream.data)) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "Unable to send the language hint\n");
+	}
+	switch_safe_free(stream.data);
+
+	if (context->fast) {
+		switch_copy_string(context->fast->language, context->language, sizeof(context->fast->language));
+		whisper_language_request(context->fast);
+	}
+}
+
+/* opened with the first closed-set grammar or at open for two-pass, the session keeps it (or its failure) until close */
+static void whisper_fast_open(whisper_t *context)
+{
+	whisper_t *fast;
+
+	if (context->fast || context->fast_failed || zstr(context->profile->fast_profile)) {
+		return;
+	}
+
+	context->fast_failed = 1;
+
+	if (whisper_profile_find(context->profile->fast_profile) == context->profile) {
+		return;
+	}
+
+	/* no events, timers or live count of its own, this context does the turn taking */
+	fast = switch_core_alloc(context->pool, sizeof(*fast));
+	fast->offline = 1;
+	fast->channel_uuid = context->channel_uuid;
+
+	context->replay_max = (switch_size_t) context->rate / 1000 * context->profile->batch_max_ms * 2;
+
+	if (whisper_asr_setup(fast, context->pool, context->rate, context->profile->fast_profile) != SWITCH_STATUS_SUCCESS ||
+		!(context->replay = switch_core_alloc(context->pool, context->replay_max))) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "Fast profile %s unavailable, closed-set grammars stay on %s\n",
+						  context->profile->fast_profile, context->profile->name);
+		return;
+	}
+
+	context->fast = fast;
+	context->fast_failed = 0;
+
+	if (*context->language) {
+		switch_copy_string(fast->language, context->language, sizeof(fast->language));
+		whisper_language_request(fast);
+	}
+}
+
+/* the whisper_language channel variable, else what earlier calls from the same caller ID were recognized as */
+static void whisper_language_hint(whisper_t *context)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(context->session);
+	const char *var;
+
+	context->caller = switch_core_strdup(context->pool, switch_str_nil(switch_channel_get_variable(channel, "caller_id_number")));
+
+	if (!zstr(var = switch_channel_get_variable(channel, "whisper_language"))) {
+		switch_copy_string(context->language, var, sizeof(context->language));
+	} else if (!whisper_language_lookup(context->caller, context->language, sizeof(context->language))) {
+		return;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Language hint %s\n", context->language);
+	whisper_language_request(context);
+}
+
+/* nothing of a turn is left on the server: no speech was sent, or its reply is in */
+static int whisper_quiescent(whisper_t *context)
+{
+	return !context->stamps.onset || context->stamps.result;
+}
+
+/*
+ * the context an earlier handle of the channel parked, if it was opened for the same profile and
+ * rate and is still connected: the connection, the fast one and the call's counters are kept, the
+ * previous handle's params are dropped
+ */
+static whisper_t *whisper_reattach(switch_core_session_t *session, whisper_profile_t *profile, uint32_t rate)
+{
+	whisper_t *context;
+
+	if (!(context = whisper_slot_take(switch_core_session_get_uuid(session)))) {
+		return NULL;
+	}
+
+	if (context->profile != profile || context->rate != rate || context->started != WS_STATE_STARTED || context->wc_error) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Parked ASR connection does not fit, opening a new one\n");
+		whisper_asr_free(context);
+		return NULL;
 	}
 
 	switch_mutex_lock(context->mutex);
-	ws_asr_close_connection(context);
 
-	if (context->vad) {
-		switch_vad_destroy(&context->vad);
+	whisper_asr_defaults(context);
+	context->send_mode = profile->send_mode;
+	if (!context->chunk_adaptive) {
+		context->chunk_bytes = switch_min(switch_max(whisper_chunk_bytes(context, profile->chunk_ms), context->chunk_min), context->chunk_max);
+	}
+	if (context->partial) {
+		context->partial = 0;
+		whisper_partial_request(context);
+	}
+	context->closed_set = 0;
+	context->two_pass = profile->two_pass;
+
+	/* whatever was published while it was parked */
+	whisper_result_take(context);
+	if (context->fast) {
+		whisper_result_take(context->fast);
 	}
 
-	
-	switch_buffer_destroy(&context->audio_buffer);
-	switch_set_flag(ah, SWITCH_ASR_FLAG_CLOSED);
-	switch_safe_free(context->result_text);
 	switch_mutex_unlock(context->mutex);
-	return status;
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "ASR reattached to the parked connection\n");
+
+	return context;
 }
 
-static switch_status_t whisper_feed(switch_asr_handle_t *ah, void *data, unsigned int len, switch_asr_flag_t *flags)
+static switch_status_t whisper_open(switch_asr_handle_t *ah, const char *codec, int rate, const char *dest, switch_asr_flag_t *flags)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
-	switch_vad_state_t vad_state;
-	int rlen;
+	whisper_t *context;
+	switch_core_session_t *session;
+	switch_memory_pool_t *pool = ah->memory_pool;
+	whisper_profile_t *profile;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+
 
 	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		return SWITCH_STATUS_BREAK;
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "asr_open attempt on CLOSED asr handle\n");
+		return SWITCH_STATUS_FALSE;
 	}
 
-	if (switch_test_flag(context, ASRFLAG_RETURNED_RESULT) && switch_test_flag(ah, SWITCH_ASR_FLAG_AUTO_RESUME)) {
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Auto Resuming\n");
-		whisper_reset_vad(context);
+	codec = "L16";
+	ah->codec = switch_core_strdup(ah->memory_pool, codec);
+
+	if (rate > 16000) {
+		ah->native_rate = 16000;
 	}
 
-	switch_mutex_lock(context->mutex);
-	
-	if (switch_test_flag(context, ASRFLAG_READY)) {
+	/* the handle lives in the session pool and is closed before the session goes away */
+	session = switch_core_memory_pool_get_data(ah->memory_pool, "__session");
 
-		vad_state = switch_vad_process(context->vad, (int16_t *)data, len / sizeof(uint16_t));
-		
-		if (vad_state == SWITCH_VAD_STATE_TALKING) {
+	/* dest is the address of detect_speech whisper <grammar> <name> <profile>, else the whisper_profile channel variable */
+	if (zstr(dest) || !strcasecmp(dest, "default")) {
+		dest = session ? switch_channel_get_variable(switch_core_session_get_channel(session), "whisper_profile") : NULL;
+	}
+	profile = whisper_profile_find(dest);
 
-			char buf[AUDIO_BLOCK_SIZE];
+	if (session && (context = whisper_reattach(session, profile, ah->native_rate))) {
+		ah->private_info = context;
+		if (context->two_pass) {
+			whisper_fast_open(context);
+		}
+		if (!*context->language) {
+			whisper_language_hint(context);
+		}
+		whisper_reset_vad(context);
+		return SWITCH_STATUS_SUCCESS;
+	}
 
-			switch_buffer_write(context->audio_buffer, data, len);
+	/* a context that may be parked at close outlives the handle, so it gets a pool of its own */
+	if (session && profile->reuse_idle_ms && switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return SWITCH_STATUS_MEMERR;
+	}
 
-			if (switch_buffer_inuse(context->audio_buffer) > AUDIO_BLOCK_SIZE) {
-				rlen = switch_buffer_read(context->audio_buffer, buf, AUDIO_BLOCK_SIZE);
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sending data %d %d\n", rlen, context->started);
-	
-				if (context->started != WS_STATE_STARTED) {
-					whisper_fire_event(context, "whisper::asr_connection_error");
-					switch_mutex_unlock(context->mutex);
-					return SWITCH_STATUS_BREAK; 
-				}
+	if (!(context = (whisper_t *) switch_core_alloc(pool, sizeof(*context)))) {
+		return SWITCH_STATUS_MEMERR;
+	}
 
-				if (ws_send_binary(context->wsi, buf, rlen) != SWITCH_STATUS_SUCCESS) {
-					switch_mutex_unlock(context->mutex);
-					return SWITCH_STATUS_BREAK;
-				}
-			} 
+	ah->private_info = context;
+	context->reuse_pool = pool != ah->memory_pool ? pool : NULL;
+	context->session = session;
+	if (session) {
+		context->channel_uuid = switch_core_strdup(pool, switch_core_session_get_uuid(session));
+	}
 
+	if ((status = whisper_asr_setup(context, pool, ah->native_rate, dest)) != SWITCH_STATUS_SUCCESS) {
+		if (context->reuse_pool) {
+			ah->private_info = NULL;
+			switch_core_destroy_memory_pool(&pool);
 		}
+		return status;
+	}
 
-		if (vad_state == SWITCH_VAD_STATE_STOP_TALKING || switch_test_flag(context, ASRFLAG_TIMEOUT)) {
-			switch_status_t ws_status;
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "ASR opened\n");
 
-			whisper_fire_event(context, "whisper::asr_stop_talking");
+	if ((context->two_pass = context->profile->two_pass)) {
+		whisper_fast_open(context);
+	}
 
-			ws_status = whisper_get_final_transcription(context);
-			
-			if (ws_status != SWITCH_STATUS_SUCCESS) {
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sendig data for transcription failed\n");
+	if (context->session) {
+		whisper_language_hint(context);
+	}
 
-				switch_mutex_unlock(context->mutex);
+	whisper_reset_vad(context);
 
-				return SWITCH_STATUS_BREAK;
-			}
-			
-			// set vad flags to stop detection
-			switch_set_flag(context, ASRFLAG_RESULT_PENDING);
-			switch_vad_reset(context->vad);
-			switch_clear_flag(context, ASRFLAG_READY);
-		} else if (vad_state == SWITCH_VAD_STATE_START_TALKING) {
-			
-			whisper_fire_event(context, "whisper::asr_start_talking");
+	return status;
+}
 
-			switch_set_flag(context, ASRFLAG_START_OF_SPEECH);
-			context->speech_time = switch_micro_time_now();
-		}
+/* media thread: the registry decides between the text and its id, the text alone if it could not be cached */
+static switch_status_t whisper_grammar_send(whisper_t *context)
+{
+	char *req;
+
+	if (context->grammar_ref) {
+		req = whisper_grammar_request(context->grammar_ref, context->profile->asr_server_url, context->pool);
+	} else {
+		switch_stream_handle_t stream = { 0 };
+
+		SWITCH_STANDARD_STREAM(stream);
+		stream.write_function(&stream, "{\"grammar\": ");
+		whisper_json_write_string(&stream, context->grammar, strlen(context->grammar));
+		stream.write_function(&stream, "}");
+		req = switch_core_strdup(context->pool, (char *) stream.data);
+		switch_safe_free(stream.data);
 	}
 
-	switch_mutex_unlock(context->mutex);
-	
-	return SWITCH_STATUS_SUCCESS;
+	/* queued behind any buffered audio and sent from the lws thread, so it lives in the session pool */
+	return ws_asr_queue_text(context, req);
 }
 
-static switch_status_t whisper_pause(switch_asr_handle_t *ah)
+/* the fast connection shares the registry entry, it holds no reference of its own */
+static void whisper_fast_grammar(whisper_t *context)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
+	if (!context->fast || !context->grammar) {
+		return;
+	}
 
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_pause attempt on CLOSED asr handle\n");
-		return SWITCH_STATUS_FALSE;
+	context->fast->grammar = context->grammar;
+	context->fast->grammar_ref = context->grammar_ref;
+
+	if ((context->closed_set || context->two_pass) && whisper_grammar_send(context->fast) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to send grammar to the fast profile\n");
+	}
+}
+
+/* media thread: the utterance so far is kept for the fallback, and sent to the fast connection while routed */
+static switch_status_t whisper_route_audio(whisper_t *context, const void *data, switch_size_t len)
+{
+	switch_size_t n = switch_min(len, context->replay_max - context->replay_len);
+
+	memcpy(context->replay + context->replay_len, data, n);
+	context->replay_len += n;
+
+	return context->routed ? ws_asr_queue_audio(context->fast, data, len) : SWITCH_STATUS_SUCCESS;
+}
+
+/* sends as much of the replay as the ring takes, and the eof once all of it went and the turn has ended */
+static void whisper_route_replay(whisper_t *context)
+{
+	switch_size_t len = switch_min(context->replay_len - context->replay_pos, whisper_ring_space(context->audio_ring) & ~(switch_size_t) 1);
+
+	if (len && ws_asr_queue_audio(context, context->replay + context->replay_pos, len) == SWITCH_STATUS_SUCCESS) {
+		context->replay_pos += len;
+	}
+
+	if (context->replay_pos < context->replay_len) {
+		return;
+	}
+
+	context->replaying = 0;
+
+	if ((whisper_state(context) & ASRFLAG_RESULT_PENDING) && whisper_get_final_transcription(context) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Sending the replayed turn for transcription failed\n");
+	}
+}
+
+static void whisper_route_fallback(whisper_t *context, const char *reason)
+{
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_INFO, "Closed-set turn falls back to %s: %s\n", context->profile->name, reason);
+
+	whisper_transition(context->fast, WHISPER_T_PAUSE);
+	context->routed = 0;
+	context->replaying = 1;
+	context->replay_pos = 0;
+	context->route = "fallback";
+	whisper_route_replay(context);
+}
+
+/* a turn answered on the fast connection: its sent and received stamps are the ones that count */
+static void whisper_stamps_copy(whisper_t *context, whisper_t *fast)
+{
+	context->stamps.last_sent = fast->stamps.last_sent;
+	context->stamps.eof_sent = fast->stamps.eof_sent;
+	context->stamps.result = fast->stamps.result;
+}
+
+/* media thread, every frame of a routed turn: takes the fast result once the turn has ended */
+static void whisper_route_check(whisper_t *context)
+{
+	whisper_t *fast = context->fast;
+	whisper_result_t *result;
+	uint32_t min = context->profile->fast_min_confidence;
+
+	if (context->replaying) {
+		whisper_route_replay(context);
+		return;
+	}
+
+	if (!(whisper_state(fast) & ASRFLAG_RESULT_READY)) {
+		if (fast->started != WS_STATE_STARTED) {
+			whisper_route_fallback(context, "connection lost");
+		}
+		return;
+	}
+
+	if (!(whisper_state(context) & ASRFLAG_RESULT_PENDING)) {
+		return;
+	}
+
+	result = whisper_result_take(fast);
+	whisper_transition(fast, WHISPER_T_PAUSE);
+
+	if (!result || (result->reply.best.confidence >= 0 && result->reply.best.confidence < min)) {
+		whisper_route_fallback(context, result ? "low confidence" : "no result");
+		return;
+	}
+
+	/* drops a reply this connection published earlier, get_results keeps the fast one */
+	whisper_result_take(context);
+	whisper_stamps_copy(context, fast);
+	context->result = result;
+	context->routed = 0;
+	whisper_transition(context, WHISPER_T_RESULT);
+}
+
+static void whisper_correction_event(whisper_t *context, whisper_result_t *result)
+{
+	whisper_event_t *ev;
+
+	context->corrections++;
+
+	if (!(ev = whisper_event_alloc())) {
+		return;
+	}
+
+	ev->subclass = "whisper::correction";
+	switch_copy_string(ev->uuid, switch_str_nil(context->channel_uuid), sizeof(ev->uuid));
+	whisper_event_header(ev, "Correction-Seq", "%u", context->corrections);
+	if (result->reply.best.confidence >= 0) {
+		whisper_event_header(ev, "Transcription-Confidence", "%.1f", result->reply.best.confidence);
+	}
+	whisper_event_body(ev, result->reply.best.text, result->reply.best.len);
+	whisper_event_queue(ev);
+}
+
+/*
+ * media thread, every frame of a two-pass session. The fast reply of the turn is returned as the
+ * result when it is confident enough and as a partial otherwise. FAST_RESULT stays set until the
+ * turn is reset, and denies RESULT: the accurate reply that follows is published by the lws thread
+ * without raising RESULT_READY, and replaces the fast one if get_results has not run yet,
+ * otherwise it is fired as a correction.
+ */
+static void whisper_refine_check(whisper_t *context)
+{
+	whisper_t *fast = context->fast;
+	whisper_result_t *result;
+	uint32_t state;
+
+	if (__atomic_exchange_n(&context->refined, 0, __ATOMIC_ACQ_REL)) {
+		state = whisper_state(context);
+		if ((state & ASRFLAG_RESULT_READY) && !(state & ASRFLAG_RETURNED_RESULT)) {
+			context->route = "refined";
+		} else if ((result = whisper_result_take(context))) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Correction: %.*s\n", (int) result->reply.best.len, result->reply.best.text);
+			whisper_correction_event(context, result);
+		}
+	}
+
+	if (!context->refining || !(whisper_state(fast) & ASRFLAG_RESULT_READY)) {
+		return;
+	}
+
+	state = whisper_state(context);
+	if (!(state & ASRFLAG_RESULT_PENDING)) {
+		/* the accurate reply came first, or the turn ended without one */
+		if (state & (ASRFLAG_RESULT_READY | ASRFLAG_RETURNED_RESULT | ASRFLAG_RESULT_TIMEOUT)) {
+			context->refining = 0;
+			whisper_transition(fast, WHISPER_T_PAUSE);
+		}
+		return;
+	}
+
+	context->refining = 0;
+	result = whisper_result_take(fast);
+	whisper_transition(fast, WHISPER_T_PAUSE);
+
+	if (!result) {
+		return;
+	}
+
+	context->result = result;
+
+	if (result->reply.best.confidence < 0 || result->reply.best.confidence >= context->profile->fast_min_confidence) {
+		/* fails when the accurate reply raised RESULT_READY since, get_results takes that one */
+		if (whisper_transition(context, WHISPER_T_FAST_RESULT)) {
+			context->route = "fast";
+			whisper_stamps_copy(context, fast);
+		}
+	} else {
+		whisper_transition(context, WHISPER_T_FAST_PARTIAL);
+	}
+}
+
+static switch_status_t whisper_load_grammar(switch_asr_handle_t *ah, const char *grammar, const char *name)
+{
+	whisper_t *context = (whisper_t *)ah->private_info;
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_open attempt on CLOSED asr handle\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "load grammar %s\n", grammar);
+	context->grammar = switch_core_strdup(ah->memory_pool, grammar);
+
+	/* the same grammar every turn is one hash lookup and an id on the wire */
+	whisper_grammar_unref(&context->grammar_ref);
+	context->grammar_ref = whisper_grammar_ref(grammar);
+
+	if (whisper_grammar_send(context) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to send grammar to websocket server\n");
+	}
+
+	context->closed_set = context->grammar_ref ? whisper_grammar_closed_set(context->grammar_ref) : whisper_grammar_classify(grammar);
+	if (context->closed_set) {
+		whisper_fast_open(context);
+	}
+	whisper_fast_grammar(context);
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Grammar is %s (%u alternatives)\n",
+					  context->closed_set ? "closed-set" : "free-form", context->closed_set);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_unload_grammar(switch_asr_handle_t *ah, const char *name)
+{
+	whisper_t *context = (whisper_t *)ah->private_info;
+
+	if (context->fast) {
+		context->fast->grammar_ref = NULL;
+	}
+	context->closed_set = 0;
+	whisper_grammar_unref(&context->grammar_ref);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static int whisper_ms_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* the channel's totals, allocated in the session pool by the first handle closing on it */
+static whisper_summary_t *whisper_summary_get(switch_core_session_t *session)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	whisper_summary_t *sum;
+
+	if (!(sum = switch_channel_get_private(channel, WHISPER_SUMMARY_PRIVATE))) {
+		sum = switch_core_session_alloc(session, sizeof(*sum));
+		switch_channel_set_private(channel, WHISPER_SUMMARY_PRIVATE, sum);
+	}
+
+	return sum;
+}
+
+/* what the connection did since its last close, a parked and reused one is summarized at every close */
+static void whisper_summary_add(whisper_summary_t *sum, whisper_t *context, int fast)
+{
+	whisper_summary_mark_t *mark = &context->summarized;
+	uint32_t i = context->results_timed > WHISPER_SUMMARY_TURNS ? context->results_timed - WHISPER_SUMMARY_TURNS : 0;
+
+	if (!mark->connected) {
+		mark->connected = 1;
+		sum->connects++;
+		sum->connect_ms_max = switch_max(sum->connect_ms_max, context->connect_ms);
+	}
+
+	sum->utterances += context->utterances - mark->utterances;
+	sum->audio_sec += (double) (context->audio_bytes - mark->audio_bytes) / (context->rate * 2 * context->channels);
+	if (fast) {
+		sum->fast_bytes_sent += context->bytes_sent - mark->bytes_sent;
+		sum->fast_bytes_recv += context->bytes_recv - mark->bytes_recv;
+	} else {
+		sum->bytes_sent += context->bytes_sent - mark->bytes_sent;
+		sum->bytes_recv += context->bytes_recv - mark->bytes_recv;
+	}
+	sum->dropped_frames += context->dropped_frames - mark->dropped_frames;
+
+	for (i = switch_max(i, mark->results_timed); i < context->results_timed; i++) {
+		sum->result_ms[sum->results_timed++ % WHISPER_SUMMARY_TURNS] = context->result_ms[i % WHISPER_SUMMARY_TURNS];
+	}
+
+	mark->utterances = context->utterances;
+	mark->audio_bytes = context->audio_bytes;
+	mark->bytes_sent = context->bytes_sent;
+	mark->bytes_recv = context->bytes_recv;
+	mark->dropped_frames = context->dropped_frames;
+	mark->results_timed = context->results_timed;
+}
+
+/* for the CDR, the totals of every handle of the call so far */
+static void whisper_summary_set(switch_channel_t *channel, whisper_summary_t *sum)
+{
+	uint32_t n = switch_min(sum->results_timed, WHISPER_SUMMARY_TURNS);
+	uint32_t sorted[WHISPER_SUMMARY_TURNS];
+
+	if (sum->connects) {
+		switch_channel_set_variable_printf(channel, "whisper_asr_utterances", "%u", sum->utterances);
+		switch_channel_set_variable_printf(channel, "whisper_asr_audio_sec", "%.1f", sum->audio_sec);
+		switch_channel_set_variable_printf(channel, "whisper_asr_bytes_sent", "%" SWITCH_SIZE_T_FMT, sum->bytes_sent);
+		switch_channel_set_variable_printf(channel, "whisper_asr_bytes_received", "%" SWITCH_SIZE_T_FMT, sum->bytes_recv);
+		if (sum->fast_bytes_sent || sum->fast_bytes_recv) {
+			switch_channel_set_variable_printf(channel, "whisper_asr_fast_bytes_sent", "%" SWITCH_SIZE_T_FMT, sum->fast_bytes_sent);
+			switch_channel_set_variable_printf(channel, "whisper_asr_fast_bytes_received", "%" SWITCH_SIZE_T_FMT, sum->fast_bytes_recv);
+		}
+		switch_channel_set_variable_printf(channel, "whisper_asr_connects", "%u", sum->connects);
+		switch_channel_set_variable_printf(channel, "whisper_asr_connect_ms", "%u", sum->connect_ms_max);
+		switch_channel_set_variable_printf(channel, "whisper_asr_dropped_frames", "%u", sum->dropped_frames);
+	}
+
+	if (n) {
+		memcpy(sorted, sum->result_ms, n * sizeof(sorted[0]));
+		qsort(sorted, n, sizeof(sorted[0]), whisper_ms_cmp);
+		switch_channel_set_variable_printf(channel, "whisper_asr_result_p50_ms", "%u", sorted[n / 2]);
+		switch_channel_set_variable_printf(channel, "whisper_asr_result_max_ms", "%u", sorted[n - 1]);
+	}
+
+	if (sum->tts_requests) {
+		switch_channel_set_variable_printf(channel, "whisper_tts_requests", "%u", sum->tts_requests);
+		switch_channel_set_variable_printf(channel, "whisper_tts_bytes_received", "%" SWITCH_SIZE_T_FMT, sum->tts_bytes_recv);
+		if (sum->ttfb_count) {
+			switch_channel_set_variable_printf(channel, "whisper_tts_ttfb_ms", "%" SWITCH_TIME_T_FMT, sum->ttfb_total_ms / sum->ttfb_count);
+			switch_channel_set_variable_printf(channel, "whisper_tts_ttfb_max_ms", "%u", sum->ttfb_max_ms);
+		}
+	}
+}
+
+/* the fast connection of closed-set routing or two-pass is counted apart, the audio was the caller's once */
+static void whisper_summary(whisper_t *context)
+{
+	whisper_summary_t *sum = whisper_summary_get(context->session);
+
+	whisper_summary_add(sum, context, 0);
+	if (context->fast) {
+		whisper_summary_add(sum, context->fast, 1);
+	}
+
+	whisper_summary_set(switch_core_session_get_channel(context->session), sum);
+}
+
+static switch_status_t whisper_close(switch_asr_handle_t *ah, switch_asr_flag_t *flags)
+{
+	whisper_t *context = (whisper_t *)ah->private_info;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "ASR close!\n");
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Double ASR close!\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	whisper_grammar_unref(&context->grammar_ref);
+
+	/* kept for the channel's next handle while the call is up and the server owes it nothing */
+	if (context->reuse_pool && context->profile->reuse_idle_ms && switch_channel_up_nosig(switch_core_session_get_channel(context->session)) &&
+		context->started == WS_STATE_STARTED && !context->wc_error && whisper_quiescent(context)) {
+		whisper_cancel_timers(context);
+		whisper_transition(context, WHISPER_T_PAUSE);
+		if (context->fast) {
+			context->fast->grammar_ref = NULL;
+			whisper_transition(context->fast, WHISPER_T_PAUSE);
+		}
+
+		/* what it did so far, the next close on this connection adds the rest */
+		whisper_summary(context);
+
+		switch_mutex_lock(context->mutex);
+		switch_set_flag(ah, SWITCH_ASR_FLAG_CLOSED);
+		switch_mutex_unlock(context->mutex);
+
+		whisper_slot_park(context, context->profile->reuse_idle_ms);
+		return status;
+	}
+
+	whisper_asr_teardown(context);
+
+	/* the lws threads are joined, the counters are final */
+	if (context->session) {
+		whisper_summary(context);
+	}
+
+	switch_mutex_lock(context->mutex);
+	switch_set_flag(ah, SWITCH_ASR_FLAG_CLOSED);
+	switch_mutex_unlock(context->mutex);
+
+	if (context->reuse_pool) {
+		switch_memory_pool_t *pool = context->reuse_pool;
+
+		switch_core_destroy_memory_pool(&pool);
+	}
+	return status;
+}
+
+/* uplink conditioning ahead of VAD and send, works on a copy so the caller's frame is left untouched */
+static void *whisper_preprocess(whisper_t *context, void *data, unsigned int len)
+{
+	uint32_t samples = len / sizeof(int16_t);
+
+	if ((!context->hpf.enabled && !context->ns.enabled && !context->agc.enabled) || len > sizeof(context->dsp_buf)) {
+		return data;
+	}
+
+	memcpy(context->dsp_buf, data, len);
+	whisper_hpf_process(&context->hpf, context->dsp_buf, samples, context->rate);
+	whisper_ns_process(&context->ns, context->dsp_buf, samples);
+	whisper_agc_process(&context->agc, context->dsp_buf, samples, context->rate);
+
+	return context->dsp_buf;
+}
+
+/*
+ * Barge-in fast path, on the media bug of the session reading the caller. CF_BREAK is picked up by
+ * the playback loop of this same session on its next frame, so nothing goes through the event
+ * system or a session lookup before the prompt stops.
+ */
+static void whisper_barge_in(whisper_t *context)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(context->session);
+	switch_time_t now = switch_micro_time_now();
+	whisper_event_t *ev;
+
+	switch_channel_set_flag(channel, CF_BREAK);
+
+	/* the energy run started this far back, give or take the frame that completed it */
+	context->barge_onset = now - (switch_time_t) context->onset.run_samples * 1000000 / context->rate;
+	context->barge_at = now;
+
+	/* reported afterwards, through the dispatcher */
+	if ((ev = whisper_event_alloc())) {
+		ev->subclass = "whisper::barge_in";
+		switch_copy_string(ev->uuid, switch_core_session_get_uuid(context->session), sizeof(ev->uuid));
+		whisper_event_header(ev, "Barge-In-Detect-Ms", "%" SWITCH_TIME_T_FMT, (now - context->barge_onset) / 1000);
+		whisper_event_queue(ev);
+	}
+}
+
+/* the frames after a barge-in: report when the playback let go of CF_BREAK, or drop it if nothing was playing */
+static void whisper_barge_in_check(whisper_t *context)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(context->session);
+	switch_time_t now = switch_micro_time_now();
+
+	if (!switch_channel_test_flag(channel, CF_BREAK)) {
+		switch_time_t detect_ms = (context->barge_at - context->barge_onset) / 1000;
+		switch_time_t stop_ms = (now - context->barge_onset) / 1000;
+
+		switch_channel_set_variable_printf(channel, "whisper_barge_in_detect_ms", "%" SWITCH_TIME_T_FMT, detect_ms);
+		switch_channel_set_variable_printf(channel, "whisper_barge_in_stop_ms", "%" SWITCH_TIME_T_FMT, stop_ms);
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_INFO, "Barge-in: onset detected after %" SWITCH_TIME_T_FMT "ms, playback stopped %" SWITCH_TIME_T_FMT "ms after onset\n",
+						  detect_ms, stop_ms);
+		context->barge_at = 0;
+	} else if (now - context->barge_at > BARGE_IN_WAIT_MS * 1000) {
+		/* left set it would cut the next prompt */
+		switch_channel_clear_flag(channel, CF_BREAK);
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Barge-in: nothing was playing\n");
+		context->barge_at = 0;
+	}
+}
+
+static switch_status_t whisper_feed(switch_asr_handle_t *ah, void *data, unsigned int len, switch_asr_flag_t *flags)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+	switch_vad_state_t vad_state;
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		return SWITCH_STATUS_BREAK;
+	}
+
+	if ((whisper_state(context) & ASRFLAG_RETURNED_RESULT) && switch_test_flag(ah, SWITCH_ASR_FLAG_AUTO_RESUME)) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Auto Resuming\n");
+		whisper_reset_vad(context);
+	}
+
+	switch_mutex_lock(context->mutex);
+
+	if (context->barge_at) {
+		whisper_barge_in_check(context);
+	}
+
+	if (context->grammar_resend) {
+		context->grammar_resend = 0;
+		if (context->grammar && whisper_grammar_send(context) != SWITCH_STATUS_SUCCESS) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unable to send grammar to websocket server\n");
+		}
+	}
+
+	if (context->fast && context->fast->grammar_resend) {
+		context->fast->grammar_resend = 0;
+		if (context->fast->grammar_ref && whisper_grammar_send(context->fast) != SWITCH_STATUS_SUCCESS) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unable to send grammar to the fast profile\n");
+		}
+	}
+
+	if (context->routed || context->replaying) {
+		whisper_route_check(context);
+	}
+
+	if (context->two_pass && context->fast) {
+		whisper_refine_check(context);
+	}
+
+	if (whisper_state(context) & ASRFLAG_READY) {
+
+		/* on the raw frame, the noise suppressor would add its delay */
+		if (context->session && whisper_onset_process(&context->onset, data, len / sizeof(int16_t), context->rate)) {
+			whisper_barge_in(context);
+		}
+
+		data = whisper_preprocess(context, data, len);
+
+		vad_state = switch_vad_process(context->vad, (int16_t *)data, len / sizeof(uint16_t));
+		
+		if (vad_state == SWITCH_VAD_STATE_TALKING) {
+
+			/* the hangover runs from the last frame over the VAD threshold */
+			if (whisper_dsp_energy((int16_t *) data, len / sizeof(int16_t)) >= (float) context->thresh * context->thresh) {
+				context->stamps.last_voice = switch_time_ref();
+			}
+
+			if (context->started != WS_STATE_STARTED) {
+				whisper_fire_event(context, "whisper::asr_connection_error");
+				switch_mutex_unlock(context->mutex);
+				return SWITCH_STATUS_BREAK; 
+			}
+
+			/* the lws thread frames and sends it, a full ring means the connection is stalled */
+			if ((context->routed || context->replaying ? whisper_route_audio(context, data, len) : ws_asr_queue_audio(context, data, len)) != SWITCH_STATUS_SUCCESS) {
+				switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "Audio ring full, dropping %u bytes\n", len);
+				context->dropped_frames++;
+			} else {
+				context->audio_bytes += len;
+				whisper_capture_audio(context->capture, data, len);
+			}
+
+			/* a stalled fast connection only costs the early answer of this turn */
+			if (context->refining && ws_asr_queue_audio(context->fast, data, len) != SWITCH_STATUS_SUCCESS) {
+				switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "Fast ring full, turn left to %s\n", context->profile->name);
+				context->refining = 0;
+			}
+
+		}
+
+		if (vad_state == SWITCH_VAD_STATE_STOP_TALKING || (whisper_state(context) & ASRFLAG_TIMEOUT)) {
+			switch_status_t ws_status;
+
+			context->stamps.vad_stop = switch_time_ref();
+			context->utterances++;
+
+			/* cut by the speech timeout, the VAD never waited out a silence */
+			if (whisper_state(context) & ASRFLAG_TIMEOUT) {
+				context->stamps.last_voice = 0;
+			}
+
+			whisper_fire_event(context, "whisper::asr_stop_talking");
+			whisper_capture_mark(context->capture, WHISPER_CAPTURE_STOP, (whisper_state(context) & ASRFLAG_TIMEOUT) ? "timeout" : "vad");
+
+			/* a routed turn gets its eof on the fast connection, a replay sends it once it is through */
+			if (context->routed && whisper_get_final_transcription(context->fast) != SWITCH_STATUS_SUCCESS) {
+				whisper_route_fallback(context, "eof not sent");
+			}
+			if (context->refining && whisper_get_final_transcription(context->fast) != SWITCH_STATUS_SUCCESS) {
+				context->refining = 0;
+			}
+			ws_status = context->routed || context->replaying ? SWITCH_STATUS_SUCCESS : whisper_get_final_transcription(context);
+			
+			if (ws_status != SWITCH_STATUS_SUCCESS) {
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sendig data for transcription failed\n");
+
+				switch_mutex_unlock(context->mutex);
+
+				return SWITCH_STATUS_BREAK;
+			}
+			
+			// set vad flags to stop detection
+			switch_vad_reset(context->vad);
+			whisper_timer_cancel(&context->speech_timer);
+			if (whisper_transition(context, WHISPER_T_END_OF_SPEECH) && context->result_timeout > 0) {
+				whisper_timer_arm(&context->result_timer, context->result_timeout);
+			}
+		} else if (vad_state == SWITCH_VAD_STATE_START_TALKING) {
+
+			/* the VAD starts voice_ms into the speech */
+			memset(&context->stamps, 0, sizeof(context->stamps));
+			context->stamps.onset = switch_time_ref() - (switch_time_t) context->voice_ms * 1000;
+			context->stamps.last_voice = switch_time_ref();
+			
+			whisper_fire_event(context, "whisper::asr_start_talking");
+			whisper_capture_mark(context->capture, WHISPER_CAPTURE_START, NULL);
+
+			context->speech_time = switch_micro_time_now();
+			whisper_timer_cancel(&context->noinput_timer);
+
+			if (context->fast && context->fast->started == WS_STATE_STARTED && !context->replaying) {
+				context->refining = context->two_pass;
+				context->routed = !context->two_pass && context->closed_set;
+				context->replay_len = 0;
+				whisper_transition(context->fast, WHISPER_T_PAUSE);
+				whisper_result_take(context->fast);
+			}
+			context->route = context->routed ? "fast" : context->fast ? "accurate" : NULL;
+
+			if (whisper_transition(context, WHISPER_T_START_OF_SPEECH) && context->speech_timeout > 0) {
+				whisper_timer_arm(&context->speech_timer, context->speech_timeout);
+			}
+		}
+	}
+
+	switch_mutex_unlock(context->mutex);
+	
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_pause(switch_asr_handle_t *ah)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_pause attempt on CLOSED asr handle\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Pausing\n");
+
+	whisper_cancel_timers(context);
+	whisper_transition(context, WHISPER_T_PAUSE);
+	if (context->fast) {
+		whisper_transition(context->fast, WHISPER_T_PAUSE);
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_resume(switch_asr_handle_t *ah)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_resume attempt on CLOSED asr handle\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Resuming\n");
+	whisper_reset_vad(context);
+	
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* polled from the media thread on every frame: one load of the state word, the timeouts are raised by the timer wheel */
+static switch_status_t whisper_check_results(switch_asr_handle_t *ah, switch_asr_flag_t *flags)
+{
+	uint32_t state;
+
+	/* first, a closed handle's context may be parked for another one or gone */
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		return SWITCH_STATUS_BREAK;
+	}
+
+	state = whisper_state((whisper_t *) ah->private_info);
+
+	/* a pending turn can only have the two-pass fast partial to return */
+	if ((state & ASRFLAG_RETURNED_RESULT) || (state & (ASRFLAG_RESULT_PENDING | ASRFLAG_PARTIAL_READY)) == ASRFLAG_RESULT_PENDING) {
+		return SWITCH_STATUS_BREAK;
+	}
+
+	if ((state & (ASRFLAG_START_OF_SPEECH | ASRFLAG_RETURNED_START_OF_SPEECH)) == ASRFLAG_START_OF_SPEECH) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	if (state & (ASRFLAG_RESULT_READY | ASRFLAG_NOINPUT_TIMEOUT | ASRFLAG_RESULT_TIMEOUT | ASRFLAG_PARTIAL_READY)) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	return SWITCH_STATUS_BREAK;
+}
+
+static void whisper_nlsml_interpretation(switch_stream_handle_t *stream, const char *grammar, const char *text, switch_size_t len, double confidence)
+{
+	stream->write_function(stream, "  <interpretation grammar=\"");
+	whisper_xml_write_string(stream, grammar, strlen(grammar));
+	stream->write_function(stream, "\" confidence=\"%d\">\n    <instance>", (int) (confidence + 0.5));
+	whisper_xml_write_string(stream, text, len);
+	stream->write_function(stream, "</instance>\n    <input mode=\"speech\">");
+	whisper_xml_write_string(stream, text, len);
+	stream->write_function(stream, "</input>\n  </interpretation>\n");
+}
+
+/* the reply in the return-json format, built straight from the scanned slot */
+static char *whisper_result_format(whisper_t *context)
+{
+	switch_stream_handle_t stream = { 0 };
+	whisper_reply_t *reply = context->result ? &context->result->reply : NULL;
+	const char *grammar = switch_str_nil(context->grammar);
+	const char *text = reply ? reply->best.text : context->result_text;
+	switch_size_t len = reply ? reply->best.len : strlen(text);
+	double confidence = reply && reply->best.confidence >= 0 ? reply->best.confidence : context->result_confidence;
+	uint32_t i;
+
+	if (context->return_json == WHISPER_RETURN_TEXT) {
+		return switch_mprintf("%.*s", (int) len, text);
+	}
+
+	SWITCH_STANDARD_STREAM(stream);
+
+	if (context->return_json == WHISPER_RETURN_NLSML) {
+		stream.write_function(&stream, "<?xml version=\"1.0\"?>\n<result grammar=\"");
+		whisper_xml_write_string(&stream, grammar, strlen(grammar));
+		stream.write_function(&stream, "\">\n");
+		whisper_nlsml_interpretation(&stream, grammar, text, len, confidence);
+		for (i = 0; reply && i < reply->nbest_count; i++) {
+			whisper_nlsml_interpretation(&stream, grammar, reply->nbest[i].text, reply->nbest[i].len, switch_max(reply->nbest[i].confidence, 0));
+		}
+		stream.write_function(&stream, "</result>\n");
+
+		return stream.data;
+	}
+
+	stream.write_function(&stream, "{\"grammar\": ");
+	whisper_json_write_string(&stream, grammar, strlen(grammar));
+	stream.write_function(&stream, ", \"text\": ");
+	whisper_json_write_string(&stream, text, len);
+	stream.write_function(&stream, ", \"confidence\": %f", confidence);
+
+	if (reply && reply->language) {
+		stream.write_function(&stream, ", \"language\": ");
+		whisper_json_write_string(&stream, reply->language, strlen(reply->language));
+	}
+	if (reply && reply->start >= 0 && reply->end >= 0) {
+		stream.write_function(&stream, ", \"start\": %.3f, \"end\": %.3f", reply->start, reply->end);
+	}
+	if (reply && reply->nbest_count) {
+		stream.write_function(&stream, ", \"alternatives\": [");
+		for (i = 0; i < reply->nbest_count; i++) {
+			stream.write_function(&stream, "%s{\"text\": ", i ? ", " : "");
+			whisper_json_write_string(&stream, reply->nbest[i].text, reply->nbest[i].len);
+			stream.write_function(&stream, ", \"confidence\": %f}", switch_max(reply->nbest[i].confidence, 0));
+		}
+		stream.write_function(&stream, "]");
+	}
+	stream.write_function(&stream, "}");
+
+	return stream.data;
+}
+
+/* no input and result timeout, in the return-json format: no text, the error object, or an NLSML noinput/nomatch */
+static char *whisper_result_error(whisper_t *context, const char *error)
+{
+	switch_stream_handle_t stream = { 0 };
+	const char *grammar = switch_str_nil(context->grammar);
+
+	if (context->return_json == WHISPER_RETURN_TEXT) {
+		return strdup("");
+	}
+
+	if (context->return_json == WHISPER_RETURN_NLSML) {
+		return switch_mprintf("<?xml version=\"1.0\"?>\n<result>\n  <interpretation>\n    <input>\n      <%s/>\n    </input>\n  </interpretation>\n</result>\n",
+							  !strcmp(error, "no_input") ? "noinput" : "nomatch");
+	}
+
+	SWITCH_STANDARD_STREAM(stream);
+
+	stream.write_function(&stream, "{\"grammar\": ");
+	whisper_json_write_string(&stream, grammar, strlen(grammar));
+	stream.write_function(&stream, ", \"text\": \"\", \"confidence\": 0, \"error\": \"%s\"}", error);
+
+	return stream.data;
+}
+
+static switch_status_t whisper_get_results(switch_asr_handle_t *ah, char **resultstr, switch_asr_flag_t *flags)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	uint32_t state = whisper_state(context);
+
+	if ((state & ASRFLAG_RETURNED_RESULT) || switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (state & ASRFLAG_RESULT_READY) {
+		whisper_result_t *result;
+
+		/* published before RESULT_READY was raised, so the reply that raised it is there */
+		if ((result = whisper_result_take(context))) {
+			context->result = result;
+		}
+
+		*resultstr = whisper_result_format(context);
+
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_NOTICE, "Final Result: %s\n", *resultstr);
+
+		/* the latency breakdown of the turn goes out with whisper::asr_result */
+		context->stamps.consumed = switch_time_ref();
+		whisper_fire_event(context, "whisper::asr_result");
+
+		if (context->result && context->result->reply.language) {
+			whisper_language_learn(context->caller, context->result->reply.language);
+		}
+
+		if (context->stamps.vad_stop && context->stamps.result >= context->stamps.vad_stop) {
+			context->result_ms[context->results_timed++ % WHISPER_SUMMARY_TURNS] = (uint32_t) ((context->stamps.result - context->stamps.vad_stop) / 1000);
+		}
+
+		status = SWITCH_STATUS_SUCCESS;
+	} else if (state & ASRFLAG_NOINPUT_TIMEOUT) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Result: NO INPUT\n");
+
+		*resultstr = whisper_result_error(context, "no_input");
+
+		status = SWITCH_STATUS_SUCCESS;
+	} else if (state & ASRFLAG_RESULT_TIMEOUT) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Result: RESULT TIMEOUT\n");
+
+		*resultstr = whisper_result_error(context, "result_timeout");
+
+		status = SWITCH_STATUS_SUCCESS;
+	} else if (whisper_transition(context, WHISPER_T_RETURN_START)) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Result: START OF SPEECH\n");
+		status = SWITCH_STATUS_BREAK;
+	} else if (whisper_transition(context, WHISPER_T_RETURN_PARTIAL)) {
+		whisper_result_t *result;
+
+		/* a partial is published before PARTIAL_READY is raised, like a final */
+		if ((result = whisper_result_take(context))) {
+			context->result = result;
+		}
+
+		*resultstr = whisper_result_format(context);
+
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Partial Result: %s\n", *resultstr);
+
+		status = SWITCH_STATUS_MORE_DATA;
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unexpected call to asr_get_results - no results to return!\n");
+		status = SWITCH_STATUS_FALSE;
+	}
+	
+	if (status == SWITCH_STATUS_SUCCESS) {
+		whisper_transition(context, WHISPER_T_RETURN_RESULT);
+	}
+
+	return status;
+}
+
+static switch_status_t whisper_start_input_timers(switch_asr_handle_t *ah)
+{
+	whisper_t *context = (whisper_t *) ah->private_info;
+
+	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_start_input_timers attempt on CLOSED asr handle\n");
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "start_input_timers\n");
+
+	if (!(whisper_state(context) & ASRFLAG_INPUT_TIMERS)) {
+		context->no_input_time = switch_micro_time_now();
+		whisper_transition(context, WHISPER_T_INPUT_TIMERS);
+		whisper_arm_noinput(context);
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_INFO, "Input timers already started\n");
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+void whisper_set_param(whisper_t *context, const char *param, const char *val)
+{
+
+	if (!zstr(param) && !zstr(val)) {
+		int nval = atoi(val);
+		double fval = atof(val);
+
+		if (!strcasecmp("no-input-timeout", param) && switch_is_number(val)) {
+			context->no_input_timeout = nval;
+			whisper_arm_noinput(context);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "no-input-timeout = %d\n", context->no_input_timeout);
+		} else if (!strcasecmp("speech-timeout", param) && switch_is_number(val)) {
+			context->speech_timeout = nval;
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "speech-timeout = %d\n", context->speech_timeout);
+		} else if (!strcasecmp("result-timeout", param) && switch_is_number(val)) {
+			context->result_timeout = nval;
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "result-timeout = %d\n", context->result_timeout);
+		} else if (!strcasecmp("start-input-timers", param)) {
+			context->start_input_timers = switch_true(val);
+			if (whisper_transition(context, context->start_input_timers ? WHISPER_T_INPUT_TIMERS : WHISPER_T_NO_INPUT_TIMERS)) {
+				context->no_input_time = switch_micro_time_now();
+				whisper_arm_noinput(context);
+			}
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "start-input-timers = %d\n", context->start_input_timers);
+		} else if (!strcasecmp("vad-mode", param)) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "vad-mode = %s\n", val);
+			if (context->vad) switch_vad_set_mode(context->vad, nval);
+		} else if (!strcasecmp("vad-voice-ms", param) && nval > 0) {
+			context->voice_ms = nval;
+			switch_vad_set_param(context->vad, "voice_ms", nval);
+		} else if (!strcasecmp("vad-silence-ms", param) && nval > 0) {
+			context->silence_ms = nval;
+			switch_vad_set_param(context->vad, "silence_ms", nval);
+		} else if (!strcasecmp("vad-thresh", param) && nval > 0) {
+			context->thresh = nval;
+			switch_vad_set_param(context->vad, "thresh", nval);
+		} else if (!strcasecmp("channel-uuid", param)) {
+			context->channel_uuid = switch_core_strdup(context->pool, val);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "channel-uuid = %s\n", val);
+		} else if (!strcasecmp("result", param)) {
+			context->result_text = switch_core_strdup(context->pool, val);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "result = %s\n", val);
+		} else if (!strcasecmp("return-json", param)) {
+			context->return_json = whisper_return_mode(val);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "return-json = %d\n", context->return_json);
+		} else if (!strcasecmp("confidence", param) && fval >= 0.0) {
+			context->result_confidence = fval;
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "confidence = %f\n", fval);
+		} else if (!strcasecmp("record-sent-audio", param)) {
+			whisper_capture_close(&context->capture);
+			if (!switch_false(val)) {
+				context->capture = whisper_capture_open(val, context->channel_uuid, context->rate, context->channels);
+			}
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "record-sent-audio = %s\n", val);
+		} else if (!strcasecmp("chunk-ms", param) && nval > 0) {
+			context->chunk_bytes = switch_min(switch_max(whisper_chunk_bytes(context, nval), context->chunk_min), context->chunk_max);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "chunk = %u bytes\n", context->chunk_bytes);
+		} else if (!strcasecmp("send-mode", param)) {
+			/* the ring was sized for the profile's mode, a stream ring may cut long batch utterances into several frames */
+			context->send_mode = !strcasecmp(val, "batch") ? WHISPER_SEND_BATCH : WHISPER_SEND_STREAM;
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "send-mode = %s\n", val);
+		} else if (!strcasecmp("partial", param)) {
+			context->partial = switch_true(val);
+			whisper_partial_request(context);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "partial = %d\n", context->partial);
+		} else if (!strcasecmp("language", param)) {
+			switch_copy_string(context->language, strcasecmp(val, "auto") ? val : "", sizeof(context->language));
+			whisper_language_request(context);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "language = %s\n", val);
+		} else if (!strcasecmp("event-channel-data", param)) {
+			context->event_channel_data = switch_true(val);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "event-channel-data = %d\n", context->event_channel_data);
+		} else if (!strcasecmp("two-pass", param)) {
+			if ((context->two_pass = switch_true(val))) {
+				whisper_fast_open(context);
+				whisper_fast_grammar(context);
+			}
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "two-pass = %d\n", context->two_pass);
+		} else if (!strcasecmp("partial-ms", param) && nval > 0) {
+			context->partial_interval = nval;
+			whisper_partial_request(context);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "partial-ms = %d\n", nval);
+		} else if (whisper_hpf_set_param(&context->hpf, param, val) || whisper_ns_set_param(&context->ns, param, val) ||
+				   whisper_agc_set_param(&context->agc, param, val) || whisper_onset_set_param(&context->onset, param, val)) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "%s = %s\n", param, val);
+		}
+	}
+}
+
+static void whisper_text_param(switch_asr_handle_t *ah, char *param, const char *val)
+{
+	whisper_set_param((whisper_t *) ah->private_info, param, val);
+}
+
+/* TTS Interface */
+
+/* closes the connection and frees the buffer, and the context's own pool with them when it had one */
+void whisper_tts_free(whisper_tts_t *context)
+{
+	switch_memory_pool_t *pool = context->reuse_pool;
+
+	if (context->lws_context) {
+		ws_tts_close_connection(context);
+	}
+
+	if (context->audio_buffer) {
+		switch_buffer_destroy(&context->audio_buffer);
+	}
+
+	if (pool) {
+		switch_core_destroy_memory_pool(&pool);
+	}
+}
+
+/* the connection whisper_preconnect parked for the channel, if the server has not closed it since */
+static whisper_tts_t *whisper_tts_adopt(const char *uuid)
+{
+	whisper_tts_t *context;
+
+	if (!(context = whisper_slot_take_tts(uuid))) {
+		return NULL;
+	}
+
+	if (context->started != WS_STATE_STARTED || context->wc_error) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(uuid), SWITCH_LOG_DEBUG, "Preconnected TTS connection lost, opening a new one\n");
+		whisper_tts_free(context);
+		return NULL;
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(uuid), SWITCH_LOG_DEBUG, "TTS using the preconnected connection\n");
+
+	return context;
+}
+
+static switch_status_t whisper_speech_open(switch_speech_handle_t *sh, const char *voice_name, int rate, int channels, switch_speech_flag_t *flags)
+{
+	whisper_tts_t *context = NULL;
+	switch_status_t status = SWITCH_STATUS_FALSE;
+	switch_event_t *event = NULL;
+	char * tts_server = NULL;
+	char * session_uuid =  NULL;
+
+	/* check if session is associated w/ this memory pool */
+	switch_core_session_t *session = switch_core_memory_pool_get_data(sh->memory_pool, "__session");
+	if (session) {
+		session_uuid = switch_core_session_get_uuid(session);
+		context = whisper_tts_adopt(session_uuid);
+	}
+
+	if (!context) {
+		context = switch_core_alloc(sh->memory_pool, sizeof(whisper_tts_t));
+	}
+	
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "session-uuid = %s\n", session_uuid);
+	switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "whisper::tts_open");
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "WHISPER-voice", voice_name);
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "WHISPER-uuid", session_uuid);
+	switch_event_fire(&event);
+
+	switch_assert(context);
+
+    if ( voice_name ) {
+        context->voice = switch_core_strdup(sh->memory_pool, voice_name);
+    } else {
+        context->voice = "default";
+    }
+
+	context->samplerate = sh->samplerate;
+
+	sh->private_info = context;
+
+	/* preconnected: buffer and connection are there already */
+	if (context->reuse_pool) {
+		return SWITCH_STATUS_SUCCESS;
+	}
+	
+	context->pool = sh->memory_pool;
+
+	switch_buffer_create_dynamic(&context->audio_buffer, SPEECH_BUFFER_SIZE, SPEECH_BUFFER_SIZE, SPEECH_BUFFER_SIZE_MAX);
+
+	tts_server = switch_core_strdup(context->pool, whisper_globals.tts_server_url);
+
+	/* the lws thread is joined in whisper_speech_close, before the handle's pool goes */
+	status = ws_tts_setup_connection(tts_server, context, context->pool);
+
+	return status;
+}
+
+static switch_status_t whisper_speech_close(switch_speech_handle_t *sh, switch_speech_flag_t *flags)
+{
+	whisper_tts_t *context = (whisper_tts_t *) sh->private_info;
+	switch_core_session_t *session = switch_core_memory_pool_get_data(sh->memory_pool, "__session");
+
+	ws_tts_close_connection(context);
+
+	/* every speak opens a handle of its own, the call's totals are on the channel */
+	if (session && context->requests) {
+		whisper_summary_t *sum = whisper_summary_get(session);
+
+		sum->tts_requests += context->requests;
+		sum->tts_bytes_recv += context->bytes_recv;
+		sum->ttfb_count += context->ttfb_count;
+		sum->ttfb_total_ms += context->ttfb_total_ms;
+		sum->ttfb_max_ms = switch_max(sum->ttfb_max_ms, context->ttfb_max_ms);
+		whisper_summary_set(switch_core_session_get_channel(session), sum);
+	}
+
+	if ( context->audio_buffer ) {
+		switch_buffer_destroy(&context->audio_buffer);
+	}
+
+	if (context->reuse_pool) {
+		switch_memory_pool_t *pool = context->reuse_pool;
+
+		switch_core_destroy_memory_pool(&pool);
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_speech_feed_tts(switch_speech_handle_t *sh, char *text, switch_speech_flag_t *flags)
+{
+	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
+
+	unsigned char buffer[LWS_SEND_BUFFER_PRE_PADDING + strlen(text) + LWS_SEND_BUFFER_POST_PADDING];
+	unsigned char *p = &buffer[LWS_SEND_BUFFER_PRE_PADDING];
+
+	if (switch_true(switch_core_get_variable("mod_whisper_tts_must_have_channel_uuid")) && zstr(context->channel_uuid)) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (!zstr(text)) {
+		context->text = switch_core_strdup(sh->memory_pool, text);
+	}
+
+	memcpy(p, context->text, strlen(context->text));
+
+	context->feed_at = switch_time_ref();
+	context->requests++;
+
+	if (lws_write(context->wsi, p, strlen(context->text), LWS_WRITE_TEXT) < 0) {
+		fprintf(stderr, "Error writing to socket\n");
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Unable to write message\n");
+		return -1;
+	}		
+
+	while ( (!context->audio_buffer || switch_buffer_inuse(context->audio_buffer) == 0) && context->started == WS_STATE_STARTED ) {
+		usleep(30000);
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static switch_status_t whisper_speech_read_tts(switch_speech_handle_t *sh, void *data, switch_size_t *datalen, switch_speech_flag_t *flags)
+{
+	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
+	size_t bytes_read;
+	
+	if ( (bytes_read = switch_buffer_read(context->audio_buffer, data, *datalen)) ) {
+		*datalen = bytes_read ;
+		return SWITCH_STATUS_SUCCESS;
+	}
+	return SWITCH_STATUS_FALSE;
+}
+
+static void whisper_speech_flush_tts(switch_speech_handle_t *sh)
+{
+	whisper_tts_t *context = (whisper_tts_t *) sh->private_info;
+
+	if ( context->audio_buffer ) {
+	    switch_buffer_zero(context->audio_buffer);
+	}
+}
+
+static void whisper_speech_text_param_tts(switch_speech_handle_t *sh, char *param, const char *val)
+{
+	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
+	if (!zstr(param) && !zstr(val)) {
+		if (!strcasecmp("channel-uuid", param)) {
+			context->channel_uuid = switch_core_strdup(sh->memory_pool, val);
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "channel-uuid = %s\n", val);
+		}
+	}
+}
+
+static void whisper_speech_numeric_param_tts(switch_speech_handle_t *sh, char *param, int val)
+{
+}
+
+static void whisper_speech_float_param_tts(switch_speech_handle_t *sh, char *param, double val)
+{
+}
+
+/* Preconnect */
+
+#define WHISPER_PRECONNECT_SYNTAX "[asr] [tts] [profile=<name>] [idle-ms=<ms>]"
+
+/* one per whisper_preconnect, the job thread holds a read lock on the session and frees the pool */
+typedef struct {
+	switch_memory_pool_t *pool;
+	switch_core_session_t *session;
+	const char *uuid;
+	const char *profile;
+	uint32_t rate;
+	uint32_t idle_ms;
+	int asr;
+	int tts;
+} whisper_preconnect_t;
+
+static whisper_tts_t *whisper_tts_preconnect(whisper_preconnect_t *job)
+{
+	switch_memory_pool_t *pool;
+	whisper_tts_t *context;
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return NULL;
+	}
+
+	context = switch_core_alloc(pool, sizeof(*context));
+	context->pool = context->reuse_pool = pool;
+	switch_buffer_create_dynamic(&context->audio_buffer, SPEECH_BUFFER_SIZE, SPEECH_BUFFER_SIZE, SPEECH_BUFFER_SIZE_MAX);
+
+	/* the lws thread in our own pool, whisper_tts_free joins it before destroying that */
+	if (ws_tts_setup_connection(switch_core_strdup(pool, whisper_globals.tts_server_url), context, pool) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(job->uuid), SWITCH_LOG_WARNING, "TTS preconnect failed, speak connects on its own\n");
+		whisper_tts_free(context);
+		return NULL;
+	}
+
+	return context;
+}
+
+/* what whisper_open would set up for the channel, in a pool of its own so the slot can hold it */
+static whisper_t *whisper_asr_preconnect(whisper_preconnect_t *job)
+{
+	switch_memory_pool_t *pool;
+	whisper_t *context;
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return NULL;
+	}
+
+	context = switch_core_alloc(pool, sizeof(*context));
+	context->reuse_pool = pool;
+	context->session = job->session;
+	context->channel_uuid = switch_core_strdup(pool, job->uuid);
+
+	if (whisper_asr_setup(context, pool, job->rate, job->profile) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(job->uuid), SWITCH_LOG_WARNING, "ASR preconnect failed, detect_speech connects on its own\n");
+		switch_core_destroy_memory_pool(&pool);
+		return NULL;
+	}
+
+	whisper_language_hint(context);
+
+	return context;
+}
+
+/* TTS first, the first prompt usually plays before anything listens */
+static void *SWITCH_THREAD_FUNC whisper_preconnect_run(switch_thread_t *thread, void *obj)
+{
+	whisper_preconnect_t *job = (whisper_preconnect_t *) obj;
+	switch_channel_t *channel = switch_core_session_get_channel(job->session);
+	switch_memory_pool_t *pool = job->pool;
+	whisper_tts_t *tts;
+	whisper_t *asr;
+
+	if (job->tts && (tts = whisper_tts_preconnect(job))) {
+		if (switch_channel_up_nosig(channel)) {
+			whisper_slot_park_tts(job->uuid, tts, job->idle_ms);
+		} else {
+			whisper_tts_free(tts);
+		}
+	}
+
+	if (job->asr && switch_channel_up_nosig(channel) && (asr = whisper_asr_preconnect(job))) {
+		if (switch_channel_up_nosig(channel)) {
+			whisper_slot_park(asr, job->idle_ms);
+		} else {
+			whisper_asr_free(asr);
+		}
+	}
+
+	switch_core_session_rwunlock(job->session);
+	switch_core_destroy_memory_pool(&pool);
+
+	return NULL;
+}
+
+/* connects in the background, the first whisper_speech_open / whisper_open of the channel adopts the connections */
+static switch_status_t whisper_preconnect(switch_core_session_t *session, const char *args)
+{
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	switch_codec_implementation_t read_impl = { 0 };
+	switch_threadattr_t *thd_attr = NULL;
+	switch_memory_pool_t *pool;
+	switch_thread_t *thread;
+	whisper_preconnect_t *job;
+	whisper_profile_t *profile;
+	char *argv[8] = { 0 };
+	int argc = 0, i;
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return SWITCH_STATUS_MEMERR;
+	}
+
+	job = switch_core_alloc(pool, sizeof(*job));
+	job->pool = pool;
+	job->session = session;
+	job->uuid = switch_core_strdup(pool, switch_core_session_get_uuid(session));
+	job->profile = switch_channel_get_variable(channel, "whisper_profile");
+
+	if (!zstr(args)) {
+		argc = switch_separate_string(switch_core_strdup(pool, args), ' ', argv, switch_arraylen(argv));
+	}
+
+	for (i = 0; i < argc; i++) {
+		if (!strcasecmp(argv[i], "asr")) {
+			job->asr = 1;
+		} else if (!strcasecmp(argv[i], "tts")) {
+			job->tts = 1;
+		} else if (!strncasecmp(argv[i], "profile=", 8)) {
+			job->profile = argv[i] + 8;
+		} else if (!strncasecmp(argv[i], "idle-ms=", 8) && atoi(argv[i] + 8) > 0) {
+			job->idle_ms = atoi(argv[i] + 8);
+		}
+	}
+
+	if (job->profile) {
+		job->profile = switch_core_strdup(pool, job->profile);
+	}
+
+	if (!job->asr && !job->tts) {
+		job->asr = job->tts = 1;
+	}
+
+	/* the rate whisper_open gets from detect_speech, a parked context is only adopted at the same one */
+	switch_core_session_get_read_impl(session, &read_impl);
+	job->rate = switch_min(read_impl.actual_samples_per_second, 16000);
+	if (!job->rate) {
+		job->asr = 0;
+	}
+
+	if (!job->idle_ms) {
+		profile = whisper_profile_find(job->profile);
+		job->idle_ms = profile->reuse_idle_ms ? profile->reuse_idle_ms : PRECONNECT_IDLE_MS;
+	}
+
+	if (switch_core_session_read_lock(session) != SWITCH_STATUS_SUCCESS) {
+		switch_core_destroy_memory_pool(&pool);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	/* logged first, the job thread frees job when it is done */
+	switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "Preconnecting%s%s, kept %ums\n", job->tts ? " TTS" : "", job->asr ? " ASR" : "", job->idle_ms);
+
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_detach_set(thd_attr, 1);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	if (switch_thread_create(&thread, thd_attr, whisper_preconnect_run, job, pool) != SWITCH_STATUS_SUCCESS) {
+		switch_core_session_rwunlock(session);
+		switch_core_destroy_memory_pool(&pool);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_APP(whisper_preconnect_app_function)
+{
+	if (whisper_preconnect(session, data) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Unable to start the preconnect\n");
+	}
+}
+
+/* Continuous transcription */
+
+#define WHISPER_TRANSCRIBE_BUG "whisper_transcribe"
+#define WHISPER_TRANSCRIBE_RATE 16000
+#define WHISPER_TRANSCRIBE_SYNTAX "start|stop [stereo] [param=value ...]"
+#define WHISPER_TRANSCRIBE_API_SYNTAX "<uuid> start|stop [stereo] [param=value ...]"
+
+static const char *whisper_transcribe_start_msg[] = { "{\"start\":\"true\",\"channel\":0}", "{\"start\":\"true\",\"channel\":1}" };
+static const char *whisper_transcribe_eof_msg[] = { "{\"eof\":\"true\",\"channel\":0}", "{\"eof\":\"true\",\"channel\":1}" };
+
+static void whisper_transcribe_event(whisper_transcribe_t *tr, int channel, const char *subclass, const char *reason)
+{
+	whisper_event_t *ev;
+
+	if (!(ev = whisper_event_alloc())) {
+		return;
+	}
+
+	ev->subclass = subclass;
+	switch_copy_string(ev->uuid, tr->asr.channel_uuid, sizeof(ev->uuid));
+	if (tr->channels > 1) {
+		whisper_event_header(ev, "Transcription-Channel", "%d", channel);
+		whisper_event_header(ev, "Transcription-Speaker", "%s", tr->legs[channel].speaker);
+	}
+	ev->stop_reason = reason;
+	ev->has_metrics = 1;
+	whisper_metrics_snapshot(&tr->asr, &ev->metrics);
+	whisper_event_queue(ev);
+}
+
+/* lws thread: every server reply is one transcribed segment, tagged with its channel in stereo mode */
+static void whisper_transcribe_on_result(whisper_t *context, whisper_reply_t *reply)
+{
+	whisper_transcribe_t *tr = (whisper_transcribe_t *) context->user_data;
+	whisper_event_t *ev;
+	int channel = tr->channels > 1 && reply->channel ? 1 : 0;
+
+	context->segments++;
+
+	if (!reply->best.len || !(ev = whisper_event_alloc())) {
+		return;
+	}
+
+	ev->subclass = "whisper::transcription";
+	switch_copy_string(ev->uuid, context->channel_uuid, sizeof(ev->uuid));
+	whisper_event_header(ev, "Transcription-Segment", "%u", context->segments);
+	if (tr->channels > 1) {
+		whisper_event_header(ev, "Transcription-Channel", "%d", channel);
+		whisper_event_header(ev, "Transcription-Speaker", "%s", tr->legs[channel].speaker);
+	}
+	if (reply->best.confidence >= 0) {
+		whisper_event_header(ev, "Transcription-Confidence", "%.1f", reply->best.confidence);
+	}
+	if (reply->language) {
+		whisper_event_header(ev, "Transcription-Language", "%s", reply->language);
+	}
+	whisper_event_body(ev, reply->best.text, reply->best.len);
+	whisper_event_queue(ev);
+}
+
+/*
+ * media thread: like whisper_feed but never waits for a result, each utterance is closed with an
+ * eof and the next one may start right away. In stereo mode every channel has its own VAD, the
+ * frame is sent interleaved with the channels that are not in an utterance zeroed, and the start
+ * and eof messages carry the channel so the server can cut both streams independently.
+ */
+static void whisper_transcribe_feed(whisper_transcribe_t *tr, int16_t *data, uint32_t samples)
+{
+	whisper_t *context = &tr->asr;
+	switch_vad_state_t vad_state[2] = { SWITCH_VAD_STATE_NONE, SWITCH_VAD_STATE_NONE };
+	const char *stop_reason[2] = { NULL, NULL };
+	int c, sending = 0;
+	uint32_t i;
+
+	if (samples > switch_arraylen(tr->chan[0])) {
+		samples = switch_arraylen(tr->chan[0]);
+	}
+
+	for (c = 0; c < tr->channels; c++) {
+		whisper_leg_t *leg = &tr->legs[c];
+		int16_t *src = tr->chan[c];
+
+		for (i = 0; i < samples; i++) {
+			src[i] = data[i * tr->channels + c];
+		}
+
+		whisper_hpf_process(&leg->hpf, src, samples, context->rate);
+		whisper_ns_process(&leg->ns, src, samples);
+		whisper_agc_process(&leg->agc, src, samples, context->rate);
+
+		vad_state[c] = switch_vad_process(leg->vad, src, samples);
+
+		if (vad_state[c] == SWITCH_VAD_STATE_START_TALKING) {
+			leg->utt_samples = 0;
+			if (tr->channels > 1) {
+				ws_asr_queue_text(context, whisper_transcribe_start_msg[c]);
+			}
+			whisper_transcribe_event(tr, c, "whisper::asr_start_talking", NULL);
+			whisper_capture_mark(context->capture, WHISPER_CAPTURE_START, NULL);
+		} else if (vad_state[c] == SWITCH_VAD_STATE_TALKING) {
+			leg->utt_samples += samples;
+			sending = 1;
+
+			/* nobody polls check_results here, so the speech timeout is counted in samples */
+			if (context->speech_timeout > 0 && leg->utt_samples / (context->rate / 1000) >= (uint32_t) context->speech_timeout) {
+				stop_reason[c] = "timeout";
+			}
+		} else if (vad_state[c] == SWITCH_VAD_STATE_STOP_TALKING) {
+			stop_reason[c] = "vad";
+		}
 	}
 
-	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Pausing\n");
+	if (sending) {
+		int16_t *out = tr->chan[0];
 
-	switch_mutex_lock(context->mutex);
-	context->flags = 0;
+		if (tr->channels > 1) {
+			for (i = 0; i < samples; i++) {
+				for (c = 0; c < tr->channels; c++) {
+					tr->frame[i * tr->channels + c] = vad_state[c] == SWITCH_VAD_STATE_TALKING ? tr->chan[c][i] : 0;
+				}
+			}
+			out = tr->frame;
+		}
 
-	switch_mutex_unlock(context->mutex);
+		if (ws_asr_queue_audio(context, out, samples * tr->channels * sizeof(int16_t)) != SWITCH_STATUS_SUCCESS) {
+			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "Audio ring full, dropping %u samples\n", samples);
+			context->dropped_frames++;
+		} else {
+			whisper_capture_audio(context->capture, out, samples * tr->channels * sizeof(int16_t));
+		}
+	}
 
-	return SWITCH_STATUS_SUCCESS;
+	for (c = 0; c < tr->channels; c++) {
+		if (!stop_reason[c]) {
+			continue;
+		}
+
+		ws_asr_queue_text(context, tr->channels > 1 ? whisper_transcribe_eof_msg[c] : "{\"eof\":\"true\"}");
+		whisper_transcribe_event(tr, c, "whisper::asr_stop_talking", stop_reason[c]);
+		whisper_capture_mark(context->capture, WHISPER_CAPTURE_STOP, tr->channels > 1 ? tr->legs[c].speaker : stop_reason[c]);
+		switch_vad_reset(tr->legs[c].vad);
+		tr->legs[c].utt_samples = 0;
+	}
 }
 
-static switch_status_t whisper_resume(switch_asr_handle_t *ah)
+static void whisper_transcribe_teardown(whisper_transcribe_t *tr)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
+	whisper_asr_teardown(&tr->asr);
 
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_resume attempt on CLOSED asr handle\n");
-		return SWITCH_STATUS_FALSE;
+	if (tr->channels > 1 && tr->legs[1].vad) {
+		switch_vad_destroy(&tr->legs[1].vad);
 	}
 
-	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Resuming\n");
-	whisper_reset_vad(context);
-	
-	return SWITCH_STATUS_SUCCESS;
+	if (tr->resampler) {
+		switch_resample_destroy(&tr->resampler);
+	}
 }
 
-static switch_status_t whisper_check_results(switch_asr_handle_t *ah, switch_asr_flag_t *flags)
+static switch_bool_t whisper_transcribe_callback(switch_media_bug_t *bug, void *user_data, switch_abc_type_t type)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
-
-	if (switch_test_flag(context, ASRFLAG_RESULT_PENDING)) {
-		return SWITCH_STATUS_BREAK;
-	}
-		
+	whisper_transcribe_t *tr = (whisper_transcribe_t *) user_data;
+	whisper_t *context = &tr->asr;
+
+	switch (type) {
+	case SWITCH_ABC_TYPE_CLOSE:
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Transcription stopped after %u segments\n", context->segments);
+		switch_channel_set_private(switch_core_session_get_channel(switch_core_media_bug_get_session(bug)), WHISPER_TRANSCRIBE_BUG, NULL);
+		whisper_transcribe_teardown(tr);
+		break;
+	case SWITCH_ABC_TYPE_READ:
+		{
+			uint8_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
+			switch_frame_t frame = { 0 };
+
+			frame.data = data;
+			frame.buflen = sizeof(data);
+
+			while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS && frame.datalen) {
+				int16_t *samples = (int16_t *) frame.data;
+				uint32_t n = frame.datalen / sizeof(int16_t) / tr->channels;
 
-	if (switch_test_flag(context, ASRFLAG_RETURNED_RESULT) || switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		return SWITCH_STATUS_BREAK;
-	}
+				if (context->started != WS_STATE_STARTED) {
+					whisper_fire_event(context, "whisper::asr_connection_error");
+					return SWITCH_FALSE;
+				}
 
-	if (!switch_test_flag(context, ASRFLAG_RETURNED_START_OF_SPEECH) && switch_test_flag(context, ASRFLAG_START_OF_SPEECH)) {
-		return SWITCH_STATUS_SUCCESS;
-	}
+				if (tr->resampler) {
+					switch_resample_process(tr->resampler, samples, n);
+					samples = tr->resampler->to;
+					n = tr->resampler->to_len;
+				}
 
-	if ((!switch_test_flag(context, ASRFLAG_RESULT_READY)) && (!switch_test_flag(context, ASRFLAG_NOINPUT_TIMEOUT))) {
-		if (switch_test_flag(context, ASRFLAG_INPUT_TIMERS) && !(switch_test_flag(context, ASRFLAG_START_OF_SPEECH)) &&
-				context->no_input_timeout >= 0 &&
-				(switch_micro_time_now() - context->no_input_time) / 1000 >= context->no_input_timeout) {
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "NO INPUT TIMEOUT %" SWITCH_TIME_T_FMT "ms\n", (switch_micro_time_now() - context->no_input_time) / 1000);
-			switch_set_flag(context, ASRFLAG_NOINPUT_TIMEOUT);
-		} else if (!switch_test_flag(context, ASRFLAG_TIMEOUT) && switch_test_flag(context, ASRFLAG_START_OF_SPEECH) && context->speech_timeout > 0 && (switch_micro_time_now() - context->speech_time) / 1000 >= context->speech_timeout) {
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "SPEECH TIMEOUT %" SWITCH_TIME_T_FMT "ms\n", (switch_micro_time_now() - context->speech_time) / 1000);
-			if (switch_test_flag(context, ASRFLAG_START_OF_SPEECH)) {
-				switch_set_flag(context, ASRFLAG_TIMEOUT);
-				return SWITCH_STATUS_FALSE;
-				//switch_set_flag(context, ASRFLAG_RESULT_READY);
-			} else {
-				switch_set_flag(context, ASRFLAG_NOINPUT_TIMEOUT);
+				whisper_transcribe_feed(tr, samples, n);
 			}
 		}
+		break;
+	default:
+		break;
 	}
 
-	return switch_test_flag(context, ASRFLAG_RESULT_READY) || switch_test_flag(context, ASRFLAG_NOINPUT_TIMEOUT) ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_BREAK;
+	return SWITCH_TRUE;
 }
 
-static switch_status_t whisper_get_results(switch_asr_handle_t *ah, char **resultstr, switch_asr_flag_t *flags)
+static switch_status_t whisper_transcribe_start(switch_core_session_t *session, const char *args)
 {
-	whisper_t *context = (whisper_t *) ah->private_info;
-	switch_status_t status = SWITCH_STATUS_SUCCESS;
-
-	if (switch_test_flag(context, ASRFLAG_RETURNED_RESULT) || switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	switch_codec_implementation_t read_impl = { 0 };
+	switch_media_bug_t *bug = NULL;
+	whisper_transcribe_t *tr;
+	const char *profile = NULL;
+	char *argv[32];
+	int argc = 0, i;
+
+	if (switch_channel_get_private(channel, WHISPER_TRANSCRIBE_BUG)) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "Transcription already running\n");
 		return SWITCH_STATUS_FALSE;
 	}
 
-	if (switch_test_flag(context, ASRFLAG_RESULT_READY)) {
-		int is_partial = context->partial-- > 0 ? 1 : 0;
+	switch_core_session_get_read_impl(session, &read_impl);
 
-		// *resultstr = switch_mprintf("{\"grammar\": \"%s\", \"text\": \"%s\", \"confidence\": %f}", context->grammar, context->result_text, context->result_confidence);
+	tr = switch_core_session_alloc(session, sizeof(*tr));
+	tr->asr.channel_uuid = switch_core_session_strdup(session, switch_core_session_get_uuid(session));
+	tr->asr.result_handler = whisper_transcribe_on_result;
+	tr->asr.user_data = tr;
+	tr->channels = 1;
+	tr->legs[0].speaker = "caller";
+	tr->legs[1].speaker = "agent";
 
-		*resultstr = switch_safe_strdup(context->result_text);
-
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_NOTICE, "%sResult: %s\n", is_partial ? "Partial " : "Final ", *resultstr);
+	if (!zstr(args)) {
+		argc = switch_separate_string(switch_core_session_strdup(session, args), ' ', argv, switch_arraylen(argv));
+	}
 
-		if (is_partial) {
-			status = SWITCH_STATUS_MORE_DATA;
-		} else {
-			status = SWITCH_STATUS_SUCCESS;
+	/* the channel layout and profile have to be known before the buffers, capture and bug are set up */
+	for (i = 0; i < argc; i++) {
+		if (!strncasecmp(argv[i], "profile=", 8)) {
+			profile = argv[i] + 8;
+		} else if (!strcasecmp(argv[i], "stereo")) {
+			tr->channels = 2;
+		} else if (!strncasecmp(argv[i], "speaker-a=", 10)) {
+			tr->legs[0].speaker = argv[i] + 10;
+		} else if (!strncasecmp(argv[i], "speaker-b=", 10)) {
+			tr->legs[1].speaker = argv[i] + 10;
 		}
-	} else if (switch_test_flag(context, ASRFLAG_NOINPUT_TIMEOUT)) {
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Result: NO INPUT\n");
+	}
 
-		*resultstr = switch_mprintf("{\"grammar\": \"%s\", \"text\": \"\", \"confidence\": 0, \"error\": \"no_input\"}", context->grammar);
+	tr->asr.channels = tr->channels;
 
-		status = SWITCH_STATUS_SUCCESS;
-	} else if (!switch_test_flag(context, ASRFLAG_RETURNED_START_OF_SPEECH) && switch_test_flag(context, ASRFLAG_START_OF_SPEECH)) {
-		switch_set_flag(context, ASRFLAG_RETURNED_START_OF_SPEECH);
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "Result: START OF SPEECH\n");
-		status = SWITCH_STATUS_BREAK;
-	} else {
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Unexpected call to asr_get_results - no results to return!\n");
-		status = SWITCH_STATUS_FALSE;
-	}
-	
-	if (status == SWITCH_STATUS_SUCCESS) {
-		switch_set_flag(context, ASRFLAG_RETURNED_RESULT);
-		switch_clear_flag(context, ASRFLAG_READY);
+	if (read_impl.actual_samples_per_second != WHISPER_TRANSCRIBE_RATE &&
+		switch_resample_create(&tr->resampler, read_impl.actual_samples_per_second, WHISPER_TRANSCRIBE_RATE,
+							   SWITCH_RECOMMENDED_BUFFER_SIZE, SWITCH_RESAMPLE_QUALITY, tr->channels) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Unable to create resampler\n");
+		return SWITCH_STATUS_FALSE;
 	}
 
-	return status;
-}
-
-static switch_status_t whisper_start_input_timers(switch_asr_handle_t *ah)
-{
-	whisper_t *context = (whisper_t *) ah->private_info;
+	if (!profile) {
+		profile = switch_channel_get_variable(channel, "whisper_profile");
+	}
 
-	if (switch_test_flag(ah, SWITCH_ASR_FLAG_CLOSED)) {
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "asr_start_input_timers attempt on CLOSED asr handle\n");
+	if (whisper_asr_setup(&tr->asr, switch_core_session_get_pool(session), WHISPER_TRANSCRIBE_RATE, profile) != SWITCH_STATUS_SUCCESS) {
+		if (tr->resampler) {
+			switch_resample_destroy(&tr->resampler);
+		}
 		return SWITCH_STATUS_FALSE;
 	}
 
-	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "start_input_timers\n");
+	for (i = 0; i < argc; i++) {
+		char *val = strchr(argv[i], '=');
 
-	if (!switch_test_flag(context, ASRFLAG_INPUT_TIMERS)) {
-		switch_set_flag(context, ASRFLAG_INPUT_TIMERS);
-		context->no_input_time = switch_micro_time_now();
-	} else {
-		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_INFO, "Input timers already started\n");
+		if (val) {
+			*val++ = '\0';
+			whisper_set_param(&tr->asr, argv[i], val);
+		}
 	}
 
-	return SWITCH_STATUS_SUCCESS;
-}
+	tr->legs[0].vad = tr->asr.vad;
+	tr->legs[0].hpf = tr->legs[1].hpf = tr->asr.hpf;
+	tr->legs[0].ns = tr->legs[1].ns = tr->asr.ns;
+	tr->legs[0].agc = tr->legs[1].agc = tr->asr.agc;
+
+	if (tr->channels > 1) {
+		tr->legs[1].vad = switch_vad_init(WHISPER_TRANSCRIBE_RATE, 1);
+		switch_vad_set_mode(tr->legs[1].vad, -1);
+		switch_vad_set_param(tr->legs[1].vad, "thresh", tr->asr.thresh);
+		switch_vad_set_param(tr->legs[1].vad, "silence_ms", tr->asr.silence_ms);
+		switch_vad_set_param(tr->legs[1].vad, "voice_ms", tr->asr.voice_ms);
+		ws_asr_queue_text(&tr->asr, "{\"channels\":2}");
+	}
 
-static void whisper_text_param(switch_asr_handle_t *ah, char *param, const char *val)
-{
-	whisper_t *context = (whisper_t *) ah->private_info;
+	if (switch_core_media_bug_add(session, WHISPER_TRANSCRIBE_BUG, NULL, whisper_transcribe_callback, tr, 0,
+								  tr->channels > 1 ? SMBF_READ_STREAM | SMBF_WRITE_STREAM | SMBF_STEREO | SMBF_NO_PAUSE : SMBF_READ_STREAM | SMBF_NO_PAUSE,
+								  &bug) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Unable to attach media bug\n");
+		whisper_transcribe_teardown(tr);
+		return SWITCH_STATUS_FALSE;
+	}
 
-	if (!zstr(param) && !zstr(val)) {
-		int nval = atoi(val);
-		double fval = atof(val);
+	switch_channel_set_private(channel, WHISPER_TRANSCRIBE_BUG, bug);
 
-		if (!strcasecmp("no-input-timeout", param) && switch_is_number(val)) {
-			context->no_input_timeout = nval;
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "no-input-timeout = %d\n", context->no_input_timeout);
-		} else if (!strcasecmp("speech-timeout", param) && switch_is_number(val)) {
-			context->speech_timeout = nval;
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "speech-timeout = %d\n", context->speech_timeout);
-		} else if (!strcasecmp("start-input-timers", param)) {
-			context->start_input_timers = switch_true(val);
-			if (context->start_input_timers) {
-				switch_set_flag(context, ASRFLAG_INPUT_TIMERS);
-			} else {
-				switch_clear_flag(context, ASRFLAG_INPUT_TIMERS);
-			}
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "start-input-timers = %d\n", context->start_input_timers);
-		} else if (!strcasecmp("vad-mode", param)) {
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "vad-mode = %s\n", val);
-			if (context->vad) switch_vad_set_mode(context->vad, nval);
-		} else if (!strcasecmp("vad-voice-ms", param) && nval > 0) {
-			context->voice_ms = nval;
-			switch_vad_set_param(context->vad, "voice_ms", nval);
-		} else if (!strcasecmp("vad-silence-ms", param) && nval > 0) {
-			context->silence_ms = nval;
-			switch_vad_set_param(context->vad, "silence_ms", nval);
-		} else if (!strcasecmp("vad-thresh", param) && nval > 0) {
-			context->thresh = nval;
-			switch_vad_set_param(context->vad, "thresh", nval);
-		} else if (!strcasecmp("channel-uuid", param)) {
-			context->channel_uuid = switch_core_strdup(ah->memory_pool, val);
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "channel-uuid = %s\n", val);
-		} else if (!strcasecmp("result", param)) {
-			context->result_text = switch_core_strdup(ah->memory_pool, val);
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "result = %s\n", val);
-		} else if (!strcasecmp("confidence", param) && fval >= 0.0) {
-			context->result_confidence = fval;
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "confidence = %f\n", fval);
-		} else if (!strcasecmp("partial", param) && switch_true(val)) {
-			context->partial = 3;
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "partial = %d\n", context->partial);
-		}
-	}
+	return SWITCH_STATUS_SUCCESS;
 }
 
-/* TTS Interface */
-
-static switch_status_t whisper_speech_open(switch_speech_handle_t *sh, const char *voice_name, int rate, int channels, switch_speech_flag_t *flags)
+static switch_status_t whisper_transcribe_stop(switch_core_session_t *session)
 {
-	whisper_tts_t *context = switch_core_alloc(sh->memory_pool, sizeof(whisper_tts_t));
-	switch_status_t status = SWITCH_STATUS_FALSE;
-	switch_event_t *event = NULL;
-	char * tts_server = NULL;
-	char * session_uuid =  NULL;
+	switch_channel_t *channel = switch_core_session_get_channel(session);
+	switch_media_bug_t *bug = switch_channel_get_private(channel, WHISPER_TRANSCRIBE_BUG);
 
-	/* check if session is associated w/ this memory pool */
-	switch_core_session_t *session = switch_core_memory_pool_get_data(sh->memory_pool, "__session");
-	if (session) {
-		session_uuid = switch_core_session_get_uuid(session);
+	if (!bug) {
+		return SWITCH_STATUS_FALSE;
 	}
-	
-	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "session-uuid = %s\n", session_uuid);
-	switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "whisper::tts_open");
-	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "WHISPER-voice", voice_name);
-	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "WHISPER-uuid", session_uuid);
-	switch_event_fire(&event);
-
-	switch_assert(context);
-
-    if ( voice_name ) {
-        context->voice = switch_core_strdup(sh->memory_pool, voice_name);
-    } else {
-        context->voice = "default";
-    }
 
-	context->samplerate = sh->samplerate;
-	
-	context->pool = sh->memory_pool;
+	switch_channel_set_private(channel, WHISPER_TRANSCRIBE_BUG, NULL);
 
-	switch_buffer_create_dynamic(&context->audio_buffer, SPEECH_BUFFER_SIZE, SPEECH_BUFFER_SIZE, SPEECH_BUFFER_SIZE_MAX);
+	return switch_core_media_bug_remove(session, &bug);
+}
 
-	sh->private_info = context;
+static switch_status_t whisper_transcribe_command(switch_core_session_t *session, char *action)
+{
+	char *args = strchr(action, ' ');
 
-	tts_server = switch_core_strdup(whisper_globals.pool, whisper_globals.tts_server_url);
+	if (args) {
+		*args++ = '\0';
+	}
 
-	status = ws_tts_setup_connection(tts_server, context, whisper_globals.pool);
+	if (!strcasecmp(action, "start")) {
+		return whisper_transcribe_start(session, args);
+	} else if (!strcasecmp(action, "stop")) {
+		return whisper_transcribe_stop(session);
+	}
 
-	return status;
+	return SWITCH_STATUS_NOTFOUND;
 }
 
-static switch_status_t whisper_speech_close(switch_speech_handle_t *sh, switch_speech_flag_t *flags)
+SWITCH_STANDARD_APP(whisper_transcribe_app_function)
 {
-	whisper_tts_t *context = (whisper_tts_t *) sh->private_info;
-
-	ws_tts_close_connection(context);
-
-	if ( context->audio_buffer ) {
-		switch_buffer_destroy(&context->audio_buffer);
+	if (zstr(data)) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Usage: whisper_transcribe %s\n", WHISPER_TRANSCRIBE_SYNTAX);
+		return;
 	}
 
-	return SWITCH_STATUS_SUCCESS;
+	if (whisper_transcribe_command(session, switch_core_session_strdup(session, data)) == SWITCH_STATUS_NOTFOUND) {
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Usage: whisper_transcribe %s\n", WHISPER_TRANSCRIBE_SYNTAX);
+	}
 }
 
-static switch_status_t whisper_speech_feed_tts(switch_speech_handle_t *sh, char *text, switch_speech_flag_t *flags)
+SWITCH_STANDARD_API(whisper_transcribe_api_function)
 {
-	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
-
-	unsigned char buffer[LWS_SEND_BUFFER_PRE_PADDING + strlen(text) + LWS_SEND_BUFFER_POST_PADDING];
-	unsigned char *p = &buffer[LWS_SEND_BUFFER_PRE_PADDING];
+	switch_core_session_t *lsession = NULL;
+	char *mycmd = NULL, *action;
+	switch_status_t status;
 
-	if (switch_true(switch_core_get_variable("mod_whisper_tts_must_have_channel_uuid")) && zstr(context->channel_uuid)) {
-		return SWITCH_STATUS_FALSE;
+	if (zstr(cmd) || !(mycmd = strdup(cmd)) || !(action = strchr(mycmd, ' '))) {
+		stream->write_function(stream, "-USAGE: %s\n", WHISPER_TRANSCRIBE_API_SYNTAX);
+		goto done;
 	}
 
-	if (!zstr(text)) {
-		context->text = switch_core_strdup(sh->memory_pool, text);
-	}
+	*action++ = '\0';
 
-	memcpy(p, context->text, strlen(context->text));
+	if (!(lsession = switch_core_session_locate(mycmd))) {
+		stream->write_function(stream, "-ERR No such channel %s\n", mycmd);
+		goto done;
+	}
 
-	if (lws_write(context->wsi, p, strlen(context->text), LWS_WRITE_TEXT) < 0) {
-		fprintf(stderr, "Error writing to socket\n");
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Unable to write message\n");
-		return -1;
-	}		
+	status = whisper_transcribe_command(lsession, action);
+	switch_core_session_rwunlock(lsession);
 
-	while ( (!context->audio_buffer || switch_buffer_inuse(context->audio_buffer) == 0) && context->started == WS_STATE_STARTED ) {
-		usleep(30000);
+	if (status == SWITCH_STATUS_SUCCESS) {
+		stream->write_function(stream, "+OK\n");
+	} else if (status == SWITCH_STATUS_NOTFOUND) {
+		stream->write_function(stream, "-USAGE: %s\n", WHISPER_TRANSCRIBE_API_SYNTAX);
+	} else {
+		stream->write_function(stream, "-ERR Operation failed\n");
 	}
+
+  done:
+	switch_safe_free(mycmd);
 	return SWITCH_STATUS_SUCCESS;
 }
 
-static switch_status_t whisper_speech_read_tts(switch_speech_handle_t *sh, void *data, switch_size_t *datalen, switch_speech_flag_t *flags)
+static switch_bool_t whisper_profile_set_param(whisper_profile_t *profile, const char *var, const char *val)
 {
-	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
-	size_t bytes_read;
-	
-	if ( (bytes_read = switch_buffer_read(context->audio_buffer, data, *datalen)) ) {
-		*datalen = bytes_read ;
-		return SWITCH_STATUS_SUCCESS;
+	if (!strcasecmp(var, "asr-server-url")) {
+		profile->asr_server_url = switch_core_strdup(whisper_globals.pool, val);
+	} else if (!strcasecmp(var, "chunk-ms") && atoi(val) > 0) {
+		profile->chunk_ms = atoi(val);
+	} else if (!strcasecmp(var, "chunk-min-ms") && atoi(val) > 0) {
+		profile->chunk_min_ms = atoi(val);
+	} else if (!strcasecmp(var, "chunk-max-ms") && atoi(val) > 0) {
+		profile->chunk_max_ms = atoi(val);
+	} else if (!strcasecmp(var, "chunk-adaptive")) {
+		profile->chunk_adaptive = switch_true(val);
+	} else if (!strcasecmp(var, "send-mode")) {
+		profile->send_mode = !strcasecmp(val, "batch") ? WHISPER_SEND_BATCH : WHISPER_SEND_STREAM;
+	} else if (!strcasecmp(var, "batch-max-ms") && atoi(val) > 0) {
+		profile->batch_max_ms = atoi(val);
+	} else if (!strcasecmp(var, "connect-timeout-ms") && atoi(val) > 0) {
+		profile->connect_timeout_ms = atoi(val);
+	} else if (!strcasecmp(var, "fast-profile")) {
+		profile->fast_profile = zstr(val) ? NULL : switch_core_strdup(whisper_globals.pool, val);
+	} else if (!strcasecmp(var, "fast-min-confidence") && atoi(val) >= 0) {
+		profile->fast_min_confidence = atoi(val);
+	} else if (!strcasecmp(var, "two-pass")) {
+		profile->two_pass = switch_true(val);
+	} else if (!strcasecmp(var, "reuse-idle-ms") && atoi(val) >= 0) {
+		profile->reuse_idle_ms = atoi(val);
+	} else {
+		return SWITCH_FALSE;
 	}
-	return SWITCH_STATUS_FALSE;
+
+	return SWITCH_TRUE;
 }
 
-static void whisper_speech_flush_tts(switch_speech_handle_t *sh)
+static void load_profiles(switch_xml_t cfg)
 {
-	whisper_tts_t *context = (whisper_tts_t *) sh->private_info;
+	switch_xml_t profiles, xprofile, param;
+	whisper_profile_t *profile;
 
-	if ( context->audio_buffer ) {
-	    switch_buffer_zero(context->audio_buffer);
+	whisper_globals.profiles = NULL;
+
+	if (!(profiles = switch_xml_child(cfg, "profiles"))) {
+		return;
 	}
-}
 
-static void whisper_speech_text_param_tts(switch_speech_handle_t *sh, char *param, const char *val)
-{
-	whisper_tts_t *context = (whisper_tts_t *)sh->private_info;
-	if (!zstr(param) && !zstr(val)) {
-		if (!strcasecmp("channel-uuid", param)) {
-			context->channel_uuid = switch_core_strdup(sh->memory_pool, val);
-			switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "channel-uuid = %s\n", val);
+	for (xprofile = switch_xml_child(profiles, "profile"); xprofile; xprofile = xprofile->next) {
+		const char *name = switch_xml_attr_soft(xprofile, "name");
+
+		if (zstr(name)) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Skipping whisper profile without a name\n");
+			continue;
 		}
-	}
-}
 
-static void whisper_speech_numeric_param_tts(switch_speech_handle_t *sh, char *param, int val)
-{
-}
+		/* unset params are inherited from the top level settings */
+		profile = switch_core_alloc(whisper_globals.pool, sizeof(*profile));
+		*profile = *whisper_globals.default_profile;
+		profile->name = switch_core_strdup(whisper_globals.pool, name);
 
-static void whisper_speech_float_param_tts(switch_speech_handle_t *sh, char *param, double val)
-{
+		for (param = switch_xml_child(xprofile, "param"); param; param = param->next) {
+			whisper_profile_set_param(profile, switch_xml_attr_soft(param, "name"), switch_xml_attr_soft(param, "value"));
+		}
+
+		profile->next = whisper_globals.profiles;
+		whisper_globals.profiles = profile;
+
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Whisper profile %s: %s, %s, chunk %ums%s\n", profile->name, profile->asr_server_url,
+						  profile->send_mode == WHISPER_SEND_BATCH ? "batch" : "stream", profile->chunk_ms, profile->chunk_adaptive ? " adaptive" : "");
+	}
 }
 
 static switch_status_t load_config(void)
@@ -583,6 +2352,17 @@ static switch_status_t load_config(void)
 	char *cf = "whisper.conf";
 	switch_xml_t cfg, xml = NULL, param, settings;
 	switch_status_t status = SWITCH_STATUS_SUCCESS;
+	whisper_profile_t *profile;
+
+	/* sessions may still point at the previous profiles, so reloads allocate new ones */
+	profile = switch_core_alloc(whisper_globals.pool, sizeof(*profile));
+	profile->name = "default";
+	profile->chunk_ms = AUDIO_CHUNK_MS;
+	profile->chunk_min_ms = AUDIO_CHUNK_MIN_MS;
+	profile->chunk_max_ms = AUDIO_CHUNK_MAX_MS;
+	profile->batch_max_ms = AUDIO_BATCH_MAX_MS;
+	profile->connect_timeout_ms = CONNECT_TIMEOUT_MS;
+	profile->fast_min_confidence = FAST_MIN_CONFIDENCE;
 
 	if (!(xml = switch_xml_open_cfg(cf, &cfg, NULL))) {
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Open of %s failed\n", cf);
@@ -590,6 +2370,15 @@ static switch_status_t load_config(void)
 		goto done;
 	}
 
+	whisper_hpf_defaults(&whisper_globals.hpf);
+	whisper_ns_defaults(&whisper_globals.ns);
+	whisper_agc_defaults(&whisper_globals.agc);
+	whisper_onset_defaults(&whisper_globals.onset);
+	whisper_globals.batch_max_connections = 0;
+	whisper_globals.grammar_cache_size = WHISPER_GRAMMAR_CACHE_SIZE;
+	whisper_globals.closed_set_max = WHISPER_GRAMMAR_CLOSED_MAX;
+	whisper_globals.event_channel_data = 0;
+	whisper_globals.language_cache_size = WHISPER_LANGUAGE_CACHE_SIZE;
 
 	if ((settings = switch_xml_child(cfg, "settings"))) {
 		for (param = switch_xml_child(settings, "param"); param; param = param->next) {
@@ -602,8 +2391,37 @@ static switch_status_t load_config(void)
 				whisper_globals.tts_server_url = switch_core_strdup(whisper_globals.pool, val);
 			}
 			if (!strcasecmp(var, "return-json")) {
-				whisper_globals.return_json = atoi(val);
+				whisper_globals.return_json = whisper_return_mode(val);
 			}
+			if (!strcasecmp(var, "record-sent-audio")) {
+				whisper_globals.record_sent_audio = zstr(val) ? NULL : switch_core_strdup(whisper_globals.pool, val);
+			}
+			if (!strcasecmp(var, "record-max-bandwidth")) {
+				whisper_globals.record_max_bandwidth = atoi(val);
+			}
+			if (!strcasecmp(var, "record-buffer-size")) {
+				whisper_globals.record_buffer_size = atoi(val);
+			}
+			if (!strcasecmp(var, "batch-max-connections")) {
+				whisper_globals.batch_max_connections = atoi(val);
+			}
+			if (!strcasecmp(var, "grammar-cache-size")) {
+				whisper_globals.grammar_cache_size = atoi(val);
+			}
+			if (!strcasecmp(var, "closed-set-max")) {
+				whisper_globals.closed_set_max = atoi(val);
+			}
+			if (!strcasecmp(var, "language-cache-size")) {
+				whisper_globals.language_cache_size = atoi(val);
+			}
+			if (!strcasecmp(var, "event-channel-data")) {
+				whisper_globals.event_channel_data = switch_true(val);
+			}
+			whisper_profile_set_param(profile, var, val);
+			whisper_hpf_set_param(&whisper_globals.hpf, var, val);
+			whisper_ns_set_param(&whisper_globals.ns, var, val);
+			whisper_agc_set_param(&whisper_globals.agc, var, val);
+			whisper_onset_set_param(&whisper_globals.onset, var, val);
 		}
 	}
 
@@ -611,6 +2429,15 @@ static switch_status_t load_config(void)
 	if (!whisper_globals.asr_server_url) {
 		whisper_globals.asr_server_url = switch_core_strdup(whisper_globals.pool, "ws://127.0.0.1:2700");
 	}
+	if (!profile->asr_server_url) {
+		profile->asr_server_url = whisper_globals.asr_server_url;
+	}
+	whisper_globals.default_profile = profile;
+
+	if (xml) {
+		load_profiles(cfg);
+	}
+
 	if (!whisper_globals.tts_server_url) {
 		whisper_globals.tts_server_url = switch_core_strdup(whisper_globals.pool, "ws://127.0.0.1:2600");
 	}
@@ -636,10 +2463,30 @@ static void event_handler(switch_event_t *event)
 	}
 }
 
+/* whisper_preconnect=true (or the app's arguments) on a channel preconnects it when it is answered */
+static void answer_handler(switch_event_t *event)
+{
+	const char *uuid = switch_event_get_header(event, "Unique-ID");
+	switch_core_session_t *session;
+	const char *var;
+
+	if (zstr(uuid) || !(session = switch_core_session_locate(uuid))) {
+		return;
+	}
+
+	if (!zstr(var = switch_channel_get_variable(switch_core_session_get_channel(session), "whisper_preconnect")) && !switch_false(var)) {
+		whisper_preconnect(session, switch_true(var) ? NULL : var);
+	}
+
+	switch_core_session_rwunlock(session);
+}
+
 SWITCH_MODULE_LOAD_FUNCTION(mod_whisper_load)
 {
 	switch_asr_interface_t *asr_interface;
 	switch_speech_interface_t *speech_interface;
+	switch_application_interface_t *app_interface;
+	switch_api_interface_t *api_interface;
 
 	switch_mutex_init(&MUTEX, SWITCH_MUTEX_NESTED, pool);
 
@@ -653,8 +2500,31 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_whisper_load)
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't bind!\n");
 	}
 
+	if ((switch_event_bind_removable(modname, SWITCH_EVENT_CHANNEL_ANSWER, NULL, answer_handler, NULL, &ANSWER_NODE) != SWITCH_STATUS_SUCCESS)) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't bind to channel answer, whisper_preconnect only works as an app\n");
+	}
+
+	whisper_dsp_init();
+	whisper_grammar_init(pool);
+	whisper_language_init(pool);
 	do_load();
 
+	if (whisper_event_start(pool) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't start the event dispatcher thread\n");
+	}
+
+	if (whisper_timer_start(pool) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't start the timer wheel thread\n");
+	}
+
+	if (whisper_capture_start(pool) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't start the capture writer thread\n");
+	}
+
+	if (whisper_slot_start(pool) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Couldn't start the connection slot thread, ASR connections are not reused\n");
+	}
+
 	*module_interface = switch_loadable_module_create_module_interface(pool, modname);
 
 	asr_interface = switch_loadable_module_create_interface(*module_interface, SWITCH_ASR_INTERFACE);
@@ -683,6 +2553,15 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_whisper_load)
 	speech_interface->speech_numeric_param_tts = whisper_speech_numeric_param_tts;
 	speech_interface->speech_float_param_tts = whisper_speech_float_param_tts;
 
+	SWITCH_ADD_APP(app_interface, "whisper_transcribe", "Continuous whisper transcription", "Stream the call audio to the ASR server and fire whisper::transcription events",
+				   whisper_transcribe_app_function, WHISPER_TRANSCRIBE_SYNTAX, SAF_MEDIA_TAP);
+	SWITCH_ADD_API(api_interface, "uuid_whisper_transcribe", "Continuous whisper transcription", whisper_transcribe_api_function, WHISPER_TRANSCRIBE_API_SYNTAX);
+	switch_console_set_complete("add uuid_whisper_transcribe ::console::list_uuid start");
+	switch_console_set_complete("add uuid_whisper_transcribe ::console::list_uuid stop");
+	SWITCH_ADD_APP(app_interface, "whisper_preconnect", "Preconnect whisper ASR/TTS", "Connect to the ASR and TTS servers ahead of the first detect_speech and speak",
+				   whisper_preconnect_app_function, WHISPER_PRECONNECT_SYNTAX, SAF_NONE);
+
+	whisper_batch_load(module_interface);
 
 	return SWITCH_STATUS_SUCCESS;
 }
@@ -693,6 +2572,14 @@ SWITCH_MODULE_SHUTDOWN_FUNCTION(mod_whisper_shutdown)
 	// ks_shutdown();
 
 	switch_event_unbind(&NODE);
+	switch_event_unbind(&ANSWER_NODE);
+	whisper_batch_shutdown();
+	whisper_slot_stop();
+	whisper_timer_stop();
+	whisper_capture_stop();
+	whisper_event_stop();
+	whisper_grammar_shutdown();
+	whisper_language_shutdown();
 	return SWITCH_STATUS_SUCCESS;
 }
 
@@ -5,8 +5,30 @@
 #include <netinet/tcp.h>
 #include <libks/ks.h>
 #include <libwebsockets.h>
+#include "whisper_ring.h"
+#include "whisper_capture.h"
+#include "whisper_dsp.h"
+#include "whisper_timer.h"
+#include "whisper_json.h"
+#include "whisper_grammar.h"
+#include "whisper_event.h"
+#include "whisper_language.h"
 
-#define AUDIO_BLOCK_SIZE 3200
+#define AUDIO_CHUNK_MS 100
+#define AUDIO_CHUNK_MIN_MS 20
+#define AUDIO_CHUNK_MAX_MS 1000
+#define AUDIO_RING_SIZE 131072
+#define AUDIO_BATCH_MAX_MS 30000
+#define CTL_RING_SIZE 1024
+#define BARGE_IN_WAIT_MS 500
+#define PARTIAL_MS 500
+#define CONNECT_TIMEOUT_MS 5000
+#define FAST_MIN_CONFIDENCE 60
+#define WHISPER_SUMMARY_TURNS 64
+#define WHISPER_SUMMARY_PRIVATE "__whisper_summary"
+#define PRECONNECT_IDLE_MS 30000
+#define WHISPER_RESULT_MAX 8192
+#define WHISPER_RESULT_FRESH 0x4
 #define SPEECH_BUFFER_SIZE 49152
 #define SPEECH_BUFFER_SIZE_MAX 4194304
 
@@ -19,32 +41,214 @@ typedef enum {
 	ASRFLAG_RESULT_PENDING = (1 << 5),
 	ASRFLAG_RESULT_READY = (1 << 6),
 	ASRFLAG_RETURNED_RESULT = (1 << 7),
-	ASRFLAG_TIMEOUT = (1 << 8)
+	ASRFLAG_TIMEOUT = (1 << 8),
+	ASRFLAG_RESULT_TIMEOUT = (1 << 9),
+	ASRFLAG_PARTIAL_READY = (1 << 10),
+	ASRFLAG_FAST_RESULT = (1 << 11)
 } whisper_flag_t;
 
+/*
+ * The ASRFLAG_* word is shared by the media thread (feed, check_results, get_results), the lws
+ * thread (replies) and the timer wheel (timeouts), and is only changed through these transitions. Each one is applied with a
+ * single compare-and-swap when all of its "need" bits are set and none of its "deny" bits are, so
+ * a reader always sees a whole state and two threads racing for the same turn cannot both win.
+ *
+ *   transition          thread   need                      deny                                   set / clear
+ *   RESET               media    -                         -                                      READY / all
+ *   PAUSE               media    -                         -                                      - / all
+ *   INPUT_TIMERS        media    -                         INPUT_TIMERS                           INPUT_TIMERS
+ *   NO_INPUT_TIMERS     media    -                         -                                      - / INPUT_TIMERS
+ *   START_OF_SPEECH     media    READY                     START_OF_SPEECH                        START_OF_SPEECH
+ *   END_OF_SPEECH       media    READY                     -                                      RESULT_PENDING / READY
+ *   PARTIAL             lws      START_OF_SPEECH           RESULT_PENDING, RESULT_READY, RETURNED PARTIAL_READY
+ *   FAST_PARTIAL        media    RESULT_PENDING            RESULT_READY, RETURNED                 PARTIAL_READY
+ *   RETURN_PARTIAL      media    PARTIAL_READY             -                                      - / PARTIAL_READY
+ *   RESULT              lws      -                         RESULT_TIMEOUT, FAST_RESULT            RESULT_READY / RESULT_PENDING, PARTIAL_READY
+ *   FAST_RESULT         media    RESULT_PENDING            RESULT_READY, RESULT_TIMEOUT           RESULT_READY, FAST_RESULT / RESULT_PENDING, PARTIAL_READY
+ *   NOINPUT_TIMEOUT     timer    INPUT_TIMERS              START_OF_SPEECH, RESULT_READY, NOINPUT NOINPUT_TIMEOUT
+ *   SPEECH_TIMEOUT      timer    START_OF_SPEECH           TIMEOUT, RESULT_READY, NOINPUT         TIMEOUT
+ *   RESULT_TIMEOUT      timer    RESULT_PENDING            -                                      RESULT_TIMEOUT / RESULT_PENDING
+ *   RETURN_START        media    START_OF_SPEECH           RETURNED_START_OF_SPEECH               RETURNED_START_OF_SPEECH
+ *   RETURN_RESULT       media    -                         RETURNED_RESULT                        RETURNED_RESULT / READY
+ */
+typedef enum {
+	WHISPER_T_RESET,
+	WHISPER_T_PAUSE,
+	WHISPER_T_INPUT_TIMERS,
+	WHISPER_T_NO_INPUT_TIMERS,
+	WHISPER_T_START_OF_SPEECH,
+	WHISPER_T_END_OF_SPEECH,
+	WHISPER_T_PARTIAL,
+	WHISPER_T_FAST_PARTIAL,
+	WHISPER_T_RETURN_PARTIAL,
+	WHISPER_T_RESULT,
+	WHISPER_T_FAST_RESULT,
+	WHISPER_T_NOINPUT_TIMEOUT,
+	WHISPER_T_SPEECH_TIMEOUT,
+	WHISPER_T_RESULT_TIMEOUT,
+	WHISPER_T_RETURN_START,
+	WHISPER_T_RETURN_RESULT
+} whisper_transition_t;
+
+#define whisper_state(_c) __atomic_load_n(&(_c)->flags, __ATOMIC_ACQUIRE)
+
+/* text frame queued behind the audio that was written before it (mark is the audio write position) */
+typedef struct {
+	switch_size_t mark;
+	const char *text;
+} whisper_tx_msg_t;
+
+/* monotonic (switch_time_ref) stamps of the current utterance, the lws thread writes the sent and received ones */
+typedef struct {
+	switch_time_t onset;
+	switch_time_t last_voice;
+	switch_time_t vad_stop;
+	volatile switch_time_t last_sent;
+	volatile switch_time_t eof_sent;
+	volatile switch_time_t first_partial;
+	volatile switch_time_t result;
+	switch_time_t consumed;
+} whisper_stamps_t;
+
+/* reply slot, three per session allocated with it and reused for every turn, reply points into text */
+typedef struct {
+	switch_size_t len;
+	char text[WHISPER_RESULT_MAX];
+	whisper_reply_t reply;
+} whisper_result_t;
+
+typedef enum {
+	WHISPER_SEND_STREAM = 0,
+	WHISPER_SEND_BATCH
+} whisper_send_mode_t;
+
+/* named server / transport settings from whisper.conf, never freed so sessions can keep a pointer across reloads */
+typedef struct whisper_profile_s {
+	char *name;
+	char *asr_server_url;
+	uint32_t chunk_ms;
+	uint32_t chunk_min_ms;
+	uint32_t chunk_max_ms;
+	int chunk_adaptive;
+	whisper_send_mode_t send_mode;
+	uint32_t batch_max_ms;
+	uint32_t connect_timeout_ms;
+	char *fast_profile;			/* closed-set grammars are tried there first */
+	uint32_t fast_min_confidence;
+	int two_pass;
+	uint32_t reuse_idle_ms;		/* a closed handle's connection is kept this long for the channel's next one, 0 to close it */
+	struct whisper_profile_s *next;
+} whisper_profile_t;
+
+/* the channel's totals over all of its ASR and TTS handles, kept as channel private data and set as variables at every close */
+typedef struct {
+	uint32_t utterances;
+	double audio_sec;
+	switch_size_t bytes_sent;
+	switch_size_t bytes_recv;
+	switch_size_t fast_bytes_sent;
+	switch_size_t fast_bytes_recv;
+	uint32_t connects;
+	uint32_t connect_ms_max;
+	uint32_t dropped_frames;
+	uint32_t result_ms[WHISPER_SUMMARY_TURNS];
+	uint32_t results_timed;
+	uint32_t tts_requests;
+	switch_size_t tts_bytes_recv;
+	uint32_t ttfb_count;
+	switch_time_t ttfb_total_ms;
+	uint32_t ttfb_max_ms;
+} whisper_summary_t;
+
+/* a connection's counters as of its last close, a reused one only adds what came since */
 typedef struct {
-	uint32_t flags;
-	char *result_text;
+	int connected;
+	uint32_t utterances;
+	switch_size_t audio_bytes;
+	switch_size_t bytes_sent;
+	switch_size_t bytes_recv;
+	uint32_t dropped_frames;
+	uint32_t results_timed;
+} whisper_summary_mark_t;
+
+typedef struct whisper_s whisper_t;
+
+/* called on the lws thread for every final reply when set, instead of raising ASRFLAG_RESULT_READY */
+typedef void (*whisper_result_handler_t)(whisper_t *context, whisper_reply_t *reply);
+
+struct whisper_s {
+	uint32_t flags;		/* ASRFLAG_*, read with whisper_state() and changed with whisper_transition() */
+	const char *result_text;
 	double result_confidence;
+	whisper_result_t *result;	/* the reply being returned, NULL until the server sent one this turn */
+	whisper_return_t return_json;
 	uint32_t thresh;
 	uint32_t silence_ms;
 	uint32_t voice_ms;
 	int no_input_timeout;
 	int speech_timeout;
+	int result_timeout;
 	switch_bool_t start_input_timers;
 	switch_time_t no_input_time;
 	switch_time_t speech_time;
+
+	/* deadlines on the shared timer wheel, expiry only applies a transition */
+	whisper_timer_t noinput_timer;
+	whisper_timer_t speech_timer;
+	whisper_timer_t result_timer;
+	whisper_timer_t connect_timer;
 	char *grammar;
+	whisper_grammar_t *grammar_ref;	/* registry entry held while the grammar is loaded */
+	volatile int grammar_resend;		/* set on the lws thread when the server lost it */
+
+	/*
+	 * closed-set grammars: the turn goes to the fast profile's connection and is kept in replay,
+	 * which is sent to this connection when the fast result is missing or not confident enough
+	 */
+	whisper_t *fast;
+	int fast_failed;
+	uint32_t closed_set;
+	int routed;
+	int replaying;
+	uint8_t *replay;
+	switch_size_t replay_len;
+	switch_size_t replay_pos;
+	switch_size_t replay_max;
+	const char *route;
+
+	/*
+	 * two-pass: every turn goes to both connections, the fast reply is returned as a partial, or as
+	 * the result when confident; the reply here then replaces it, or is fired as a correction
+	 */
+	int two_pass;
+	int refining;
+	volatile int refined;
+	uint32_t corrections;
 	char *channel_uuid;
 	switch_vad_t *vad;
-	switch_buffer_t *audio_buffer;
+	whisper_ring_t *audio_ring;
+	whisper_ring_t *ctl_ring;
+	whisper_capture_t *capture;
+	whisper_hpf_t hpf;
+	whisper_ns_t ns;
+	whisper_agc_t agc;
+	int16_t dsp_buf[SWITCH_RECOMMENDED_BUFFER_SIZE / 2];
+
+	/* barge-in, session is the channel that owns the ASR handle (NULL for the other users) */
+	whisper_onset_t onset;
+	switch_core_session_t *session;
+	switch_time_t barge_onset;
+	switch_time_t barge_at;
+
 	switch_mutex_t *mutex;
 	kws_t *ws;
-	int partial;
 	switch_memory_pool_t *pool;
+	switch_memory_pool_t *reuse_pool;	/* pool is our own when the context may be parked after close (whisper_slot) */
+	uint32_t rate;
 
 	/* thread related members */
 	switch_mutex_t *wsi_mutex;
+	switch_thread_t *thread;
 	int started;
 	switch_bool_t wc_connected;
 	switch_bool_t wc_error;
@@ -52,20 +256,115 @@ typedef struct {
 	struct lws_context *lws_context;
 	struct lws_context_creation_info lws_info;
 	struct lws_client_connect_info lws_ccinfo;
-} whisper_t;
+
+	/* chunking, chunk_bytes is retuned on the lws thread when the profile is adaptive */
+	whisper_profile_t *profile;
+	volatile uint32_t chunk_bytes;
+	uint32_t chunk_min;
+	uint32_t chunk_max;
+	int chunk_adaptive;
+	uint8_t *tx_buf;
+	switch_time_t ping_sent;
+	switch_time_t last_ping;
+	switch_time_t last_adapt;
+	switch_time_t last_text;
+	uint32_t rtt_ms;
+	uint32_t partial_ms;
+
+	/* server partials, asked for with the partial param and forwarded at most every partial_interval ms */
+	int partial;
+	uint32_t partial_interval;
+	switch_time_t last_partial;
+	uint32_t partials;
+
+	/* batch mode holds the utterance in audio_ring and sends it when the eof is queued */
+	whisper_send_mode_t send_mode;
+	switch_size_t ring_size;
+
+	/* transport stats, written on the lws thread */
+	uint32_t frames_sent;
+	switch_size_t bytes_sent;
+	switch_time_t busy_start;
+	switch_time_t busy_us;
+	switch_size_t bytes_recv;
+	whisper_stamps_t stamps;
+
+	/* per call summary, added to the channel's whisper_summary_t at close (the last WHISPER_SUMMARY_TURNS result latencies) */
+	uint32_t connect_ms;
+	uint32_t utterances;
+	switch_size_t audio_bytes;		/* speech queued by the media thread, once whatever connections it went to */
+	uint32_t dropped_frames;
+	uint32_t result_ms[WHISPER_SUMMARY_TURNS];
+	uint32_t results_timed;
+	whisper_summary_mark_t summarized;
+
+	/*
+	 * triple buffered replies: the lws thread fills results[result_back] and swaps it into result_mid
+	 * (flagged WHISPER_RESULT_FRESH), the media thread swaps result_front with a fresh result_mid
+	 */
+	whisper_result_t *results;
+	uint32_t result_back;
+	uint32_t result_mid;
+	uint32_t result_front;
+
+	/* continuous transcription (whisper_transcribe) */
+	whisper_result_handler_t result_handler;
+	void *user_data;
+	uint32_t segments;
+	int channels;
+
+	/* events carry every channel variable instead of Unique-ID only */
+	int event_channel_data;
+
+	/* language hint sent to the server (empty: it detects), caller is the key results are learned under */
+	char language[WHISPER_LANGUAGE_MAX];
+	const char *caller;
+
+	/* file jobs are offline, everything else counts as a live session */
+	int offline;
+	int live;
+};
 
 
 
+typedef struct {
+	switch_vad_t *vad;
+	whisper_hpf_t hpf;
+	whisper_ns_t ns;
+	whisper_agc_t agc;
+	const char *speaker;
+	uint32_t utt_samples;
+} whisper_leg_t;
+
+typedef struct {
+	whisper_t asr;
+	switch_audio_resampler_t *resampler;
+	int channels;
+	whisper_leg_t legs[2];
+	int16_t frame[SWITCH_RECOMMENDED_BUFFER_SIZE];
+	int16_t chan[2][SWITCH_RECOMMENDED_BUFFER_SIZE / 2];
+} whisper_transcribe_t;
+
 typedef struct {
 	char *text;
 	char *voice;
 	int samplerate;
 	const char *channel_uuid;
 	switch_memory_pool_t *pool;
+	switch_memory_pool_t *reuse_pool;	/* pool is our own when preconnected (whisper_preconnect) */
 	switch_buffer_t *audio_buffer;
 	kws_t *ws;
+	whisper_timer_t connect_timer;
+	/* time to first byte of each text, for the summary set on the channel at close */
+	switch_time_t feed_at;
+	uint32_t requests;
+	uint32_t ttfb_count;
+	switch_time_t ttfb_total_ms;
+	uint32_t ttfb_max_ms;
+	switch_size_t bytes_recv;
 	/* thread related members */
 	switch_mutex_t *wsi_mutex;
+	switch_thread_t *thread;
 	int started;
 	switch_bool_t wc_connected;
 	switch_bool_t wc_error;
@@ -90,15 +389,41 @@ int callback_ws_asr(struct lws *wsi, enum lws_callback_reasons reason,
 
 struct whisper_globals {
 	char *asr_server_url;
+	whisper_profile_t *default_profile;
+	whisper_profile_t *profiles;
 	char *tts_server_url;
-	int return_json;
+	whisper_return_t return_json;
 	int auto_reload;
+	char *record_sent_audio;
+	uint32_t record_max_bandwidth;
+	uint32_t record_buffer_size;
+	whisper_hpf_t hpf;
+	whisper_ns_t ns;
+	whisper_agc_t agc;
+	whisper_onset_t onset;
+	uint32_t batch_max_connections;
+	uint32_t grammar_cache_size;
+	uint32_t closed_set_max;
+	int event_channel_data;
+	uint32_t language_cache_size;
+	volatile uint32_t live_sessions;
 	switch_memory_pool_t *pool;
 	ks_pool_t *ks_pool;
 };
 
+extern struct whisper_globals whisper_globals;
+
+/* shared by the ASR interface, whisper_transcribe and the file jobs */
+switch_status_t whisper_asr_setup(whisper_t *context, switch_memory_pool_t *pool, uint32_t rate, const char *profile_name);
+void whisper_asr_teardown(whisper_t *context);
+void whisper_asr_free(whisper_t *context);
+void whisper_tts_free(whisper_tts_t *context);
+void whisper_set_param(whisper_t *context, const char *param, const char *val);
+switch_bool_t whisper_transition(whisper_t *context, whisper_transition_t transition);
+
  
 #define WS_STATE_STARTED 0
 #define WS_STATE_DESTROY 1
 #define WS_TIMEOUT_MS 50  /* same as ptime on the RTP side , lws_service()*/
+#define WS_PING_TIMEOUT_MS 2500  /* a probe without a pong by then counts as an RTT this long */
 #endif
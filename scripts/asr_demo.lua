@@ -22,6 +22,8 @@ function onInput(s, type, obj)
         if ( event == "detected-speech" ) then
             -- freeswitch.consoleLog("info", "\n" .. obj:serialize() .. "\n");
             local text = obj:getBody();
+            -- return-json=1 results, the text is all this demo needs
+            text = text:match('"text":%s*"(.-)"') or text;
             if ( text ~= "(null)" ) then
                 -- Pause speech detection (this is on auto but pausing it just in case)
                 session:execute("detect_speech", "pause");
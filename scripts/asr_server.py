@@ -10,9 +10,39 @@ import logging
 import os
 import whisper
 import json
+import math
+import time
+import torch
+from collections import OrderedDict
 
-# Load model
-model = whisper.load_model("base")
+# Load model, a smaller one (tiny) makes a fast tier for closed-set grammars
+model = whisper.load_model(os.environ.get('WHISPER_MODEL', 'base'))
+
+
+# grammars shared by all connections, keyed by the id the client computes from the text
+grammars = OrderedDict()
+GRAMMAR_CACHE_SIZE = int(os.environ.get('WHISPER_GRAMMAR_CACHE_SIZE', 256))
+
+
+async def load_grammar(websocket, request, prompt_grammar):
+    # {"grammar_id", "grammar"?, "grammar_evict"?}, or a bare {"grammar"} from older clients
+    for gid in request.get('grammar_evict', []):
+        grammars.pop(gid, None)
+    gid = request.get('grammar_id')
+    if 'grammar' in request:
+        if gid:
+            grammars[gid] = request['grammar']
+            grammars.move_to_end(gid)
+            while len(grammars) > GRAMMAR_CACHE_SIZE:
+                grammars.popitem(last=False)
+        return request['grammar']
+    if gid in grammars:
+        grammars.move_to_end(gid)
+        return grammars[gid]
+    if gid:
+        # the client uploads it again
+        await websocket.send(json.dumps({"error": "grammar_miss", "grammar_id": gid}))
+    return prompt_grammar
 
 
 def process_chunk(message):
@@ -25,13 +55,121 @@ def process_chunk(message):
     else:
         audio = np.frombuffer(message, np.int16)
         return audio, False    
-    
-    
+
+
+def reply(result, language, **extra):
+    # confidence 0-1 from the mean token log probability
+    return json.dumps(dict(extra, text=result.text, confidence=round(math.exp(result.avg_logprob), 3), language=language))
+
+
+def language_hint(message):
+    # {"language": "de"} from the client, "" (or null) to detect again
+    if type(message) is str and 'language' in message:
+        request = json.loads(message)
+        if 'language' in request and 'grammar' not in request and 'grammar_id' not in request:
+            return True, request['language'] or None
+    return False, None
+
+
+def channels_request(message):
+    # {"channels": 2} from the client opens a multichannel session, 0 otherwise
+    if type(message) is str and 'channels' in message:
+        request = json.loads(message)
+        if 'channels' in request:
+            return int(request['channels'])
+    return 0
+
+
+def detect_languages(mel, hint):
+    # one per mel of the batch, decoded and reported alike; a hint saves the encoder pass and the language scoring
+    if hint:
+        return [hint] * len(mel)
+    _, probs = model.detect_language(mel)
+    languages = [max(p, key=p.get) for p in probs]
+    print(f"Detected languages: {languages}")
+    return languages
+
+
+def transcribe(buffers, prompt_grammar, hint=None):
+    # one batch for every channel that ended an utterance at the same time, one decode per language in it
+    mels = []
+    for audio in buffers:
+        audio = whisper.pad_or_trim(audio.astype(np.float32)*(1/32768.0))
+        mels.append(whisper.log_mel_spectrogram(audio))
+    mel = torch.stack(mels).to(model.device)
+
+    languages = detect_languages(mel, hint)
+    results = [None] * len(buffers)
+    for language in set(languages):
+        group = [i for i, l in enumerate(languages) if l == language]
+        options = whisper.DecodingOptions(language=language, fp16 = False, prompt=prompt_grammar)
+        for i, result in zip(group, whisper.decode(model, mel[group], options)):
+            results[i] = (result, language)
+    return results
+
+
+async def recognize_stereo(websocket, channels, prompt_grammar, hint):
+    # interleaved frames, every channel is cut by its own start/eof messages
+    buffers = [np.array([], np.int16) for _ in range(channels)]
+    active = [False] * channels
+    ready = []
+    loop = asyncio.get_running_loop()
+
+    while True:
+        # wait for the next message, but only briefly once an utterance is ready so a
+        # simultaneous eof on the other channel still makes it into the same batch
+        try:
+            message = await asyncio.wait_for(websocket.recv(), 0.005 if ready else None)
+        except asyncio.TimeoutError:
+            channels_done = sorted(set(ready))
+            ready = []
+            results = await loop.run_in_executor(pool, transcribe, [buffers[c] for c in channels_done], prompt_grammar, hint)
+            for c, (result, language) in zip(channels_done, results):
+                print(f"Result[{c}]: {result.text}")
+                await websocket.send(reply(result, language, channel=c))
+                buffers[c] = np.array([], np.int16)
+            continue
+
+        is_hint, language = language_hint(message)
+        if is_hint:
+            hint = language
+            continue
+
+        if type(message) is str:
+            request = json.loads(message)
+            c = int(request.get('channel', 0))
+            if 'grammar' in request or 'grammar_id' in request:
+                prompt_grammar = await load_grammar(websocket, request, prompt_grammar)
+            elif 'start' in request:
+                active[c] = True
+            elif 'eof' in request:
+                active[c] = False
+                ready.append(c)
+        else:
+            frames = np.frombuffer(message, np.int16).reshape(-1, channels)
+            for c in range(channels):
+                if active[c]:
+                    buffers[c] = np.append(buffers[c], frames[:, c])
+
+
+def decode_partial(audio, prompt_grammar, hint=None):
+    # interim hypothesis of the audio so far, no language detection
+    mel = whisper.log_mel_spectrogram(whisper.pad_or_trim(audio.astype(np.float32)*(1/32768.0))).to(model.device)
+    options = whisper.DecodingOptions(language=hint or "en", fp16 = False, prompt=prompt_grammar, without_timestamps=True)
+    return whisper.decode(model, mel, options)
+
+
 async def recognize(websocket):
     global args
     global pool
     full_audio_bytes = np.array([])
     prompt_grammar = ""
+    frames = 0
+    # {"partial": ms} from the client: decode the utterance so far every ms of new audio
+    partial_ms = 0
+    partial_at = 0
+    # language hint of the session, None to detect it on every utterance
+    hint = None
 
     loop = asyncio.get_running_loop()
 
@@ -39,36 +177,60 @@ async def recognize(websocket):
 
     while True:
         message = await websocket.recv()
+
+        channels = channels_request(message)
+        if channels:
+            await recognize_stereo(websocket, channels, prompt_grammar, hint)
+            return
+
+        is_hint, language = language_hint(message)
+        if is_hint:
+            hint = language
+            continue
+
+        if type(message) is str and 'partial' in message and 'partial' in json.loads(message):
+            partial_ms = int(json.loads(message)['partial'])
+            continue
+
         response, stop = await loop.run_in_executor(pool, process_chunk, message)
     
         if type(response) == str:
             print('text response', response)
             if 'grammar' in response:
-                grammar = json.loads(response)
-                prompt_grammar = grammar['grammar']
+                prompt_grammar = await load_grammar(websocket, json.loads(response), prompt_grammar)
             
         if type(response) == np.ndarray:
             full_audio_bytes = np.append(full_audio_bytes, response)
-            print('response', response)
+            frames += 1
+
+            if partial_ms and len(full_audio_bytes) - partial_at >= partial_ms * args.sample_rate / 1000:
+                partial_at = len(full_audio_bytes)
+                result = await loop.run_in_executor(pool, decode_partial, full_audio_bytes, prompt_grammar, hint)
+                await websocket.send(json.dumps({"partial": True, "text": result.text}))
             
         
         if stop: 
+            # per utterance load figures, to compare stream and batch (send-mode) clients
+            samples = len(full_audio_bytes)
+            cpu = time.thread_time()
+
             full_audio_bytes = whisper.pad_or_trim(full_audio_bytes)
 
             # make log-Mel spectrogram and move to the same device as the model
             mel = whisper.log_mel_spectrogram(full_audio_bytes.astype(np.float32)*(1/32768.0)).to(model.device)
 
-            # detect the spoken language
-            _, probs = model.detect_language(mel)
-            print(f"Detected language: {max(probs, key=probs.get)}")
+            language = detect_languages(mel.unsqueeze(0), hint)[0]
 
             # decode the audio
-            options = whisper.DecodingOptions(language="en", fp16 = False, prompt=prompt_grammar)
+            options = whisper.DecodingOptions(language=language, fp16 = False, prompt=prompt_grammar)
             result = whisper.decode(model, mel, options)
             print(f"Result: {result.text}")
+            logging.info('Utterance: %d frames, %d samples, decode %.3fs cpu', frames, samples, time.thread_time() - cpu)
             
-            await websocket.send(result.text)
+            await websocket.send(reply(result, language))
             full_audio_bytes = np.array([])
+            frames = 0
+            partial_at = 0
             #break
     
 
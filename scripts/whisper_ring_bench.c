@@ -0,0 +1,172 @@
+/*
+ * Microbenchmark of the ASR audio path: 20 ms frames written by the media thread and read back in
+ * 100 ms chunks by the lws thread, through whisper_ring and through the dynamic switch_buffer
+ * guarded by a nested mutex that it replaced. Built on demand, against libfreeswitch:
+ *
+ *   make whisper_ring_bench && ./whisper_ring_bench [frames]
+ *
+ * Prints ns per frame (one write, and a fifth of a chunk read) for both, on one thread and with a
+ * producer and a consumer thread.
+ */
+
+#include <switch.h>
+#include <sched.h>
+#include "whisper_ring.h"
+
+#define BENCH_FRAME 640			/* 20 ms of 16 kHz L16 */
+#define BENCH_CHUNK 3200		/* AUDIO_BLOCK_SIZE, the frame the lws thread sent */
+#define BENCH_RING 65536
+#define BENCH_FRAMES 10000000
+
+typedef struct {
+	whisper_ring_t *ring;
+	switch_buffer_t *buffer;
+	switch_mutex_t *mutex;
+	uint32_t frames;
+	uint8_t out[BENCH_CHUNK];
+} bench_t;
+
+static int bench_ring_write(bench_t *b, const uint8_t *frame)
+{
+	return whisper_ring_write(b->ring, frame, BENCH_FRAME) != 0;
+}
+
+/* as ws_asr_write_pending: framed in place, copied once into the tx buffer */
+static int bench_ring_read(bench_t *b)
+{
+	const void *data;
+
+	if (whisper_ring_peek(b->ring, &data) < BENCH_CHUNK) {
+		return 0;
+	}
+	memcpy(b->out, data, BENCH_CHUNK);
+	whisper_ring_consume(b->ring, BENCH_CHUNK);
+
+	return 1;
+}
+
+static int bench_buffer_write(bench_t *b, const uint8_t *frame)
+{
+	switch_size_t len;
+
+	switch_mutex_lock(b->mutex);
+	len = switch_buffer_write(b->buffer, frame, BENCH_FRAME);
+	switch_mutex_unlock(b->mutex);
+
+	return len != 0;
+}
+
+static int bench_buffer_read(bench_t *b)
+{
+	int n = 0;
+
+	switch_mutex_lock(b->mutex);
+	if (switch_buffer_inuse(b->buffer) >= BENCH_CHUNK) {
+		n = switch_buffer_read(b->buffer, b->out, BENCH_CHUNK) != 0;
+	}
+	switch_mutex_unlock(b->mutex);
+
+	return n;
+}
+
+typedef int (*bench_write_t)(bench_t *b, const uint8_t *frame);
+typedef int (*bench_read_t)(bench_t *b);
+
+static bench_read_t bench_reader;
+
+static void *SWITCH_THREAD_FUNC bench_consumer_run(switch_thread_t *thread, void *obj)
+{
+	bench_t *b = (bench_t *) obj;
+	uint32_t chunks = 0;
+
+	while (chunks < b->frames * BENCH_FRAME / BENCH_CHUNK) {
+		if (bench_reader(b)) {
+			chunks++;
+		} else {
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static double bench_single(bench_t *b, bench_write_t wr, bench_read_t rd)
+{
+	uint8_t frame[BENCH_FRAME] = { 0 };
+	switch_time_t start = switch_time_ref();
+	uint32_t i;
+
+	for (i = 0; i < b->frames; i++) {
+		wr(b, frame);
+		if ((i + 1) % (BENCH_CHUNK / BENCH_FRAME) == 0) {
+			rd(b);
+		}
+	}
+
+	return (double) (switch_time_ref() - start) * 1000 / b->frames;
+}
+
+static double bench_threaded(bench_t *b, bench_write_t wr, bench_read_t rd, switch_memory_pool_t *pool)
+{
+	uint8_t frame[BENCH_FRAME] = { 0 };
+	switch_threadattr_t *thd_attr = NULL;
+	switch_thread_t *thread;
+	switch_status_t st;
+	switch_time_t start;
+	uint32_t i;
+
+	bench_reader = rd;
+
+	switch_threadattr_create(&thd_attr, pool);
+	start = switch_time_ref();
+	switch_thread_create(&thread, thd_attr, bench_consumer_run, b, pool);
+
+	for (i = 0; i < b->frames;) {
+		if (wr(b, frame)) {
+			i++;
+		} else {
+			sched_yield();
+		}
+	}
+	switch_thread_join(&st, thread);
+
+	return (double) (switch_time_ref() - start) * 1000 / b->frames;
+}
+
+int main(int argc, char *argv[])
+{
+	switch_memory_pool_t *pool = NULL;
+	const char *err = NULL;
+	bench_t b = { 0 };
+	double ring, buffer;
+
+	b.frames = argc > 1 ? (uint32_t) atoi(argv[1]) : BENCH_FRAMES;
+	b.frames -= b.frames % (BENCH_CHUNK / BENCH_FRAME);
+
+	if (switch_core_init(SCF_MINIMAL, SWITCH_FALSE, &err) != SWITCH_STATUS_SUCCESS) {
+		fprintf(stderr, "switch_core_init: %s\n", switch_str_nil(err));
+		return 1;
+	}
+
+	switch_core_new_memory_pool(&pool);
+	whisper_ring_create(&b.ring, BENCH_RING, BENCH_CHUNK, pool);
+	switch_mutex_init(&b.mutex, SWITCH_MUTEX_NESTED, pool);
+	/* capped like the ring, a producer ahead of the consumer waits for it on both */
+	switch_buffer_create_dynamic(&b.buffer, BENCH_CHUNK, BENCH_CHUNK, BENCH_RING);
+
+	printf("%u frames of %u bytes, read in %u byte chunks, ns/frame\n", b.frames, BENCH_FRAME, BENCH_CHUNK);
+
+	ring = bench_single(&b, bench_ring_write, bench_ring_read);
+	buffer = bench_single(&b, bench_buffer_write, bench_buffer_read);
+	printf("single thread   whisper_ring %7.1f   switch_buffer %7.1f\n", ring, buffer);
+
+	ring = bench_threaded(&b, bench_ring_write, bench_ring_read, pool);
+	buffer = bench_threaded(&b, bench_buffer_write, bench_buffer_read, pool);
+	printf("two threads     whisper_ring %7.1f   switch_buffer %7.1f\n", ring, buffer);
+
+	switch_buffer_destroy(&b.buffer);
+	switch_core_destroy_memory_pool(&pool);
+	switch_core_destroy();
+
+	return 0;
+}
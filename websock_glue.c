@@ -2,6 +2,9 @@
 #include "websock_glue.h"
 #include <libwebsockets.h>
 
+/* queued by pointer, the lws thread knows the eof by it */
+static const char whisper_eof[] = "{\"eof\":\"true\"}";
+
 // libwebsocket protocols
 static struct lws_protocols ws_tts_protocols[] = {
 	{
@@ -48,7 +51,16 @@ int callback_ws_tts(struct lws *wsi, enum lws_callback_reasons reason, void *use
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "WS receiving TTS data\n");
 
 			if (lws_frame_is_binary(context->wsi)) {
-				switch_buffer_write(context->audio_buffer, in, len);				
+				switch_buffer_write(context->audio_buffer, in, len);
+				context->bytes_recv += len;
+				if (context->feed_at) {
+					uint32_t ttfb = (uint32_t) ((switch_time_ref() - context->feed_at) / 1000);
+
+					context->ttfb_total_ms += ttfb;
+					context->ttfb_max_ms = switch_max(context->ttfb_max_ms, ttfb);
+					context->ttfb_count++;
+					context->feed_at = 0;
+				}
 			} else {
 				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "WebSockets RX: Frame not received in binary mode");
 			}
@@ -73,6 +85,17 @@ int callback_ws_tts(struct lws *wsi, enum lws_callback_reasons reason, void *use
     }
     return 0;
 }
+/* connect deadlines on the timer wheel, the setup loops below give up once wc_error is raised */
+static void ws_tts_connect_expired(whisper_timer_t *timer, void *data)
+{
+	((whisper_tts_t *) data)->wc_error = TRUE;
+}
+
+static void ws_asr_connect_expired(whisper_timer_t *timer, void *data)
+{
+	((whisper_t *) data)->wc_error = TRUE;
+}
+
 switch_status_t ws_tts_setup_connection(char * tts_server_uri, whisper_tts_t *tech_pvt, switch_memory_pool_t *pool) {
 	whisper_tts_t *context = (whisper_tts_t *) tech_pvt;
 	int logs = LLL_USER | LLL_ERR | LLL_WARN;
@@ -120,14 +143,20 @@ switch_status_t ws_tts_setup_connection(char * tts_server_uri, whisper_tts_t *te
 			return SWITCH_CAUSE_DESTINATION_OUT_OF_ORDER;
 	}
 
+	whisper_timer_init(&context->connect_timer, ws_tts_connect_expired, context);
+	whisper_timer_arm(&context->connect_timer, whisper_globals.default_profile->connect_timeout_ms);
+
 	ws_tts_thread_launch(context, pool);
 
 	while (!(context->wc_connected || context->wc_error)) {
 		usleep(30000);
 	}
 
+	whisper_timer_cancel(&context->connect_timer);
+
 	if (context->wc_error == TRUE) {
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Websocket connect failed\n");
+			ws_tts_close_connection(context);
 			return SWITCH_STATUS_FALSE;
 	}
 
@@ -140,10 +169,10 @@ void ws_tts_thread_launch(whisper_tts_t *tech_pvt, switch_memory_pool_t *pool)
 	switch_threadattr_t *thd_attr = NULL;
 
 	switch_threadattr_create(&thd_attr, pool);
-	switch_threadattr_detach_set(thd_attr, 1);
 	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
 	tech_pvt->started = WS_STATE_STARTED;
 	switch_thread_create(&thread, thd_attr, ws_tts_thread_run, tech_pvt, pool);
+	tech_pvt->thread = thread;
 }
 
 // thread for handling websocket connection
@@ -155,15 +184,177 @@ void *SWITCH_THREAD_FUNC ws_tts_thread_run(switch_thread_t *thread, void *obj) {
     return NULL;
 }
 
+/* joins the service thread, as for ASR, so nothing touches the context (or its pool) after this returns */
 void ws_tts_close_connection(whisper_tts_t *tech_pvt) {
 	whisper_tts_t *context = (whisper_tts_t *) tech_pvt;
+	switch_status_t st;
 
-	lws_cancel_service(context->lws_context);
 	context->started = WS_STATE_DESTROY;
+
+	if (!context->lws_context) {
+		return;
+	}
+
+	if (context->thread) {
+		lws_cancel_service(context->lws_context);
+		switch_thread_join(&st, context->thread);
+		context->thread = NULL;
+	}
+
 	lws_context_destroy(context->lws_context);
+	context->lws_context = NULL;
+	context->wsi = NULL;
 }
 
 //ASR Functions
+
+/* bytes of audio per millisecond of the stream sent to the server */
+static uint32_t ws_asr_bytes_per_ms(whisper_t *context)
+{
+	return switch_max(context->rate * 2 * context->channels / 1000, 1);
+}
+
+/*
+ * lws thread, adaptive profiles only. A frame carries about half an RTT of audio so a slow link is
+ * not flooded with tiny frames, but no more than half the server's partial interval so streaming
+ * partials are not held back; a growing send backlog means the frames are too small to keep up.
+ */
+static void ws_asr_adapt_chunk(whisper_t *context, switch_size_t backlog)
+{
+	uint32_t bpm = ws_asr_bytes_per_ms(context);
+	uint32_t align = 2 * context->channels;
+	switch_size_t desired = context->chunk_bytes;
+	switch_time_t now = switch_micro_time_now();
+
+	if (now - context->last_adapt < 250000) {
+		return;
+	}
+	context->last_adapt = now;
+
+	if (context->rtt_ms) {
+		desired = (switch_size_t) context->rtt_ms / 2 * bpm;
+	}
+
+	if (context->partial_ms && desired > (switch_size_t) context->partial_ms / 2 * bpm) {
+		desired = (switch_size_t) context->partial_ms / 2 * bpm;
+	}
+
+	if (backlog > 2 * (switch_size_t) context->chunk_bytes && desired < backlog / 2) {
+		desired = backlog / 2;
+	}
+
+	desired = switch_max(desired, context->chunk_min);
+	desired = switch_min(desired, context->chunk_max);
+
+	/* move a quarter of the way per step so one noisy sample does not swing it */
+	desired = (3 * (switch_size_t) context->chunk_bytes + desired) / 4;
+	desired -= desired % align;
+
+	if (desired && desired != context->chunk_bytes) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "ASR chunk %u -> %u bytes (rtt %ums, partials %ums, backlog %" SWITCH_SIZE_T_FMT ")\n",
+						  context->chunk_bytes, (uint32_t) desired, context->rtt_ms, context->partial_ms, backlog);
+		context->chunk_bytes = (uint32_t) desired;
+	}
+}
+
+/* lws thread: one RTT sample of the ping probe, smoothed */
+static void ws_asr_rtt_sample(whisper_t *context, uint32_t rtt)
+{
+	context->rtt_ms = context->rtt_ms ? (7 * context->rtt_ms + rtt) / 8 : rtt;
+	context->last_ping = switch_micro_time_now();
+	context->ping_sent = 0;
+}
+
+/* lws thread: send the next audio chunk, or the next text frame once all audio queued before it is out */
+static int ws_asr_write_pending(whisper_t *context, struct lws *wsi)
+{
+	const whisper_tx_msg_t *msg = NULL;
+	const void *rec, *audio;
+	switch_size_t avail, limit;
+	uint32_t chunk = context->chunk_bytes;
+
+	/* the pong was lost, or the link is that slow: either way probing goes on */
+	if (context->ping_sent && switch_micro_time_now() - context->ping_sent >= (switch_time_t) WS_PING_TIMEOUT_MS * 1000) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_DEBUG, "ASR ping unanswered after %ums\n", WS_PING_TIMEOUT_MS);
+		ws_asr_rtt_sample(context, WS_PING_TIMEOUT_MS);
+	}
+
+	if (context->chunk_adaptive && context->send_mode == WHISPER_SEND_STREAM && !context->ping_sent && switch_micro_time_now() - context->last_ping >= 1000000) {
+		unsigned char ping[LWS_PRE];
+
+		context->ping_sent = switch_micro_time_now();
+		if (lws_write(wsi, ping + LWS_PRE, 0, LWS_WRITE_PING) < 0) {
+			return -1;
+		}
+		lws_callback_on_writable(wsi);
+		return 0;
+	}
+
+	if (whisper_ring_peek(context->ctl_ring, &rec) >= sizeof(*msg)) {
+		msg = (const whisper_tx_msg_t *) rec;
+	}
+
+	avail = whisper_ring_peek(context->audio_ring, &audio);
+	limit = avail;
+
+	if (msg && msg->mark - whisper_ring_read_pos(context->audio_ring) < limit) {
+		limit = msg->mark - whisper_ring_read_pos(context->audio_ring);
+	}
+
+	/* batch mode flushes at the eof in frames as large as allowed, or early if the utterance outgrows half the ring */
+	if (context->send_mode == WHISPER_SEND_BATCH) {
+		chunk = context->chunk_max;
+		if (!msg && whisper_ring_inuse(context->audio_ring) < context->ring_size / 2) {
+			limit = 0;
+		} else if (limit && limit < chunk) {
+			/* what is contiguous now, up to the wrap, the rest on the next writeable */
+			chunk = (uint32_t) limit;
+		}
+	}
+
+	if (limit >= chunk || (msg && limit > 0)) {
+		int rlen = (int) switch_min(limit, chunk);
+
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Sending data %d %d\n", rlen, context->started);
+
+		/* framed in place in the preallocated tx buffer, chunks can be far larger than a stack frame */
+		memcpy(context->tx_buf + LWS_PRE, audio, rlen);
+		if (lws_write(wsi, context->tx_buf + LWS_PRE, rlen, LWS_WRITE_BINARY) < 0) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Unable to write message \n");
+			return -1;
+		}
+		whisper_ring_consume(context->audio_ring, rlen);
+		context->stamps.last_sent = switch_time_ref();
+
+		if (!context->busy_start) {
+			context->busy_start = switch_micro_time_now();
+		}
+		context->frames_sent++;
+		context->bytes_sent += rlen;
+
+		if (context->chunk_adaptive && context->send_mode == WHISPER_SEND_STREAM) {
+			ws_asr_adapt_chunk(context, avail - rlen);
+		}
+	} else if (msg) {
+		if (ws_send_text(wsi, (char *) msg->text) != SWITCH_STATUS_SUCCESS) {
+			return -1;
+		}
+		whisper_ring_consume(context->ctl_ring, sizeof(*msg));
+		if (msg->text == whisper_eof) {
+			context->stamps.eof_sent = switch_time_ref();
+		}
+	} else {
+		return 0;
+	}
+
+	if (whisper_ring_inuse(context->ctl_ring) ||
+		whisper_ring_inuse(context->audio_ring) >= (context->send_mode == WHISPER_SEND_BATCH ? context->ring_size / 2 : context->chunk_bytes)) {
+		lws_callback_on_writable(wsi);
+	}
+
+	return 0;
+}
+
 int callback_ws_asr(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
 {
 	whisper_t *context = (whisper_t *)lws_wsi_user(wsi);
@@ -175,19 +366,72 @@ int callback_ws_asr(struct lws *wsi, enum lws_callback_reasons reason, void *use
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "WebSockets ASR client established. [%p]\n", (void *)wsi);
 			context->wc_connected = TRUE;
             break;
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+			/* woken up by ws_asr_kick(), wsi here is not ours so find the session through the lws context */
+			context = (whisper_t *)lws_context_user(lws_get_context(wsi));
+			if (context && context->wsi && context->wc_connected) {
+				lws_callback_on_writable(context->wsi);
+			}
+			break;
+        case LWS_CALLBACK_CLIENT_WRITEABLE:
+			return ws_asr_write_pending(context, wsi);
+        case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
+			if (context->ping_sent) {
+				ws_asr_rtt_sample(context, (uint32_t) ((switch_micro_time_now() - context->ping_sent) / 1000));
+			}
+			break;
         case LWS_CALLBACK_CLIENT_RECEIVE:
 			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "WS receiving ASR data\n");
+			context->bytes_recv += len;
 			if (!lws_frame_is_binary(context->wsi)) {
-				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Text: %s \n", (char *)in);
-				context->result_text = switch_safe_strdup((const char *)in); 
-			}
+				switch_time_t now = switch_micro_time_now();
 
-			switch_mutex_lock(context->mutex);
+				/* partial cadence: spacing of replies that follow each other closely (within 5s) */
+				if (context->last_text && now - context->last_text < 5000000) {
+					uint32_t gap = (uint32_t) ((now - context->last_text) / 1000);
 
-			switch_set_flag(context, ASRFLAG_RESULT_READY);
-			switch_clear_flag(context, ASRFLAG_RESULT_PENDING);
-			
-			switch_mutex_unlock(context->mutex);
+					context->partial_ms = context->partial_ms ? (3 * context->partial_ms + gap) / 4 : gap;
+				}
+				context->last_text = now;
+
+				/* from the first frame of a turn to its reply, the time the server holds this socket */
+				if (context->busy_start) {
+					context->busy_us += now - context->busy_start;
+					context->busy_start = 0;
+				}
+			}
+			if (!lws_frame_is_binary(context->wsi)) {
+				whisper_result_t *result = whisper_result_parse(context, (const char *)in, len);
+
+				/* the media thread uploads it again on its next frame, the ctl ring has a single producer */
+				if (result->reply.error && !strcmp(result->reply.error, "grammar_miss") && result->reply.grammar_id) {
+					switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_INFO, "Server lost grammar %s\n", result->reply.grammar_id);
+					whisper_grammar_miss(context->profile->asr_server_url, result->reply.grammar_id);
+					context->grammar_resend = 1;
+					break;
+				}
+
+				if (result->reply.partial) {
+					whisper_partial(context, result);
+					break;
+				}
+
+				if (context->result_handler) {
+					context->result_handler(context, &result->reply);
+					break;
+				}
+
+				switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Text: %.*s\n", (int) len, (char *)in);
+				if (!(whisper_state(context) & ASRFLAG_FAST_RESULT)) {
+					context->stamps.result = switch_time_ref();
+				}
+				whisper_result_publish(context);
+			}
+
+			/* two-pass: FAST_RESULT denies it once the fast reply went out as the result, the media thread decides between replacing and correcting */
+			if (!whisper_transition(context, WHISPER_T_RESULT) && (whisper_state(context) & ASRFLAG_FAST_RESULT)) {
+				__atomic_store_n(&context->refined, 1, __ATOMIC_RELEASE);
+			}
 			
             break;
 
@@ -216,6 +460,7 @@ switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_p
 	whisper_t *context = (whisper_t *) tech_pvt;
 	int logs = LLL_USER | LLL_ERR | LLL_WARN ;
 	const char *prot;
+	switch_time_t connect_start;
 
 	memset(&context->lws_info, 0, sizeof(context->lws_info));
 	memset(&context->lws_ccinfo, 0, sizeof(context->lws_ccinfo));
@@ -224,6 +469,7 @@ switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_p
 	context->lws_info.protocols = ws_asr_protocols;
 	context->lws_info.gid = -1;
 	context->lws_info.uid = -1;
+	context->lws_info.user = context;
 
 	lws_set_log_level(logs, NULL);
 
@@ -268,17 +514,26 @@ switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_p
 			return SWITCH_CAUSE_DESTINATION_OUT_OF_ORDER;
 	}
 
+	whisper_timer_init(&context->connect_timer, ws_asr_connect_expired, context);
+	whisper_timer_arm(&context->connect_timer, context->profile->connect_timeout_ms);
+
+	connect_start = switch_time_ref();
 	ws_asr_thread_launch(context, pool);
 
 	while (!(context->wc_connected || context->wc_error)) {
 		switch_sleep(10000);
 	}	
 
+	whisper_timer_cancel(&context->connect_timer);
+
 	if (context->wc_error == TRUE) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Websocket ASR connect to %s failed or timed out after %ums\n", asr_server_uri, context->profile->connect_timeout_ms);
 			ws_asr_close_connection(context);
 			return SWITCH_STATUS_FALSE;
 	}
 
+	context->connect_ms = (uint32_t) ((switch_time_ref() - connect_start) / 1000);
+
 	return SWITCH_STATUS_SUCCESS;
 }
 
@@ -288,10 +543,10 @@ void ws_asr_thread_launch(whisper_t *tech_pvt, switch_memory_pool_t *pool)
 	switch_threadattr_t *thd_attr = NULL;
 
 	switch_threadattr_create(&thd_attr, pool);
-	switch_threadattr_detach_set(thd_attr, 1);
 	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
 	tech_pvt->started = WS_STATE_STARTED;
 	switch_thread_create(&thread, thd_attr, ws_asr_thread_run, tech_pvt, pool);
+	tech_pvt->thread = thread;
 }
 
 // thread for handling websocket connection
@@ -302,18 +557,74 @@ void *SWITCH_THREAD_FUNC ws_asr_thread_run(switch_thread_t *thread, void *obj) {
 		n = lws_service(context->lws_context, WS_TIMEOUT_MS);
 	}
 
-	lws_context_destroy(context->lws_context);
+	context->started = WS_STATE_DESTROY;
 	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Exiting ASR lws_service thread!\n");
 	return NULL;
 }
 
+/* joins the service thread so nothing touches the context (or its rings) after this returns */
 void ws_asr_close_connection(whisper_t *tech_pvt) {
 	whisper_t *context = (whisper_t *) tech_pvt;
+	switch_status_t st;
 
 	context->started = WS_STATE_DESTROY;
 
-	lws_cancel_service(context->lws_context);	
-	
+	if (!context->lws_context) {
+		return;
+	}
+
+	if (context->thread) {
+		lws_cancel_service(context->lws_context);
+		switch_thread_join(&st, context->thread);
+		context->thread = NULL;
+	}
+
+	lws_context_destroy(context->lws_context);
+	context->lws_context = NULL;
+	context->wsi = NULL;
+}
+
+/* media thread: wake the lws thread so it asks for a writeable callback */
+void ws_asr_kick(whisper_t *context)
+{
+	if (context->lws_context && context->started == WS_STATE_STARTED) {
+		lws_cancel_service(context->lws_context);
+	}
+}
+
+switch_status_t ws_asr_queue_audio(whisper_t *context, const void *data, switch_size_t len)
+{
+	switch_size_t inuse = whisper_ring_inuse(context->audio_ring);
+	switch_size_t wake = context->send_mode == WHISPER_SEND_BATCH ? context->ring_size / 2 : context->chunk_bytes;
+
+	if (!whisper_ring_write(context->audio_ring, data, len)) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	/* batch mode leaves the lws thread asleep until the eof is queued */
+	if (inuse < wake && inuse + len >= wake) {
+		ws_asr_kick(context);
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* text must stay valid until sent, use static strings or memory from the session pool */
+switch_status_t ws_asr_queue_text(whisper_t *context, const char *text)
+{
+	whisper_tx_msg_t msg;
+
+	msg.mark = whisper_ring_write_pos(context->audio_ring);
+	msg.text = text;
+
+	if (!whisper_ring_write(context->ctl_ring, &msg, sizeof(msg))) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_ERROR, "Control queue full, dropping %s\n", text);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	ws_asr_kick(context);
+
+	return SWITCH_STATUS_SUCCESS;
 }
 
 switch_status_t ws_send_binary(struct lws *websocket, void *data, int rlen) 
@@ -359,16 +670,10 @@ switch_status_t ws_send_json(struct lws *websocket, ks_json_t *json_object)
 
 switch_status_t whisper_get_final_transcription(whisper_t *context)
 {
-	ks_json_t *req = ks_json_create_object();
-
-	ks_json_add_string_to_object(req, "eof", "true");
-
-	if (ws_send_json(context->wsi, req) != SWITCH_STATUS_SUCCESS) {
-		ks_json_delete(&req);
+	if (ws_asr_queue_text(context, whisper_eof) != SWITCH_STATUS_SUCCESS) {
 		return SWITCH_STATUS_BREAK;
 	}
 
-	ks_json_delete(&req);
 	return SWITCH_STATUS_SUCCESS;
 }
 
@@ -400,21 +705,143 @@ switch_status_t whisper_get_speech_synthesis(whisper_tts_t *context)
 	return SWITCH_STATUS_SUCCESS;
 }
 
+/* effective transport settings, reported on the ASR events */
+void whisper_metrics_snapshot(whisper_t *context, whisper_metrics_t *metrics)
+{
+	metrics->profile = context->profile ? context->profile->name : NULL;
+	metrics->send_mode = context->send_mode == WHISPER_SEND_BATCH ? "batch" : "stream";
+	metrics->route = context->route;
+	metrics->chunk_bytes = context->chunk_bytes;
+	metrics->chunk_ms = context->chunk_bytes / ws_asr_bytes_per_ms(context);
+	metrics->rtt_ms = context->rtt_ms;
+	metrics->frames_sent = context->frames_sent;
+	metrics->bytes_sent = context->bytes_sent;
+	metrics->busy_ms = context->busy_us / 1000;
+}
+
+static int whisper_stamp_ms(switch_time_t from, switch_time_t to)
+{
+	return from && to >= from ? (int) ((to - from) / 1000) : -1;
+}
+
+void whisper_latency(whisper_t *context, whisper_latency_t *latency)
+{
+	whisper_stamps_t *s = &context->stamps;
+
+	latency->speech = whisper_stamp_ms(s->onset, s->vad_stop);
+	latency->vad_hangover = whisper_stamp_ms(s->last_voice, s->vad_stop);
+	latency->send = whisper_stamp_ms(s->vad_stop, s->last_sent);
+	latency->eof = whisper_stamp_ms(s->vad_stop, s->eof_sent);
+	latency->first_partial = whisper_stamp_ms(s->onset, s->first_partial);
+	latency->decode = whisper_stamp_ms(s->eof_sent, s->result);
+	latency->result = whisper_stamp_ms(s->vad_stop, s->result);
+	latency->consume = whisper_stamp_ms(s->result, s->consumed);
+	latency->total = whisper_stamp_ms(s->vad_stop, s->consumed);
+}
+
+/* lws thread: copies the reply into the back slot and scans it there, for the result handlers too */
+whisper_result_t *whisper_result_parse(whisper_t *context, const char *text, switch_size_t len)
+{
+	whisper_result_t *slot = &context->results[context->result_back];
+
+	if (len >= WHISPER_RESULT_MAX) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(context->channel_uuid), SWITCH_LOG_WARNING, "Result of %" SWITCH_SIZE_T_FMT " bytes truncated\n", len);
+		len = WHISPER_RESULT_MAX - 1;
+	}
+
+	memcpy(slot->text, text, len);
+	slot->text[len] = '\0';
+	slot->len = len;
+	whisper_reply_parse(slot->text, len, &slot->reply);
+
+	return slot;
+}
+
+/* lws thread: hands the back slot filled by whisper_result_parse over to the media thread */
+void whisper_result_publish(whisper_t *context)
+{
+	/* whatever was published and not taken yet becomes the next back slot */
+	context->result_back = __atomic_exchange_n(&context->result_mid, context->result_back | WHISPER_RESULT_FRESH, __ATOMIC_ACQ_REL) & ~WHISPER_RESULT_FRESH;
+}
+
+/*
+ * lws thread: an interim hypothesis of the utterance being spoken. Forwarded as a whisper::partial
+ * event and, for the ASR interface, through get_results as MORE_DATA, at most once every
+ * partial_interval ms; the ones coming in between or after the end of speech are dropped.
+ */
+void whisper_partial(whisper_t *context, whisper_result_t *result)
+{
+	switch_time_t now = switch_micro_time_now();
+	whisper_event_t *ev;
+	const char *uuid = context->channel_uuid;
+
+	if (!context->partial || (context->last_partial && now - context->last_partial < (switch_time_t) context->partial_interval * 1000)) {
+		return;
+	}
+
+	if (!context->result_handler && (whisper_state(context) & (ASRFLAG_RESULT_PENDING | ASRFLAG_RESULT_READY | ASRFLAG_RETURNED_RESULT))) {
+		return;
+	}
+
+	context->last_partial = now;
+	context->partials++;
+	if (!context->stamps.first_partial) {
+		context->stamps.first_partial = switch_time_ref();
+	}
+
+	if (!uuid && context->session) {
+		uuid = switch_core_session_get_uuid(context->session);
+	}
+
+	if ((ev = whisper_event_alloc())) {
+		ev->subclass = "whisper::partial";
+		switch_copy_string(ev->uuid, switch_str_nil(uuid), sizeof(ev->uuid));
+		whisper_event_header(ev, "Partial-Seq", "%u", context->partials);
+		if (context->channels > 1) {
+			whisper_event_header(ev, "Transcription-Channel", "%d", result->reply.channel ? 1 : 0);
+		}
+		whisper_event_body(ev, result->reply.best.text, result->reply.best.len);
+		whisper_event_queue(ev);
+	}
+
+	if (!context->result_handler) {
+		whisper_result_publish(context);
+		whisper_transition(context, WHISPER_T_PARTIAL);
+	}
+}
+
+/* media thread: the latest reply, valid until the next take, or NULL when nothing new was published */
+whisper_result_t *whisper_result_take(whisper_t *context)
+{
+	if (!(__atomic_load_n(&context->result_mid, __ATOMIC_ACQUIRE) & WHISPER_RESULT_FRESH)) {
+		return NULL;
+	}
+
+	context->result_front = __atomic_exchange_n(&context->result_mid, context->result_front, __ATOMIC_ACQ_REL) & ~WHISPER_RESULT_FRESH;
+
+	return &context->results[context->result_front];
+}
+
+/* media or lws thread: one enqueue, the dispatcher thread builds and fires the event */
 void whisper_fire_event(whisper_t *context, char * event_subclass) {
-			switch_event_t *event = NULL;
-			switch_core_session_t *session;
-			switch_channel_t *channel;
-			switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, event_subclass);
-			session = switch_core_session_locate(context->channel_uuid);
-			if (session) {
-				channel = switch_core_session_get_channel(session);
-				switch_channel_event_set_data(channel, event);
-				switch_core_session_rwunlock(session);
+			whisper_event_t *ev;
+
+			if (!(ev = whisper_event_alloc())) {
+				return;
 			}
 
-			if (switch_test_flag(context, ASRFLAG_TIMEOUT)) {
-				switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Stop-Reason", "timeout");
+			ev->subclass = event_subclass;
+			switch_copy_string(ev->uuid, switch_str_nil(context->channel_uuid), sizeof(ev->uuid));
+			ev->channel_data = context->event_channel_data;
+			if (whisper_state(context) & ASRFLAG_TIMEOUT) {
+				ev->stop_reason = "timeout";
+			}
+			ev->has_metrics = 1;
+			whisper_metrics_snapshot(context, &ev->metrics);
+			if (context->stamps.onset) {
+				ev->has_latency = 1;
+				whisper_latency(context, &ev->latency);
 			}
 
-			switch_event_fire(&event);	
+			whisper_event_queue(ev);
 }
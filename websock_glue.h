@@ -14,12 +14,21 @@ switch_status_t ws_asr_setup_connection(char * asr_server_uri, whisper_t *tech_p
 void *SWITCH_THREAD_FUNC ws_asr_thread_run(switch_thread_t *thread, void *obj);
 void ws_asr_thread_launch(whisper_t *tech_pvt, switch_memory_pool_t *pool);
 void ws_asr_close_connection(whisper_t *tech_pvt);
+void ws_asr_kick(whisper_t *context);
+switch_status_t ws_asr_queue_audio(whisper_t *context, const void *data, switch_size_t len);
+switch_status_t ws_asr_queue_text(whisper_t *context, const char *text);
 
 switch_status_t ws_send_binary(struct lws *websocket, void *data, int rlen); 
 
 switch_status_t ws_send_text(struct lws *websocket, char *text) ;
 switch_status_t ws_send_json(struct lws *websocket, ks_json_t *json_object) ;
 switch_status_t whisper_get_final_transcription(whisper_t *context);
+whisper_result_t *whisper_result_parse(whisper_t *context, const char *text, switch_size_t len);
+void whisper_result_publish(whisper_t *context);
+void whisper_partial(whisper_t *context, whisper_result_t *result);
+whisper_result_t *whisper_result_take(whisper_t *context);
+void whisper_metrics_snapshot(whisper_t *context, whisper_metrics_t *metrics);
+void whisper_latency(whisper_t *context, whisper_latency_t *latency);
 void whisper_fire_event(whisper_t *context, char * event_subclass);
 switch_status_t whisper_get_speech_synthesis(whisper_tts_t *context);
 
@@ -0,0 +1,1223 @@
+#include "mod_whisper.h"
+#include "websock_glue.h"
+#include "whisper_batch.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/*
+ * Offline transcription of recordings over the same websocket transport as live calls.
+ *
+ * A job owns a pool of ASR connections and a queue of files. Every file is mapped (or decoded when
+ * it is not 16kHz mono PCM), run through the same pre-filters and switch_vad segmentation as
+ * whisper_feed (including the speech timeout cut), and its segments are streamed at full speed.
+ * Every connection has a feeder thread that takes the next segment of the oldest file that still
+ * has one, keeps up to WHISPER_FILE_DEPTH of them in flight and remembers their order in a small
+ * FIFO: the server answers each eof in turn, so the lws thread pairs every reply with the head of
+ * that FIFO. The job thread queues the files and finalizes them once all their replies are in.
+ *
+ * whisper_transcribe_file is a job of one file whose transcript is fired as an event. whisper_batch
+ * walks a directory, writes one JSON per recording and a checkpoint so a restarted job skips what
+ * is already done.
+ */
+
+#define WHISPER_FILE_SYNTAX "<path> [profile] [connections=N] [out=<file.json>] [param=value ...]"
+#define WHISPER_BATCH_SYNTAX "start <dir> <outdir> [concurrency=N] [priority=normal|low] [profile=<name>] [param=value ...] | stop <id> | status [<id>]"
+#define WHISPER_FILE_SEND_SAMPLES 1600		/* handed to the ring per write, 100ms */
+#define WHISPER_FILE_WARMUP_SAMPLES 8000	/* audio before a segment the pre-filters settle on, 500ms */
+#define WHISPER_FILE_REPLY_TIMEOUT 60000000	/* us to wait for the last replies */
+#define WHISPER_BATCH_LOOKAHEAD 2			/* files mapped and queued per connection */
+#define WHISPER_BATCH_CHECKPOINT ".whisper_batch.checkpoint"
+
+typedef struct {
+	switch_size_t start;
+	switch_size_t end;
+	const char *text;
+	int failed;
+} whisper_segment_t;
+
+typedef struct whisper_file_s whisper_file_t;
+
+struct whisper_file_s {
+	switch_memory_pool_t *pool;
+	const char *name;
+	const char *path;
+	const char *out;
+	const int16_t *samples;
+	switch_size_t count;
+	void *map;
+	switch_size_t map_len;
+	int16_t *decoded;
+	whisper_segment_t *segments;
+	uint32_t nsegments;
+	uint32_t next;
+	uint32_t done;
+	uint32_t failed;
+	switch_time_t started;
+	whisper_file_t *next_file;
+};
+
+typedef struct {
+	whisper_file_t *file;
+	uint32_t idx;
+} whisper_file_ref_t;
+
+typedef struct whisper_file_job_s whisper_file_job_t;
+
+typedef struct {
+	whisper_t asr;
+	whisper_file_job_t *job;
+	switch_thread_t *thread;
+	uint32_t index;
+	int ready;
+	whisper_file_ref_t fifo[WHISPER_FILE_DEPTH];	/* segments sent and not answered yet, oldest first */
+	uint32_t fifo_head;
+	uint32_t fifo_len;
+	int16_t scratch[WHISPER_FILE_SEND_SAMPLES];	/* pre-filtered copy of the chunk being sent */
+} whisper_file_conn_t;
+
+struct whisper_file_job_s {
+	switch_memory_pool_t *pool;
+	switch_mutex_t *mutex;
+	uint32_t id;
+	const char *profile;
+	char *params[32];
+	char *values[32];
+	int nparams;
+	uint32_t nconns;
+	whisper_file_conn_t *conns;
+	int low_priority;
+	switch_time_t started;
+	volatile int stop;
+
+	/* guarded by mutex */
+	whisper_file_t *files;
+	uint32_t queued;
+	uint32_t feeders;
+	volatile int closed;
+
+	/* whisper_transcribe_file */
+	whisper_file_t *single;
+
+	/* whisper_batch, the counters are read by status under batch_globals.mutex */
+	const char *dir;
+	const char *outdir;
+	FILE *checkpoint;
+	switch_hash_t *finished;
+	uint32_t total;
+	uint32_t completed;
+	uint32_t skipped;
+	uint32_t failed_files;
+	uint32_t segments;
+	uint32_t failed_segments;
+	switch_size_t audio_samples;
+
+	whisper_file_job_t *next;
+};
+
+static struct {
+	switch_mutex_t *mutex;
+	uint32_t next_id;
+	uint32_t connections;		/* held by directory jobs, capped by batch-max-connections */
+	whisper_file_job_t *jobs;
+	volatile uint32_t running;
+	volatile int shutdown;
+} batch_globals;
+
+/* lws thread: the reply belongs to the oldest segment still waiting on this connection */
+static void whisper_file_on_result(whisper_t *context, whisper_reply_t *reply)
+{
+	whisper_file_conn_t *conn = (whisper_file_conn_t *) context->user_data;
+	whisper_file_job_t *job = conn->job;
+
+	switch_mutex_lock(job->mutex);
+	if (conn->fifo_len) {
+		whisper_file_ref_t *ref = &conn->fifo[conn->fifo_head];
+
+		ref->file->segments[ref->idx].text = switch_core_sprintf(ref->file->pool, "%.*s", (int) reply->best.len, reply->best.text);
+		ref->file->done++;
+		conn->fifo_head = (conn->fifo_head + 1) % WHISPER_FILE_DEPTH;
+		conn->fifo_len--;
+	} else {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Job %u: unexpected reply %.*s\n", job->id, (int) reply->best.len, reply->best.text);
+	}
+	switch_mutex_unlock(job->mutex);
+}
+
+static int whisper_file_conn_alive(whisper_file_conn_t *conn)
+{
+	return conn->asr.started == WS_STATE_STARTED && !conn->job->stop && !batch_globals.shutdown;
+}
+
+/* a low priority job gives up one connection per live call, down to one */
+static int whisper_file_conn_paused(whisper_file_conn_t *conn)
+{
+	uint32_t live = __atomic_load_n(&whisper_globals.live_sessions, __ATOMIC_RELAXED);
+
+	return conn->job->low_priority && conn->index > 0 && conn->index + live >= conn->job->nconns;
+}
+
+/* next segment of the oldest file that still has one, appended to this connection's FIFO */
+static whisper_segment_t *whisper_file_take(whisper_file_conn_t *conn, const int16_t **samples)
+{
+	whisper_file_job_t *job = conn->job;
+	whisper_segment_t *seg = NULL;
+	whisper_file_t *file;
+
+	switch_mutex_lock(job->mutex);
+	for (file = job->files; file; file = file->next_file) {
+		if (file->next < file->nsegments) {
+			whisper_file_ref_t *ref = &conn->fifo[(conn->fifo_head + conn->fifo_len) % WHISPER_FILE_DEPTH];
+
+			ref->file = file;
+			ref->idx = file->next++;
+			conn->fifo_len++;
+			seg = &file->segments[ref->idx];
+			*samples = file->samples;
+			break;
+		}
+	}
+	switch_mutex_unlock(job->mutex);
+
+	return seg;
+}
+
+static int whisper_file_drained(whisper_file_job_t *job)
+{
+	whisper_file_t *file;
+	int drained = job->closed;
+
+	switch_mutex_lock(job->mutex);
+	for (file = job->files; file && drained; file = file->next_file) {
+		drained = file->next == file->nsegments;
+	}
+	switch_mutex_unlock(job->mutex);
+
+	return drained;
+}
+
+static int whisper_file_filtering(whisper_t *context)
+{
+	return context->hpf.enabled || context->ns.enabled || context->agc.enabled;
+}
+
+/* feeder thread: the pre-filters run on a copy, the samples are a read-only mapping shared by all connections */
+static const int16_t *whisper_file_filter(whisper_file_conn_t *conn, const int16_t *data, switch_size_t n)
+{
+	whisper_t *context = &conn->asr;
+	switch_size_t i;
+
+	if (!whisper_file_filtering(context)) {
+		return data;
+	}
+
+	memcpy(conn->scratch, data, n * sizeof(int16_t));
+
+	for (i = 0; i < n; i += WHISPER_FILE_FRAME) {
+		uint32_t m = (uint32_t) switch_min(n - i, WHISPER_FILE_FRAME);
+
+		whisper_hpf_process(&context->hpf, conn->scratch + i, m, context->rate);
+		whisper_ns_process(&context->ns, conn->scratch + i, m);
+		whisper_agc_process(&context->agc, conn->scratch + i, m, context->rate);
+	}
+
+	return conn->scratch;
+}
+
+/* filter state settled on the audio before the segment, as it was when the segmentation pass reached it */
+static void whisper_file_filter_start(whisper_file_conn_t *conn, const int16_t *samples, switch_size_t start)
+{
+	whisper_t *context = &conn->asr;
+	switch_size_t pos, n;
+
+	if (!whisper_file_filtering(context)) {
+		return;
+	}
+
+	whisper_hpf_reset(&context->hpf);
+	whisper_ns_reset(&context->ns);
+	whisper_agc_reset(&context->agc);
+
+	for (pos = start > WHISPER_FILE_WARMUP_SAMPLES ? start - WHISPER_FILE_WARMUP_SAMPLES : 0; pos < start; pos += n) {
+		n = switch_min(start - pos, WHISPER_FILE_SEND_SAMPLES);
+		whisper_file_filter(conn, samples + pos, n);
+	}
+}
+
+static void *SWITCH_THREAD_FUNC whisper_file_feeder_run(switch_thread_t *thread, void *obj)
+{
+	whisper_file_conn_t *conn = (whisper_file_conn_t *) obj;
+	whisper_file_job_t *job = conn->job;
+	whisper_t *context = &conn->asr;
+	switch_time_t deadline;
+
+	while (whisper_file_conn_alive(conn)) {
+		const int16_t *samples = NULL;
+		whisper_segment_t *seg;
+		switch_size_t pos;
+
+		if (conn->fifo_len >= WHISPER_FILE_DEPTH || whisper_file_conn_paused(conn)) {
+			if (!conn->fifo_len && whisper_file_drained(job)) {
+				break;
+			}
+			switch_yield(10000);
+			continue;
+		}
+
+		if (!(seg = whisper_file_take(conn, &samples))) {
+			if (whisper_file_drained(job)) {
+				break;
+			}
+			switch_yield(20000);
+			continue;
+		}
+
+		whisper_file_filter_start(conn, samples, seg->start);
+
+		/* as fast as the connection drains the ring, a full ring just means waiting for the lws thread */
+		for (pos = seg->start; pos < seg->end && whisper_file_conn_alive(conn);) {
+			switch_size_t n = switch_min(seg->end - pos, WHISPER_FILE_SEND_SAMPLES);
+			const int16_t *chunk = whisper_file_filter(conn, samples + pos, n);
+
+			while (ws_asr_queue_audio(context, chunk, n * sizeof(int16_t)) != SWITCH_STATUS_SUCCESS && whisper_file_conn_alive(conn)) {
+				ws_asr_kick(context);
+				switch_yield(5000);
+			}
+			pos += n;
+		}
+
+		while (whisper_file_conn_alive(conn) && whisper_get_final_transcription(context) != SWITCH_STATUS_SUCCESS) {
+			switch_yield(5000);
+		}
+	}
+
+	deadline = switch_micro_time_now() + WHISPER_FILE_REPLY_TIMEOUT;
+	while (conn->fifo_len && whisper_file_conn_alive(conn) && switch_micro_time_now() < deadline) {
+		switch_yield(10000);
+	}
+
+	/* whatever is left on a dead or silent connection will not be answered */
+	switch_mutex_lock(job->mutex);
+	while (conn->fifo_len) {
+		whisper_file_ref_t *ref = &conn->fifo[conn->fifo_head];
+
+		ref->file->segments[ref->idx].failed = 1;
+		ref->file->failed++;
+		conn->fifo_head = (conn->fifo_head + 1) % WHISPER_FILE_DEPTH;
+		conn->fifo_len--;
+	}
+	job->feeders--;
+	switch_mutex_unlock(job->mutex);
+
+	return NULL;
+}
+
+/*
+ * 16kHz mono 16 bit WAV and headerless .raw/.pcm/.r16 are used straight from the page cache. The
+ * mapping is read-only, the pre-filters write to per-connection and per-pass scratch frames so no
+ * page of the file is ever copied.
+ */
+static switch_status_t whisper_file_map(whisper_file_t *file)
+{
+	const char *ext = strrchr(file->path, '.');
+	const uint8_t *p, *end;
+	struct stat st;
+	int raw, fd;
+
+	if (!ext) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	raw = !strcasecmp(ext, ".raw") || !strcasecmp(ext, ".pcm") || !strcasecmp(ext, ".r16");
+
+	if (!raw && strcasecmp(ext, ".wav")) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if ((fd = open(file->path, O_RDONLY)) < 0) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	if (fstat(fd, &st) || st.st_size < (raw ? (off_t) sizeof(int16_t) : 44)) {
+		close(fd);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	file->map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (file->map == MAP_FAILED) {
+		file->map = NULL;
+		return SWITCH_STATUS_FALSE;
+	}
+
+	file->map_len = st.st_size;
+	madvise(file->map, file->map_len, MADV_SEQUENTIAL);
+
+	if (raw) {
+		file->samples = file->map;
+		file->count = file->map_len / sizeof(int16_t);
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	p = file->map;
+	end = p + file->map_len;
+
+	if (memcmp(p, "RIFF", 4) || memcmp(p + 8, "WAVE", 4)) {
+		goto fail;
+	}
+
+	for (p += 12; p + 8 <= end;) {
+		uint32_t size;
+
+		memcpy(&size, p + 4, sizeof(size));
+
+		if (!memcmp(p, "fmt ", 4)) {
+			uint16_t format, channels, bits;
+			uint32_t rate;
+
+			if (size < 16 || p + 24 > end) {
+				goto fail;
+			}
+
+			memcpy(&format, p + 8, sizeof(format));
+			memcpy(&channels, p + 10, sizeof(channels));
+			memcpy(&rate, p + 12, sizeof(rate));
+			memcpy(&bits, p + 22, sizeof(bits));
+
+			if ((format != 1 && format != 0xFFFE) || channels != 1 || rate != WHISPER_FILE_RATE || bits != 16) {
+				goto fail;
+			}
+		} else if (!memcmp(p, "data", 4)) {
+			file->samples = (const int16_t *) (p + 8);
+			file->count = switch_min((switch_size_t) size, (switch_size_t) (end - p - 8)) / sizeof(int16_t);
+			return SWITCH_STATUS_SUCCESS;
+		}
+
+		if ((switch_size_t) (end - p) < 8 + (switch_size_t) size + (size & 1)) {
+			break;
+		}
+		p += 8 + size + (size & 1);
+	}
+
+  fail:
+	munmap(file->map, file->map_len);
+	file->map = NULL;
+	return SWITCH_STATUS_FALSE;
+}
+
+/* everything else goes through the file interface, resampled to 16kHz mono */
+static switch_status_t whisper_file_decode(whisper_file_t *file)
+{
+	switch_file_handle_t fh = { 0 };
+	switch_size_t cap = WHISPER_FILE_RATE * 60;
+
+	if (switch_core_file_open(&fh, file->path, 1, WHISPER_FILE_RATE, SWITCH_FILE_FLAG_READ | SWITCH_FILE_DATA_SHORT, NULL) != SWITCH_STATUS_SUCCESS) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	switch_zmalloc(file->decoded, cap * sizeof(int16_t));
+
+	for (;;) {
+		switch_size_t len = WHISPER_FILE_FRAME;
+
+		if (file->count + len > cap) {
+			int16_t *grown;
+
+			cap *= 2;
+			if (!(grown = realloc(file->decoded, cap * sizeof(int16_t)))) {
+				break;
+			}
+			file->decoded = grown;
+		}
+
+		if (switch_core_file_read(&fh, file->decoded + file->count, &len) != SWITCH_STATUS_SUCCESS || !len) {
+			break;
+		}
+		file->count += len;
+	}
+
+	switch_core_file_close(&fh);
+	file->samples = file->decoded;
+
+	return file->count ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+}
+
+/* directory files live in a pool of their own, so this frees the file itself too */
+static void whisper_file_release(whisper_file_job_t *job, whisper_file_t *file)
+{
+	switch_memory_pool_t *pool = file->pool;
+
+	if (file->map) {
+		munmap(file->map, file->map_len);
+		file->map = NULL;
+	}
+	switch_safe_free(file->decoded);
+	switch_safe_free(file->segments);
+	file->samples = NULL;
+
+	if (pool != job->pool) {
+		switch_core_destroy_memory_pool(&pool);
+	}
+}
+
+static void whisper_file_add_segment(whisper_file_t *file, switch_size_t start, switch_size_t end, uint32_t *cap)
+{
+	if (file->nsegments == *cap) {
+		whisper_segment_t *grown;
+
+		if (!(grown = realloc(file->segments, (*cap ? *cap * 2 : 64) * sizeof(whisper_segment_t)))) {
+			return;
+		}
+		file->segments = grown;
+		*cap = *cap ? *cap * 2 : 64;
+	}
+
+	memset(&file->segments[file->nsegments], 0, sizeof(whisper_segment_t));
+	file->segments[file->nsegments].start = start;
+	file->segments[file->nsegments].end = end;
+	file->nsegments++;
+}
+
+/*
+ * same conditioning, VAD and speech timeout as a live call, over the whole file. The filters run on
+ * copies of the lead's, its feeder has its own state, and only decide where the segments are: the
+ * feeders filter the audio again as they send it.
+ */
+static void whisper_file_segment(whisper_file_t *file, whisper_t *context)
+{
+	whisper_hpf_t hpf = context->hpf;
+	whisper_ns_t ns = context->ns;
+	whisper_agc_t agc = context->agc;
+	int16_t frame[WHISPER_FILE_FRAME];
+	switch_size_t pos, start = 0;
+	uint32_t cap = 0;
+	int talking = 0;
+
+	switch_vad_reset(context->vad);
+	whisper_hpf_reset(&hpf);
+	whisper_ns_reset(&ns);
+	whisper_agc_reset(&agc);
+
+	for (pos = 0; pos < file->count; pos += WHISPER_FILE_FRAME) {
+		uint32_t n = (uint32_t) switch_min(file->count - pos, WHISPER_FILE_FRAME);
+		switch_vad_state_t state;
+
+		memcpy(frame, file->samples + pos, n * sizeof(int16_t));
+		whisper_hpf_process(&hpf, frame, n, context->rate);
+		whisper_ns_process(&ns, frame, n);
+		whisper_agc_process(&agc, frame, n, context->rate);
+
+		state = switch_vad_process(context->vad, frame, n);
+
+		if (state == SWITCH_VAD_STATE_START_TALKING) {
+			start = pos;
+			talking = 1;
+		} else if (talking && state == SWITCH_VAD_STATE_STOP_TALKING) {
+			whisper_file_add_segment(file, start, pos + n, &cap);
+			talking = 0;
+		} else if (talking && context->speech_timeout > 0 && (pos + n - start) / (context->rate / 1000) >= (switch_size_t) context->speech_timeout) {
+			whisper_file_add_segment(file, start, pos + n, &cap);
+			switch_vad_reset(context->vad);
+			talking = 0;
+		}
+	}
+
+	if (talking) {
+		whisper_file_add_segment(file, start, file->count, &cap);
+	}
+}
+
+/* job thread: read and segment a file, then hand its segments to the feeders */
+static switch_status_t whisper_file_queue(whisper_file_job_t *job, whisper_file_t *file, whisper_t *lead)
+{
+	whisper_file_t **tail;
+
+	file->started = switch_micro_time_now();
+
+	if (whisper_file_map(file) != SWITCH_STATUS_SUCCESS && whisper_file_decode(file) != SWITCH_STATUS_SUCCESS) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Job %u: unable to read %s\n", job->id, file->path);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	whisper_file_segment(file, lead);
+
+	switch_mutex_lock(job->mutex);
+	for (tail = &job->files; *tail; tail = &(*tail)->next_file);
+	*tail = file;
+	job->queued++;
+	switch_mutex_unlock(job->mutex);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static char *whisper_file_json(whisper_file_t *file, const char *error)
+{
+	ks_json_t *json, *segments;
+	char *body;
+	uint32_t i;
+
+	json = ks_json_create_object();
+	ks_json_add_string_to_object(json, "file", file->path);
+	ks_json_add_number_to_object(json, "duration", (double) file->count / WHISPER_FILE_RATE);
+	ks_json_add_number_to_object(json, "elapsed", (switch_micro_time_now() - file->started) / 1000000.0);
+	if (error) {
+		ks_json_add_string_to_object(json, "error", error);
+	}
+
+	segments = ks_json_create_array();
+	for (i = 0; i < file->nsegments; i++) {
+		ks_json_t *seg = ks_json_create_object();
+
+		ks_json_add_number_to_object(seg, "start", (double) file->segments[i].start / WHISPER_FILE_RATE);
+		ks_json_add_number_to_object(seg, "end", (double) file->segments[i].end / WHISPER_FILE_RATE);
+		if (file->segments[i].text) {
+			ks_json_add_string_to_object(seg, "text", file->segments[i].text);
+		} else {
+			ks_json_add_string_to_object(seg, "error", "no_reply");
+		}
+		ks_json_add_item_to_array(segments, seg);
+	}
+	ks_json_add_item_to_object(json, "segments", segments);
+
+	body = ks_json_print_unformatted(json);
+	ks_json_delete(&json);
+
+	return body;
+}
+
+static switch_status_t whisper_file_write(whisper_file_job_t *job, const char *path, const char *body)
+{
+	FILE *fp;
+
+	if (!(fp = fopen(path, "w"))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Job %u: unable to write %s\n", job->id, path);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	fputs(body, fp);
+
+	return fclose(fp) ? SWITCH_STATUS_FALSE : SWITCH_STATUS_SUCCESS;
+}
+
+/* whisper_transcribe_file: the transcript goes out as an event, and to out= if given */
+static void whisper_file_report(whisper_file_job_t *job, whisper_file_t *file, const char *error)
+{
+	switch_event_t *event = NULL;
+	switch_time_t elapsed = switch_micro_time_now() - file->started;
+	switch_time_t duration = (switch_time_t) file->count * 1000 / WHISPER_FILE_RATE;
+	char *body = whisper_file_json(file, error);
+
+	if (file->out) {
+		whisper_file_write(job, file->out, body);
+	}
+
+	if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "whisper::file_transcription") == SWITCH_STATUS_SUCCESS) {
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Job-ID", "%u", job->id);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "File", file->path);
+		if (file->out) {
+			switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Output-File", file->out);
+		}
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Status", error ? "error" : file->failed ? "partial" : "done");
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Segments", "%u", file->nsegments);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Failed-Segments", "%u", file->failed);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Audio-Duration-Ms", "%" SWITCH_TIME_T_FMT, duration);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Elapsed-Ms", "%" SWITCH_TIME_T_FMT, elapsed / 1000);
+		switch_event_add_body(event, "%s", body);
+		switch_event_fire(&event);
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Job %u: %s, %u segments (%u failed), %" SWITCH_TIME_T_FMT "ms of audio in %" SWITCH_TIME_T_FMT "ms\n",
+					  job->id, file->path, file->nsegments, file->failed, duration, elapsed / 1000);
+
+	switch_safe_free(body);
+}
+
+/* whisper_batch: the transcript goes next to the others, and into the checkpoint once it is complete and on disk */
+static void whisper_batch_file_done(whisper_file_job_t *job, whisper_file_t *file)
+{
+	char *body = whisper_file_json(file, NULL);
+
+	if (whisper_file_write(job, file->out, body) == SWITCH_STATUS_SUCCESS && !file->failed && job->checkpoint) {
+		fprintf(job->checkpoint, "%s\n", file->name);
+		fflush(job->checkpoint);
+	}
+	switch_safe_free(body);
+
+	switch_mutex_lock(batch_globals.mutex);
+	job->completed++;
+	job->segments += file->nsegments;
+	job->failed_segments += file->failed;
+	job->audio_samples += file->count;
+	if (file->failed) {
+		job->failed_files++;
+	}
+	switch_mutex_unlock(batch_globals.mutex);
+}
+
+/*
+ * job thread: finalize the files whose segments are all answered or failed, returns how many are
+ * still queued. Once every feeder is gone nobody will take the rest, so it fails too.
+ */
+static uint32_t whisper_file_collect(whisper_file_job_t *job)
+{
+	whisper_file_t **fp, *file, *done = NULL;
+	uint32_t queued;
+
+	switch_mutex_lock(job->mutex);
+	for (fp = &job->files; (file = *fp);) {
+		if (!job->feeders) {
+			file->failed += file->nsegments - file->next;
+			file->next = file->nsegments;
+		}
+
+		if (file->next == file->nsegments && file->done + file->failed == file->nsegments) {
+			*fp = file->next_file;
+			file->next_file = done;
+			done = file;
+			job->queued--;
+		} else {
+			fp = &file->next_file;
+		}
+	}
+	queued = job->queued;
+	switch_mutex_unlock(job->mutex);
+
+	while ((file = done)) {
+		done = file->next_file;
+
+		if (job->single) {
+			whisper_file_report(job, file, NULL);
+		} else {
+			whisper_batch_file_done(job, file);
+		}
+		whisper_file_release(job, file);
+	}
+
+	return queued;
+}
+
+static switch_status_t whisper_file_job_connect(whisper_file_job_t *job, whisper_t **lead)
+{
+	uint32_t i;
+	int a;
+
+	*lead = NULL;
+
+	for (i = 0; i < job->nconns && !batch_globals.shutdown; i++) {
+		whisper_file_conn_t *conn = &job->conns[i];
+
+		conn->job = job;
+		conn->index = i;
+		conn->asr.offline = 1;
+		conn->asr.result_handler = whisper_file_on_result;
+		conn->asr.user_data = conn;
+
+		if (whisper_asr_setup(&conn->asr, job->pool, WHISPER_FILE_RATE, job->profile) != SWITCH_STATUS_SUCCESS) {
+			continue;
+		}
+
+		for (a = 0; a < job->nparams; a++) {
+			whisper_set_param(&conn->asr, job->params[a], job->values[a]);
+		}
+
+		conn->ready = 1;
+		if (!*lead) {
+			*lead = &conn->asr;
+		}
+	}
+
+	if (!*lead) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	for (i = 0; i < job->nconns; i++) {
+		switch_threadattr_t *thd_attr = NULL;
+
+		if (!job->conns[i].ready) {
+			continue;
+		}
+
+		switch_mutex_lock(job->mutex);
+		job->feeders++;
+		switch_mutex_unlock(job->mutex);
+
+		switch_threadattr_create(&thd_attr, job->pool);
+		switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+		if (switch_thread_create(&job->conns[i].thread, thd_attr, whisper_file_feeder_run, &job->conns[i], job->pool) != SWITCH_STATUS_SUCCESS) {
+			switch_mutex_lock(job->mutex);
+			job->feeders--;
+			switch_mutex_unlock(job->mutex);
+			job->conns[i].thread = NULL;
+		}
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static void whisper_file_job_disconnect(whisper_file_job_t *job)
+{
+	uint32_t i;
+
+	for (i = 0; i < job->nconns; i++) {
+		switch_status_t st;
+
+		if (job->conns[i].thread) {
+			switch_thread_join(&st, job->conns[i].thread);
+		}
+	}
+
+	for (i = 0; i < job->nconns; i++) {
+		if (job->conns[i].asr.mutex) {
+			whisper_asr_teardown(&job->conns[i].asr);
+		}
+	}
+}
+
+static int whisper_batch_wanted(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+
+	return *name != '.' && ext && (!strcasecmp(ext, ".wav") || !strcasecmp(ext, ".raw") || !strcasecmp(ext, ".pcm") || !strcasecmp(ext, ".r16"));
+}
+
+static uint32_t whisper_batch_count(const char *path, switch_memory_pool_t *pool)
+{
+	switch_dir_t *dir = NULL;
+	const char *name;
+	char buf[1024];
+	uint32_t total = 0;
+
+	if (switch_dir_open(&dir, path, pool) != SWITCH_STATUS_SUCCESS) {
+		return 0;
+	}
+
+	while ((name = switch_dir_next_file(dir, buf, sizeof(buf)))) {
+		total += whisper_batch_wanted(name);
+	}
+
+	switch_dir_close(dir);
+
+	return total;
+}
+
+/* recordings listed in <outdir>/.whisper_batch.checkpoint are done, new ones are appended as they finish */
+static switch_status_t whisper_batch_open_checkpoint(whisper_file_job_t *job)
+{
+	char *path = switch_core_sprintf(job->pool, "%s%s%s", job->outdir, SWITCH_PATH_SEPARATOR, WHISPER_BATCH_CHECKPOINT);
+	char line[1024];
+	FILE *fp;
+
+	switch_core_hash_init(&job->finished);
+
+	if ((fp = fopen(path, "r"))) {
+		while (fgets(line, sizeof(line), fp)) {
+			char *e = line + strlen(line);
+
+			while (e > line && (e[-1] == '\n' || e[-1] == '\r')) {
+				*--e = '\0';
+			}
+			if (*line && !switch_core_hash_find(job->finished, line)) {
+				switch_core_hash_insert(job->finished, line, job);
+				job->skipped++;
+			}
+		}
+		fclose(fp);
+	}
+
+	if (!(job->checkpoint = fopen(path, "a"))) {
+		switch_core_hash_destroy(&job->finished);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+/* job thread: walk the directory, with at most WHISPER_BATCH_LOOKAHEAD files per connection read ahead */
+static void whisper_batch_produce(whisper_file_job_t *job, whisper_t *lead)
+{
+	switch_dir_t *dir = NULL;
+	const char *name;
+	char buf[1024];
+
+	if (switch_dir_open(&dir, job->dir, job->pool) != SWITCH_STATUS_SUCCESS) {
+		return;
+	}
+
+	while (!job->stop && !batch_globals.shutdown && (name = switch_dir_next_file(dir, buf, sizeof(buf)))) {
+		switch_memory_pool_t *pool = NULL;
+		whisper_file_t *file;
+
+		if (!whisper_batch_wanted(name) || switch_core_hash_find(job->finished, name)) {
+			continue;
+		}
+
+		while (whisper_file_collect(job) >= WHISPER_BATCH_LOOKAHEAD * job->nconns && !job->stop && !batch_globals.shutdown) {
+			switch_yield(20000);
+		}
+
+		if (job->stop || batch_globals.shutdown || !job->feeders) {
+			break;
+		}
+
+		switch_core_new_memory_pool(&pool);
+		file = switch_core_alloc(pool, sizeof(*file));
+		file->pool = pool;
+		file->name = switch_core_strdup(pool, name);
+		file->path = switch_core_sprintf(pool, "%s%s%s", job->dir, SWITCH_PATH_SEPARATOR, name);
+		file->out = switch_core_sprintf(pool, "%s%s%s.json", job->outdir, SWITCH_PATH_SEPARATOR, name);
+
+		if (whisper_file_queue(job, file, lead) != SWITCH_STATUS_SUCCESS) {
+			switch_mutex_lock(batch_globals.mutex);
+			job->completed++;
+			job->failed_files++;
+			switch_mutex_unlock(batch_globals.mutex);
+			whisper_file_release(job, file);
+		}
+	}
+
+	switch_dir_close(dir);
+}
+
+static void whisper_batch_report(whisper_file_job_t *job, const char *status)
+{
+	switch_event_t *event = NULL;
+	switch_time_t elapsed = switch_micro_time_now() - job->started;
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "Batch %u %s: %u/%u files (%u failed), %" SWITCH_TIME_T_FMT "s\n",
+					  job->id, status, job->completed + job->skipped, job->total, job->failed_files, elapsed / 1000000);
+
+	if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, "whisper::batch") == SWITCH_STATUS_SUCCESS) {
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Job-ID", "%u", job->id);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Directory", job->dir);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Output-Directory", job->outdir);
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Status", status);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Files", "%u", job->total);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Completed-Files", "%u", job->completed);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Skipped-Files", "%u", job->skipped);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Failed-Files", "%u", job->failed_files);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Segments", "%u", job->segments);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Failed-Segments", "%u", job->failed_segments);
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Audio-Duration-Ms", "%" SWITCH_SIZE_T_FMT, job->audio_samples / (WHISPER_FILE_RATE / 1000));
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "Elapsed-Ms", "%" SWITCH_TIME_T_FMT, elapsed / 1000);
+		switch_event_fire(&event);
+	}
+}
+
+static void whisper_file_job_unlink(whisper_file_job_t *job)
+{
+	whisper_file_job_t **jp;
+
+	switch_mutex_lock(batch_globals.mutex);
+	for (jp = &batch_globals.jobs; *jp; jp = &(*jp)->next) {
+		if (*jp == job) {
+			*jp = job->next;
+			break;
+		}
+	}
+	if (job->dir) {
+		batch_globals.connections -= job->nconns;
+	}
+	batch_globals.running--;
+	switch_mutex_unlock(batch_globals.mutex);
+}
+
+static void *SWITCH_THREAD_FUNC whisper_file_job_run(switch_thread_t *thread, void *obj)
+{
+	whisper_file_job_t *job = (whisper_file_job_t *) obj;
+	switch_memory_pool_t *pool = job->pool;
+	whisper_t *lead = NULL;
+	const char *error = NULL;
+
+	if (whisper_file_job_connect(job, &lead) != SWITCH_STATUS_SUCCESS) {
+		error = "no_connection";
+	} else if (job->single) {
+		if (whisper_file_queue(job, job->single, lead) != SWITCH_STATUS_SUCCESS) {
+			error = "unreadable";
+		}
+	} else {
+		whisper_batch_produce(job, lead);
+	}
+
+	job->closed = 1;
+
+	while (whisper_file_collect(job)) {
+		switch_yield(20000);
+	}
+
+	whisper_file_job_disconnect(job);
+
+	if (job->single) {
+		if (error) {
+			if (!job->single->started) {
+				job->single->started = job->started;
+			}
+			whisper_file_report(job, job->single, error);
+			whisper_file_release(job, job->single);
+		}
+	} else {
+		whisper_batch_report(job, error ? "error" : job->stop || batch_globals.shutdown ? "stopped" : "done");
+		fclose(job->checkpoint);
+		switch_core_hash_destroy(&job->finished);
+	}
+
+	whisper_file_job_unlink(job);
+	switch_core_destroy_memory_pool(&pool);
+
+	return NULL;
+}
+
+static whisper_file_job_t *whisper_file_job_create(void)
+{
+	switch_memory_pool_t *pool = NULL;
+	whisper_file_job_t *job;
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return NULL;
+	}
+
+	job = switch_core_alloc(pool, sizeof(*job));
+	job->pool = pool;
+	job->nconns = WHISPER_FILE_CONNECTIONS;
+	switch_mutex_init(&job->mutex, SWITCH_MUTEX_NESTED, pool);
+
+	return job;
+}
+
+static void whisper_file_job_destroy(whisper_file_job_t *job)
+{
+	switch_memory_pool_t *pool = job->pool;
+
+	if (job->checkpoint) {
+		fclose(job->checkpoint);
+		switch_core_hash_destroy(&job->finished);
+	}
+	switch_core_destroy_memory_pool(&pool);
+}
+
+/* options shared by both APIs, any other param=value is set on every connection */
+static void whisper_file_job_option(whisper_file_job_t *job, char *arg)
+{
+	char *val;
+
+	if (!strncasecmp(arg, "connections=", 12) || !strncasecmp(arg, "concurrency=", 12)) {
+		job->nconns = atoi(arg + 12);
+	} else if (!strncasecmp(arg, "profile=", 8)) {
+		job->profile = arg + 8;
+	} else if (!strncasecmp(arg, "priority=", 9)) {
+		job->low_priority = !strcasecmp(arg + 9, "low");
+	} else if ((val = strchr(arg, '=')) && job->nparams < (int) switch_arraylen(job->params)) {
+		*val++ = '\0';
+		job->params[job->nparams] = arg;
+		job->values[job->nparams++] = val;
+	}
+}
+
+static switch_status_t whisper_file_job_start(whisper_file_job_t *job)
+{
+	switch_threadattr_t *thd_attr = NULL;
+	switch_thread_t *thread;
+
+	if (job->nconns < 1 || job->nconns > WHISPER_FILE_MAX_CONNECTIONS) {
+		job->nconns = WHISPER_FILE_CONNECTIONS;
+	}
+
+	switch_mutex_lock(batch_globals.mutex);
+
+	/* directory jobs share batch-max-connections, a new one gets whatever is left */
+	if (job->dir && whisper_globals.batch_max_connections) {
+		if (batch_globals.connections >= whisper_globals.batch_max_connections) {
+			switch_mutex_unlock(batch_globals.mutex);
+			return SWITCH_STATUS_INUSE;
+		}
+		job->nconns = switch_min(job->nconns, whisper_globals.batch_max_connections - batch_globals.connections);
+	}
+
+	job->conns = switch_core_alloc(job->pool, job->nconns * sizeof(whisper_file_conn_t));
+	job->id = ++batch_globals.next_id;
+	job->started = switch_micro_time_now();
+	if (job->dir) {
+		batch_globals.connections += job->nconns;
+	}
+	job->next = batch_globals.jobs;
+	batch_globals.jobs = job;
+	batch_globals.running++;
+	switch_mutex_unlock(batch_globals.mutex);
+
+	switch_threadattr_create(&thd_attr, job->pool);
+	switch_threadattr_detach_set(thd_attr, 1);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	if (switch_thread_create(&thread, thd_attr, whisper_file_job_run, job, job->pool) != SWITCH_STATUS_SUCCESS) {
+		whisper_file_job_unlink(job);
+		return SWITCH_STATUS_FALSE;
+	}
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(whisper_transcribe_file_function)
+{
+	whisper_file_job_t *job;
+	char *argv[32];
+	int argc, i;
+
+	if (zstr(cmd) || batch_globals.shutdown || !(job = whisper_file_job_create())) {
+		stream->write_function(stream, "-USAGE: %s\n", WHISPER_FILE_SYNTAX);
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	argc = switch_separate_string(switch_core_strdup(job->pool, cmd), ' ', argv, switch_arraylen(argv));
+
+	job->single = switch_core_alloc(job->pool, sizeof(whisper_file_t));
+	job->single->pool = job->pool;
+	job->single->path = argv[0];
+
+	for (i = 1; i < argc; i++) {
+		if (!strncasecmp(argv[i], "out=", 4)) {
+			job->single->out = argv[i] + 4;
+		} else if (i == 1 && !strchr(argv[i], '=')) {
+			job->profile = argv[i];
+		} else {
+			whisper_file_job_option(job, argv[i]);
+		}
+	}
+
+	if (whisper_file_job_start(job) != SWITCH_STATUS_SUCCESS) {
+		whisper_file_job_destroy(job);
+		stream->write_function(stream, "-ERR Unable to start the job\n");
+		return SWITCH_STATUS_SUCCESS;
+	}
+
+	stream->write_function(stream, "+OK %u\n", job->id);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+static void whisper_batch_start(switch_stream_handle_t *stream, int argc, char **argv)
+{
+	whisper_file_job_t *job;
+	switch_status_t status;
+	int i;
+
+	if (batch_globals.shutdown || !(job = whisper_file_job_create())) {
+		stream->write_function(stream, "-ERR Unable to start the job\n");
+		return;
+	}
+
+	job->dir = switch_core_strdup(job->pool, argv[1]);
+	job->outdir = switch_core_strdup(job->pool, argv[2]);
+
+	for (i = 3; i < argc; i++) {
+		whisper_file_job_option(job, switch_core_strdup(job->pool, argv[i]));
+	}
+
+	if (!(job->total = whisper_batch_count(job->dir, job->pool))) {
+		stream->write_function(stream, "-ERR No recordings in %s\n", job->dir);
+	} else if (switch_dir_make_recursive(job->outdir, SWITCH_DEFAULT_DIR_PERMS, job->pool) != SWITCH_STATUS_SUCCESS ||
+			   whisper_batch_open_checkpoint(job) != SWITCH_STATUS_SUCCESS) {
+		stream->write_function(stream, "-ERR Unable to write to %s\n", job->outdir);
+	} else if ((status = whisper_file_job_start(job)) != SWITCH_STATUS_SUCCESS) {
+		stream->write_function(stream, "-ERR %s\n", status == SWITCH_STATUS_INUSE ? "batch-max-connections reached" : "Unable to start the job");
+	} else {
+		stream->write_function(stream, "+OK %u\n", job->id);
+		return;
+	}
+
+	whisper_file_job_destroy(job);
+}
+
+/* progress of directory jobs, done counts the files skipped from the checkpoint */
+static void whisper_batch_status(switch_stream_handle_t *stream, uint32_t id)
+{
+	whisper_file_job_t *job;
+	int found = 0;
+
+	switch_mutex_lock(batch_globals.mutex);
+	for (job = batch_globals.jobs; job; job = job->next) {
+		switch_time_t elapsed = switch_micro_time_now() - job->started;
+		double audio = (double) job->audio_samples / WHISPER_FILE_RATE;
+		double secs = elapsed / 1000000.0;
+
+		if (!job->dir || (id && job->id != id)) {
+			continue;
+		}
+
+		found++;
+		stream->write_function(stream, "%u %s -> %s%s\n"
+							   "  files: %u/%u done, %u skipped, %u failed\n"
+							   "  segments: %u, %u failed\n"
+							   "  audio: %.2fh in %.0fs, %.1fx real time, %.1f files/min\n"
+							   "  connections: %u\n",
+							   job->id, job->dir, job->outdir, job->stop ? " (stopping)" : job->low_priority ? " (low priority)" : "",
+							   job->completed + job->skipped, job->total, job->skipped, job->failed_files,
+							   job->segments, job->failed_segments,
+							   audio / 3600, secs, secs > 0 ? audio / secs : 0.0, secs > 0 ? job->completed * 60 / secs : 0.0,
+							   job->feeders);
+	}
+	switch_mutex_unlock(batch_globals.mutex);
+
+	if (!found) {
+		stream->write_function(stream, id ? "-ERR No such job\n" : "No batch jobs\n");
+	}
+}
+
+SWITCH_STANDARD_API(whisper_batch_function)
+{
+	char *mycmd = NULL, *argv[32];
+	int argc = 0;
+
+	if (!zstr(cmd)) {
+		mycmd = strdup(cmd);
+		argc = switch_separate_string(mycmd, ' ', argv, switch_arraylen(argv));
+	}
+
+	if (argc >= 3 && !strcasecmp(argv[0], "start")) {
+		whisper_batch_start(stream, argc, argv);
+	} else if (argc >= 1 && !strcasecmp(argv[0], "status")) {
+		whisper_batch_status(stream, argc > 1 ? atoi(argv[1]) : 0);
+	} else if (argc >= 2 && !strcasecmp(argv[0], "stop")) {
+		whisper_file_job_t *job;
+		uint32_t id = atoi(argv[1]);
+
+		switch_mutex_lock(batch_globals.mutex);
+		for (job = batch_globals.jobs; job && job->id != id; job = job->next);
+		if (job) {
+			job->stop = 1;
+		}
+		switch_mutex_unlock(batch_globals.mutex);
+
+		stream->write_function(stream, job ? "+OK\n" : "-ERR No such job\n");
+	} else {
+		stream->write_function(stream, "-USAGE: %s\n", WHISPER_BATCH_SYNTAX);
+	}
+
+	switch_safe_free(mycmd);
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+void whisper_batch_load(switch_loadable_module_interface_t **module_interface)
+{
+	switch_api_interface_t *api_interface;
+
+	switch_mutex_init(&batch_globals.mutex, SWITCH_MUTEX_NESTED, whisper_globals.pool);
+	batch_globals.shutdown = 0;
+
+	SWITCH_ADD_API(api_interface, "whisper_transcribe_file", "Transcribe a recording faster than real time", whisper_transcribe_file_function, WHISPER_FILE_SYNTAX);
+	SWITCH_ADD_API(api_interface, "whisper_batch", "Transcribe a directory of recordings", whisper_batch_function, WHISPER_BATCH_SYNTAX);
+	switch_console_set_complete("add whisper_transcribe_file");
+	switch_console_set_complete("add whisper_batch start");
+	switch_console_set_complete("add whisper_batch status");
+	switch_console_set_complete("add whisper_batch stop");
+}
+
+/* running jobs notice the flag within one segment and report what they have */
+void whisper_batch_shutdown(void)
+{
+	batch_globals.shutdown = 1;
+
+	while (batch_globals.running) {
+		switch_yield(100000);
+	}
+}
@@ -0,0 +1,16 @@
+#ifndef __WHISPER_BATCH_H__
+#define __WHISPER_BATCH_H__
+
+#include "mod_whisper.h"
+
+#define WHISPER_FILE_RATE 16000
+#define WHISPER_FILE_FRAME 320		/* 20ms at WHISPER_FILE_RATE, the VAD and AGC step */
+#define WHISPER_FILE_CONNECTIONS 4
+#define WHISPER_FILE_MAX_CONNECTIONS 32
+#define WHISPER_FILE_DEPTH 4		/* segments in flight per connection */
+
+/* registers the whisper_transcribe_file and whisper_batch APIs, and waits for running jobs on shutdown */
+void whisper_batch_load(switch_loadable_module_interface_t **module_interface);
+void whisper_batch_shutdown(void);
+
+#endif
@@ -0,0 +1,339 @@
+#include "mod_whisper.h"
+#include "whisper_capture.h"
+
+/*
+ * Capture of exactly what is sent to the ASR server.
+ *
+ * The media thread only appends small records to a per capture SPSC ring. A single writer thread
+ * owns every file: it opens them, drains the rings within the global disk bandwidth budget,
+ * writes the audio as WAV (interleaved for stereo transcription) and the utterance boundaries as
+ * an Audacity style label file next to it, then finalizes and frees the capture once the session
+ * has closed it.
+ */
+
+typedef struct {
+	uint32_t type;
+	uint32_t len;
+} whisper_capture_rec_t;
+
+struct whisper_capture_s {
+	switch_memory_pool_t *pool;
+	whisper_ring_t *ring;
+	char *path;
+	char *label_path;
+	FILE *fp;
+	FILE *labels;
+	uint32_t rate;
+	uint32_t channels;
+	switch_size_t data_bytes;
+	switch_size_t utt_start;
+	uint32_t utterances;
+	volatile uint32_t dropped;
+	volatile int closing;
+	int failed;
+	struct whisper_capture_s *next;
+};
+
+static struct {
+	switch_mutex_t *mutex;
+	switch_thread_t *thread;
+	whisper_capture_t *incoming;	/* new captures, guarded by mutex */
+	whisper_capture_t *list;		/* owned by the writer thread */
+	volatile int running;
+	int64_t tokens;
+	uint8_t buf[SWITCH_RECOMMENDED_BUFFER_SIZE];
+} capture_globals;
+
+static void whisper_capture_wav_header(FILE *fp, uint32_t rate, uint32_t channels, uint32_t data_bytes)
+{
+	uint8_t h[44];
+	uint32_t v;
+
+	memcpy(h, "RIFF", 4);
+	v = data_bytes + 36; memcpy(h + 4, &v, 4);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	v = 16; memcpy(h + 16, &v, 4);
+	h[20] = 1; h[21] = 0;					/* PCM */
+	h[22] = (uint8_t) channels; h[23] = 0;
+	memcpy(h + 24, &rate, 4);
+	v = rate * 2 * channels; memcpy(h + 28, &v, 4);
+	h[32] = (uint8_t) (2 * channels); h[33] = 0;	/* block align */
+	h[34] = 16; h[35] = 0;					/* bits per sample */
+	memcpy(h + 36, "data", 4);
+	memcpy(h + 40, &data_bytes, 4);
+
+	fseek(fp, 0, SEEK_SET);
+	fwrite(h, 1, sizeof(h), fp);
+}
+
+static void whisper_capture_open_files(whisper_capture_t *capture)
+{
+	if (!(capture->fp = fopen(capture->path, "wb"))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Unable to open %s for writing, capture disabled\n", capture->path);
+		capture->failed = 1;
+		return;
+	}
+
+	whisper_capture_wav_header(capture->fp, capture->rate, capture->channels, 0);
+
+	if (!(capture->labels = fopen(capture->label_path, "w"))) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Unable to open %s, utterance boundaries will not be saved\n", capture->label_path);
+	}
+}
+
+static void whisper_capture_finalize(whisper_capture_t *capture)
+{
+	switch_memory_pool_t *pool = capture->pool;
+
+	if (capture->fp) {
+		whisper_capture_wav_header(capture->fp, capture->rate, capture->channels, (uint32_t) capture->data_bytes);
+		fclose(capture->fp);
+	}
+
+	if (capture->labels) {
+		fclose(capture->labels);
+	}
+
+	if (capture->dropped) {
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Capture %s dropped %u bytes (writer behind or bandwidth capped)\n", capture->path, capture->dropped);
+	}
+
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Capture %s closed, %u utterances %" SWITCH_SIZE_T_FMT " bytes\n",
+					  capture->path, capture->utterances, capture->data_bytes);
+
+	switch_core_destroy_memory_pool(&pool);
+}
+
+/* writer thread: move as many whole records as the bandwidth budget allows, returns bytes written */
+static switch_size_t whisper_capture_drain(whisper_capture_t *capture, int limited)
+{
+	whisper_capture_rec_t rec;
+	const void *ptr;
+	switch_size_t written = 0;
+
+	if (!capture->fp && !capture->failed) {
+		whisper_capture_open_files(capture);
+	}
+
+	while (whisper_ring_peek(capture->ring, &ptr) >= sizeof(rec)) {
+		memcpy(&rec, ptr, sizeof(rec));
+
+		if (whisper_ring_inuse(capture->ring) < sizeof(rec) + rec.len) {
+			break;
+		}
+
+		if (rec.type == WHISPER_CAPTURE_AUDIO && limited && capture_globals.tokens < (int64_t) rec.len) {
+			break;
+		}
+
+		whisper_ring_consume(capture->ring, sizeof(rec));
+		whisper_ring_read(capture->ring, capture_globals.buf, rec.len);
+
+		if (capture->failed) {
+			continue;
+		}
+
+		switch (rec.type) {
+		case WHISPER_CAPTURE_AUDIO:
+			fwrite(capture_globals.buf, 1, rec.len, capture->fp);
+			capture->data_bytes += rec.len;
+			capture_globals.tokens -= rec.len;
+			written += rec.len;
+			break;
+		case WHISPER_CAPTURE_START:
+			capture->utt_start = capture->data_bytes;
+			break;
+		case WHISPER_CAPTURE_STOP:
+			capture->utterances++;
+			if (capture->labels) {
+				fprintf(capture->labels, "%.3f\t%.3f\tutterance %u %.*s\n",
+						(double) capture->utt_start / (capture->rate * 2 * capture->channels), (double) capture->data_bytes / (capture->rate * 2 * capture->channels),
+						capture->utterances, (int) rec.len, (char *) capture_globals.buf);
+			}
+			break;
+		}
+	}
+
+	return written;
+}
+
+static void *SWITCH_THREAD_FUNC whisper_capture_thread_run(switch_thread_t *thread, void *obj)
+{
+	switch_time_t last = switch_micro_time_now();
+
+	while (capture_globals.running) {
+		whisper_capture_t *capture, *prev = NULL, *next;
+		int64_t bandwidth = (int64_t) whisper_globals.record_max_bandwidth * 1024;
+		switch_time_t now = switch_micro_time_now();
+
+		/* token bucket shared by every capture, one second of burst */
+		if (bandwidth > 0) {
+			capture_globals.tokens += bandwidth * (now - last) / 1000000;
+			if (capture_globals.tokens > switch_max(bandwidth, (int64_t) sizeof(capture_globals.buf))) {
+				capture_globals.tokens = switch_max(bandwidth, (int64_t) sizeof(capture_globals.buf));
+			}
+		}
+		last = now;
+
+		/* the lock only covers the splice, disk I/O never holds up whisper_capture_open() */
+		switch_mutex_lock(capture_globals.mutex);
+		while ((capture = capture_globals.incoming)) {
+			capture_globals.incoming = capture->next;
+			capture->next = capture_globals.list;
+			capture_globals.list = capture;
+		}
+		switch_mutex_unlock(capture_globals.mutex);
+
+		for (capture = capture_globals.list; capture; capture = next) {
+			next = capture->next;
+
+			whisper_capture_drain(capture, bandwidth > 0);
+
+			/* acquire: the records written before close are in the ring by the time closing is seen */
+			if (__atomic_load_n(&capture->closing, __ATOMIC_ACQUIRE) && !whisper_ring_inuse(capture->ring)) {
+				if (prev) {
+					prev->next = next;
+				} else {
+					capture_globals.list = next;
+				}
+				whisper_capture_finalize(capture);
+				continue;
+			}
+			prev = capture;
+		}
+
+		switch_yield(CAPTURE_INTERVAL_US);
+	}
+
+	return NULL;
+}
+
+switch_status_t whisper_capture_start(switch_memory_pool_t *pool)
+{
+	switch_threadattr_t *thd_attr = NULL;
+
+	switch_mutex_init(&capture_globals.mutex, SWITCH_MUTEX_NESTED, pool);
+	capture_globals.running = 1;
+
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	return switch_thread_create(&capture_globals.thread, thd_attr, whisper_capture_thread_run, NULL, pool);
+}
+
+void whisper_capture_stop(void)
+{
+	whisper_capture_t *capture, *next;
+	switch_status_t st;
+
+	if (!capture_globals.thread) {
+		return;
+	}
+
+	capture_globals.running = 0;
+	switch_thread_join(&st, capture_globals.thread);
+	capture_globals.thread = NULL;
+
+	/* flush whatever is left regardless of the bandwidth cap */
+	while ((capture = capture_globals.incoming)) {
+		capture_globals.incoming = capture->next;
+		capture->next = capture_globals.list;
+		capture_globals.list = capture;
+	}
+
+	for (capture = capture_globals.list; capture; capture = next) {
+		next = capture->next;
+		whisper_capture_drain(capture, 0);
+		whisper_capture_finalize(capture);
+	}
+	capture_globals.list = NULL;
+}
+
+/*
+ * A path ending in '/' is a directory and gets one file per handle named after the channel,
+ * anything else is used as the file name as is. Only memory is touched here, the writer thread
+ * opens the files.
+ */
+whisper_capture_t *whisper_capture_open(const char *path, const char *uuid, uint32_t rate, uint32_t channels)
+{
+	switch_memory_pool_t *pool = NULL;
+	whisper_capture_t *capture;
+	uint32_t size = whisper_globals.record_buffer_size ? whisper_globals.record_buffer_size : CAPTURE_BUFFER_SIZE;
+
+	if (zstr(path) || !capture_globals.running) {
+		return NULL;
+	}
+
+	if (switch_core_new_memory_pool(&pool) != SWITCH_STATUS_SUCCESS) {
+		return NULL;
+	}
+
+	capture = switch_core_alloc(pool, sizeof(*capture));
+	capture->pool = pool;
+	capture->rate = rate;
+	capture->channels = channels ? channels : 1;
+
+	if (whisper_ring_create(&capture->ring, size, sizeof(whisper_capture_rec_t), pool) != SWITCH_STATUS_SUCCESS) {
+		switch_core_destroy_memory_pool(&pool);
+		return NULL;
+	}
+
+	if (path[strlen(path) - 1] == '/') {
+		capture->path = switch_core_sprintf(pool, "%s%s-%" SWITCH_TIME_T_FMT ".wav", path, zstr(uuid) ? "asr" : uuid, switch_micro_time_now());
+	} else {
+		capture->path = switch_core_strdup(pool, path);
+	}
+	capture->label_path = switch_core_sprintf(pool, "%s.labels", capture->path);
+
+	switch_mutex_lock(capture_globals.mutex);
+	capture->next = capture_globals.incoming;
+	capture_globals.incoming = capture;
+	switch_mutex_unlock(capture_globals.mutex);
+
+	return capture;
+}
+
+static void whisper_capture_put(whisper_capture_t *capture, uint32_t type, const void *data, switch_size_t len)
+{
+	whisper_capture_rec_t rec;
+
+	if (len > sizeof(capture_globals.buf)) {
+		len = sizeof(capture_globals.buf);
+	}
+
+	/* only this thread writes, so the space checked here cannot shrink between the two writes */
+	if (whisper_ring_space(capture->ring) < sizeof(rec) + len) {
+		capture->dropped += (uint32_t) len;
+		return;
+	}
+
+	rec.type = type;
+	rec.len = (uint32_t) len;
+	whisper_ring_write(capture->ring, &rec, sizeof(rec));
+	if (len) {
+		whisper_ring_write(capture->ring, data, len);
+	}
+}
+
+void whisper_capture_audio(whisper_capture_t *capture, const void *data, switch_size_t len)
+{
+	if (capture) {
+		whisper_capture_put(capture, WHISPER_CAPTURE_AUDIO, data, len);
+	}
+}
+
+void whisper_capture_mark(whisper_capture_t *capture, whisper_capture_rec_type_t type, const char *label)
+{
+	if (capture) {
+		whisper_capture_put(capture, type, label, label ? strlen(label) : 0);
+	}
+}
+
+/* ownership passes to the writer thread, which frees the capture after the last record is on disk */
+void whisper_capture_close(whisper_capture_t **capture)
+{
+	if (*capture) {
+		__atomic_store_n(&(*capture)->closing, 1, __ATOMIC_RELEASE);
+		*capture = NULL;
+	}
+}
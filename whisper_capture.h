@@ -0,0 +1,27 @@
+#ifndef __WHISPER_CAPTURE_H__
+#define __WHISPER_CAPTURE_H__
+
+#include <switch.h>
+
+#define CAPTURE_BUFFER_SIZE 262144
+#define CAPTURE_INTERVAL_US 20000
+
+typedef enum {
+	WHISPER_CAPTURE_AUDIO = 0,
+	WHISPER_CAPTURE_START,
+	WHISPER_CAPTURE_STOP
+} whisper_capture_rec_type_t;
+
+typedef struct whisper_capture_s whisper_capture_t;
+
+/* module level writer thread, one for all sessions */
+switch_status_t whisper_capture_start(switch_memory_pool_t *pool);
+void whisper_capture_stop(void);
+
+/* media thread side, none of these block or touch the disk */
+whisper_capture_t *whisper_capture_open(const char *path, const char *uuid, uint32_t rate, uint32_t channels);
+void whisper_capture_audio(whisper_capture_t *capture, const void *data, switch_size_t len);
+void whisper_capture_mark(whisper_capture_t *capture, whisper_capture_rec_type_t type, const char *label);
+void whisper_capture_close(whisper_capture_t **capture);
+
+#endif
@@ -0,0 +1,513 @@
+#include "whisper_dsp.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define NS_OVERSUBTRACT 3.0f
+
+#define DBFS(db) (32767.0f * powf(10.0f, (db) / 20.0f))
+
+uint32_t whisper_dsp_peak(const int16_t *data, uint32_t samples)
+{
+	uint32_t i = 0;
+	int32_t peak = 0;
+
+#if defined(__SSE2__)
+	__m128i vmax = _mm_setzero_si128();
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (data + i));
+		/* saturating negate, so -32768 becomes 32767 instead of wrapping */
+		__m128i neg = _mm_subs_epi16(_mm_setzero_si128(), x);
+		vmax = _mm_max_epi16(vmax, _mm_max_epi16(x, neg));
+	}
+
+	vmax = _mm_max_epi16(vmax, _mm_srli_si128(vmax, 8));
+	vmax = _mm_max_epi16(vmax, _mm_srli_si128(vmax, 4));
+	vmax = _mm_max_epi16(vmax, _mm_srli_si128(vmax, 2));
+	peak = (int16_t) _mm_cvtsi128_si32(vmax);
+#endif
+
+	for (; i < samples; i++) {
+		int32_t a = data[i] < 0 ? -data[i] : data[i];
+		if (a > peak) {
+			peak = a;
+		}
+	}
+
+	return (uint32_t) peak;
+}
+
+/* mean square of the frame */
+float whisper_dsp_energy(const int16_t *data, uint32_t samples)
+{
+	uint32_t i = 0;
+	float sum = 0;
+
+#if defined(__SSE2__)
+	__m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+	float lanes[4];
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (data + i));
+		__m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+		__m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+		acc0 = _mm_add_ps(acc0, _mm_mul_ps(lo, lo));
+		acc1 = _mm_add_ps(acc1, _mm_mul_ps(hi, hi));
+	}
+
+	_mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+	sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#endif
+
+	for (; i < samples; i++) {
+		sum += (float) data[i] * data[i];
+	}
+
+	return samples ? sum / samples : 0;
+}
+
+/* in place gain ramped linearly from g0 to g1 over the frame, saturated to 16 bit */
+void whisper_dsp_gain(int16_t *data, uint32_t samples, float g0, float g1)
+{
+	float step = samples ? (g1 - g0) / samples : 0;
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	__m128 g = _mm_setr_ps(g0, g0 + step, g0 + 2 * step, g0 + 3 * step);
+	__m128 g4 = _mm_set1_ps(4 * step);
+
+	for (; i + 8 <= samples; i += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i *) (data + i));
+		__m128 lo = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16));
+		__m128 hi = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16));
+
+		lo = _mm_mul_ps(lo, g);
+		g = _mm_add_ps(g, g4);
+		hi = _mm_mul_ps(hi, g);
+		g = _mm_add_ps(g, g4);
+
+		_mm_storeu_si128((__m128i *) (data + i), _mm_packs_epi32(_mm_cvtps_epi32(lo), _mm_cvtps_epi32(hi)));
+	}
+#endif
+
+	for (; i < samples; i++) {
+		float v = data[i] * (g0 + step * i);
+
+		if (v > 32767.0f) {
+			v = 32767.0f;
+		} else if (v < -32768.0f) {
+			v = -32768.0f;
+		}
+		data[i] = (int16_t) lrintf(v);
+	}
+}
+
+/* in place element wise product */
+void whisper_dsp_mul(float *data, const float *coef, uint32_t n)
+{
+	uint32_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 4 <= n; i += 4) {
+		_mm_storeu_ps(data + i, _mm_mul_ps(_mm_loadu_ps(data + i), _mm_loadu_ps(coef + i)));
+	}
+#endif
+
+	for (; i < n; i++) {
+		data[i] *= coef[i];
+	}
+}
+
+static struct {
+	float window[WHISPER_NS_FFT];
+	float cos[WHISPER_NS_FFT / 2];
+	float sin[WHISPER_NS_FFT / 2];
+	uint16_t rev[WHISPER_NS_FFT];
+} dsp_tables;
+
+void whisper_dsp_init(void)
+{
+	uint32_t i, j, bits = 0;
+
+	while ((1u << bits) < WHISPER_NS_FFT) {
+		bits++;
+	}
+
+	for (i = 0; i < WHISPER_NS_FFT; i++) {
+		/* sqrt-Hann on analysis and synthesis sums to one at 50% overlap */
+		dsp_tables.window[i] = sinf((float) M_PI * (i + 0.5f) / WHISPER_NS_FFT);
+
+		for (j = 0, dsp_tables.rev[i] = 0; j < bits; j++) {
+			dsp_tables.rev[i] |= ((i >> j) & 1) << (bits - 1 - j);
+		}
+	}
+
+	for (i = 0; i < WHISPER_NS_FFT / 2; i++) {
+		dsp_tables.cos[i] = cosf(2 * (float) M_PI * i / WHISPER_NS_FFT);
+		dsp_tables.sin[i] = -sinf(2 * (float) M_PI * i / WHISPER_NS_FFT);
+	}
+}
+
+/* radix-2 in place complex FFT, inverse is unscaled */
+static void whisper_dsp_fft(float *re, float *im, int inverse)
+{
+	uint32_t i, j, len, k;
+
+	for (i = 0; i < WHISPER_NS_FFT; i++) {
+		j = dsp_tables.rev[i];
+		if (j > i) {
+			float t = re[i]; re[i] = re[j]; re[j] = t;
+			t = im[i]; im[i] = im[j]; im[j] = t;
+		}
+	}
+
+	for (len = 2; len <= WHISPER_NS_FFT; len <<= 1) {
+		uint32_t half = len / 2, step = WHISPER_NS_FFT / len;
+
+		for (i = 0; i < WHISPER_NS_FFT; i += len) {
+			for (k = 0; k < half; k++) {
+				float wr = dsp_tables.cos[k * step];
+				float wi = inverse ? -dsp_tables.sin[k * step] : dsp_tables.sin[k * step];
+				uint32_t a = i + k, b = a + half;
+				float tr = re[b] * wr - im[b] * wi;
+				float ti = re[b] * wi + im[b] * wr;
+
+				re[b] = re[a] - tr;
+				im[b] = im[a] - ti;
+				re[a] += tr;
+				im[a] += ti;
+			}
+		}
+	}
+}
+
+void whisper_agc_defaults(whisper_agc_t *agc)
+{
+	memset(agc, 0, sizeof(*agc));
+	agc->target = DBFS(-20.0f);
+	agc->max_gain = powf(10.0f, 30.0f / 20.0f);
+	agc->limit = DBFS(-1.0f);
+	agc->noise_floor = DBFS(-55.0f);
+	agc->attack_ms = 10;
+	agc->release_ms = 500;
+	agc->gain = 1.0f;
+}
+
+/* levels are given in dBFS and the maximum gain in dB, shared by whisper.conf and the ASR params */
+switch_bool_t whisper_agc_set_param(whisper_agc_t *agc, const char *param, const char *val)
+{
+	float fval = (float) atof(val);
+
+	if (!strcasecmp(param, "agc")) {
+		agc->enabled = switch_true(val);
+	} else if (!strcasecmp(param, "agc-target")) {
+		agc->target = DBFS(fval);
+	} else if (!strcasecmp(param, "agc-max-gain")) {
+		agc->max_gain = powf(10.0f, fval / 20.0f);
+	} else if (!strcasecmp(param, "agc-limit")) {
+		agc->limit = DBFS(fval);
+	} else if (!strcasecmp(param, "agc-noise-floor")) {
+		agc->noise_floor = DBFS(fval);
+	} else if (!strcasecmp(param, "agc-attack-ms") && fval > 0) {
+		agc->attack_ms = fval;
+		agc->coef_samples = 0;
+	} else if (!strcasecmp(param, "agc-release-ms") && fval > 0) {
+		agc->release_ms = fval;
+		agc->coef_samples = 0;
+	} else {
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
+}
+
+void whisper_agc_reset(whisper_agc_t *agc)
+{
+	agc->gain = 1.0f;
+}
+
+void whisper_agc_process(whisper_agc_t *agc, int16_t *data, uint32_t samples, uint32_t rate)
+{
+	float rms, desired, gain, coef;
+	uint32_t peak;
+
+	if (!agc->enabled || !samples || !rate) {
+		return;
+	}
+
+	/* one pole smoothing per frame, the coefficients only change with the frame size */
+	if (agc->coef_samples != samples || agc->coef_rate != rate) {
+		float frame_ms = samples * 1000.0f / rate;
+
+		agc->attack_coef = expf(-frame_ms / agc->attack_ms);
+		agc->release_coef = expf(-frame_ms / agc->release_ms);
+		agc->coef_samples = samples;
+		agc->coef_rate = rate;
+	}
+
+	rms = sqrtf(whisper_dsp_energy(data, samples));
+	peak = whisper_dsp_peak(data, samples);
+
+	gain = agc->gain;
+
+	if (rms > agc->noise_floor) {
+		desired = agc->target / rms;
+		if (desired > agc->max_gain) {
+			desired = agc->max_gain;
+		}
+
+		coef = desired < gain ? agc->attack_coef : agc->release_coef;
+		gain = desired + coef * (gain - desired);
+	}
+
+	/* limiter: neither end of the ramp may push this frame's peak over the limit */
+	if (peak && gain * peak > agc->limit) {
+		gain = agc->limit / peak;
+	}
+
+	whisper_dsp_gain(data, samples, switch_min(agc->gain, peak ? agc->limit / peak : agc->gain), gain);
+
+	agc->gain = gain;
+}
+
+void whisper_hpf_defaults(whisper_hpf_t *hpf)
+{
+	memset(hpf, 0, sizeof(*hpf));
+	hpf->cutoff = 100.0f;
+}
+
+switch_bool_t whisper_hpf_set_param(whisper_hpf_t *hpf, const char *param, const char *val)
+{
+	if (!strcasecmp(param, "hpf")) {
+		hpf->enabled = switch_true(val);
+	} else if (!strcasecmp(param, "hpf-cutoff") && atof(val) > 0) {
+		hpf->cutoff = (float) atof(val);
+		hpf->rate = 0;
+	} else {
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
+}
+
+void whisper_hpf_reset(whisper_hpf_t *hpf)
+{
+	hpf->z1 = hpf->z2 = 0;
+}
+
+void whisper_hpf_process(whisper_hpf_t *hpf, int16_t *data, uint32_t samples, uint32_t rate)
+{
+	float z1, z2;
+	uint32_t i;
+
+	if (!hpf->enabled || !rate) {
+		return;
+	}
+
+	/* RBJ cookbook high-pass, Q = 1/sqrt(2) */
+	if (hpf->rate != rate) {
+		float w0 = 2 * (float) M_PI * switch_min(hpf->cutoff, rate * 0.45f) / rate;
+		float alpha = sinf(w0) / (2 * (float) M_SQRT1_2);
+		float a0 = 1 + alpha;
+
+		hpf->b0 = (1 + cosf(w0)) / 2 / a0;
+		hpf->b1 = -(1 + cosf(w0)) / a0;
+		hpf->b2 = hpf->b0;
+		hpf->a1 = -2 * cosf(w0) / a0;
+		hpf->a2 = (1 - alpha) / a0;
+		hpf->rate = rate;
+	}
+
+	z1 = hpf->z1;
+	z2 = hpf->z2;
+
+	for (i = 0; i < samples; i++) {
+		float x = data[i];
+		float y = hpf->b0 * x + z1;
+
+		z1 = hpf->b1 * x - hpf->a1 * y + z2;
+		z2 = hpf->b2 * x - hpf->a2 * y;
+
+		if (y > 32767.0f) {
+			y = 32767.0f;
+		} else if (y < -32768.0f) {
+			y = -32768.0f;
+		}
+		data[i] = (int16_t) lrintf(y);
+	}
+
+	hpf->z1 = z1;
+	hpf->z2 = z2;
+}
+
+void whisper_ns_defaults(whisper_ns_t *ns)
+{
+	memset(ns, 0, sizeof(*ns));
+	ns->floor = powf(10.0f, -15.0f / 20.0f);
+}
+
+/* the level is the deepest attenuation in dB applied to a noise only bin */
+switch_bool_t whisper_ns_set_param(whisper_ns_t *ns, const char *param, const char *val)
+{
+	if (!strcasecmp(param, "noise-suppress")) {
+		ns->enabled = switch_true(val);
+	} else if (!strcasecmp(param, "noise-suppress-level")) {
+		ns->floor = powf(10.0f, -fabsf((float) atof(val)) / 20.0f);
+	} else {
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
+}
+
+void whisper_ns_reset(whisper_ns_t *ns)
+{
+	uint32_t k;
+
+	ns->fill = 0;
+	ns->frames = 0;
+	memset(ns->in, 0, sizeof(ns->in));
+	memset(ns->ola, 0, sizeof(ns->ola));
+	memset(ns->out, 0, sizeof(ns->out));
+
+	for (k = 0; k < WHISPER_NS_BINS; k++) {
+		ns->power[k] = ns->noise[k] = 0;
+		ns->gain[k] = 1.0f;
+	}
+}
+
+static void whisper_ns_frame(whisper_ns_t *ns)
+{
+	uint32_t k;
+
+	memcpy(ns->re, ns->in, sizeof(ns->re));
+	memset(ns->im, 0, sizeof(ns->im));
+	whisper_dsp_mul(ns->re, dsp_tables.window, WHISPER_NS_FFT);
+	whisper_dsp_fft(ns->re, ns->im, 0);
+
+	for (k = 0; k < WHISPER_NS_BINS; k++) {
+		float p = ns->re[k] * ns->re[k] + ns->im[k] * ns->im[k] + 1e-3f;
+		float g;
+
+		/* seed from the first frames, then follow the minimum of the smoothed power */
+		if (ns->frames < 8) {
+			ns->power[k] += (p - ns->power[k]) / (ns->frames + 1);
+			ns->noise[k] = ns->power[k];
+		} else {
+			ns->power[k] += 0.3f * (p - ns->power[k]);
+			if (ns->power[k] < ns->noise[k]) {
+				ns->noise[k] = ns->power[k];
+			} else {
+				ns->noise[k] *= 1.005f;
+			}
+		}
+
+		g = 1.0f - NS_OVERSUBTRACT * ns->noise[k] / p;
+		if (g < ns->floor) {
+			g = ns->floor;
+		}
+
+		/* temporal smoothing keeps isolated bins from flickering (musical noise) */
+		ns->gain[k] = g = 0.5f * (ns->gain[k] + g);
+
+		ns->re[k] *= g;
+		ns->im[k] *= g;
+		if (k && k < WHISPER_NS_FFT / 2) {
+			ns->re[WHISPER_NS_FFT - k] = ns->re[k];
+			ns->im[WHISPER_NS_FFT - k] = -ns->im[k];
+		}
+	}
+
+	ns->frames++;
+
+	whisper_dsp_fft(ns->re, ns->im, 1);
+	whisper_dsp_mul(ns->re, dsp_tables.window, WHISPER_NS_FFT);
+
+	for (k = 0; k < WHISPER_NS_FFT; k++) {
+		ns->ola[k] += ns->re[k] / WHISPER_NS_FFT;
+	}
+
+	memcpy(ns->out, ns->ola, sizeof(ns->out));
+	memmove(ns->ola, ns->ola + WHISPER_NS_HOP, (WHISPER_NS_FFT - WHISPER_NS_HOP) * sizeof(float));
+	memset(ns->ola + WHISPER_NS_FFT - WHISPER_NS_HOP, 0, WHISPER_NS_HOP * sizeof(float));
+	memmove(ns->in, ns->in + WHISPER_NS_HOP, (WHISPER_NS_FFT - WHISPER_NS_HOP) * sizeof(float));
+}
+
+void whisper_ns_process(whisper_ns_t *ns, int16_t *data, uint32_t samples)
+{
+	uint32_t i;
+
+	if (!ns->enabled) {
+		return;
+	}
+
+	for (i = 0; i < samples; i++) {
+		float y = ns->out[ns->fill];
+
+		ns->in[WHISPER_NS_FFT - WHISPER_NS_HOP + ns->fill] = data[i];
+
+		if (y > 32767.0f) {
+			y = 32767.0f;
+		} else if (y < -32768.0f) {
+			y = -32768.0f;
+		}
+		data[i] = (int16_t) lrintf(y);
+
+		if (++ns->fill == WHISPER_NS_HOP) {
+			whisper_ns_frame(ns);
+			ns->fill = 0;
+		}
+	}
+}
+
+void whisper_onset_defaults(whisper_onset_t *onset)
+{
+	memset(onset, 0, sizeof(*onset));
+	onset->thresh = DBFS(-30.0f);
+	onset->onset_ms = 40;
+}
+
+switch_bool_t whisper_onset_set_param(whisper_onset_t *onset, const char *param, const char *val)
+{
+	if (!strcasecmp(param, "barge-in")) {
+		onset->enabled = switch_true(val);
+	} else if (!strcasecmp(param, "barge-in-ms") && atoi(val) > 0) {
+		onset->onset_ms = atoi(val);
+	} else if (!strcasecmp(param, "barge-in-thresh")) {
+		onset->thresh = DBFS((float) atof(val));
+	} else {
+		return SWITCH_FALSE;
+	}
+
+	return SWITCH_TRUE;
+}
+
+void whisper_onset_reset(whisper_onset_t *onset)
+{
+	onset->run_samples = 0;
+	onset->fired = 0;
+}
+
+/* true on the frame that completes the run, then nothing until the next reset */
+switch_bool_t whisper_onset_process(whisper_onset_t *onset, const int16_t *data, uint32_t samples, uint32_t rate)
+{
+	if (!onset->enabled || onset->fired || !samples) {
+		return SWITCH_FALSE;
+	}
+
+	if (whisper_dsp_energy(data, samples) < onset->thresh * onset->thresh) {
+		onset->run_samples = 0;
+		return SWITCH_FALSE;
+	}
+
+	onset->run_samples += samples;
+
+	if ((uint64_t) onset->run_samples * 1000 >= (uint64_t) onset->onset_ms * rate) {
+		onset->fired = 1;
+		return SWITCH_TRUE;
+	}
+
+	return SWITCH_FALSE;
+}
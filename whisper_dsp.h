@@ -0,0 +1,108 @@
+#ifndef __WHISPER_DSP_H__
+#define __WHISPER_DSP_H__
+
+#include <switch.h>
+
+/* kernels, SSE2 when the compiler targets it and plain C otherwise */
+uint32_t whisper_dsp_peak(const int16_t *data, uint32_t samples);
+float whisper_dsp_energy(const int16_t *data, uint32_t samples);
+void whisper_dsp_gain(int16_t *data, uint32_t samples, float g0, float g1);
+void whisper_dsp_mul(float *data, const float *coef, uint32_t n);
+
+/* builds the shared FFT tables, called once at module load */
+void whisper_dsp_init(void);
+
+/*
+ * Automatic gain control run on the uplink before VAD. The gain follows target / rms with separate
+ * attack (gain going down) and release (gain going up) time constants, is held while the input is
+ * under the noise floor, and is capped per frame so the frame peak never exceeds the limit. All the
+ * state lives in the struct, nothing is allocated per frame.
+ */
+typedef struct {
+	int enabled;
+	float target;
+	float max_gain;
+	float limit;
+	float noise_floor;
+	float attack_ms;
+	float release_ms;
+
+	/* state carried across frames */
+	float gain;
+	uint32_t coef_samples;
+	uint32_t coef_rate;
+	float attack_coef;
+	float release_coef;
+} whisper_agc_t;
+
+void whisper_agc_defaults(whisper_agc_t *agc);
+switch_bool_t whisper_agc_set_param(whisper_agc_t *agc, const char *param, const char *val);
+void whisper_agc_reset(whisper_agc_t *agc);
+void whisper_agc_process(whisper_agc_t *agc, int16_t *data, uint32_t samples, uint32_t rate);
+
+/* DC removal / high-pass, 2nd order Butterworth biquad (transposed direct form II) */
+typedef struct {
+	int enabled;
+	float cutoff;
+
+	uint32_t rate;
+	float b0, b1, b2, a1, a2;
+	float z1, z2;
+} whisper_hpf_t;
+
+void whisper_hpf_defaults(whisper_hpf_t *hpf);
+switch_bool_t whisper_hpf_set_param(whisper_hpf_t *hpf, const char *param, const char *val);
+void whisper_hpf_reset(whisper_hpf_t *hpf);
+void whisper_hpf_process(whisper_hpf_t *hpf, int16_t *data, uint32_t samples, uint32_t rate);
+
+#define WHISPER_NS_FFT 256
+#define WHISPER_NS_HOP (WHISPER_NS_FFT / 2)
+#define WHISPER_NS_BINS (WHISPER_NS_FFT / 2 + 1)
+
+/*
+ * Spectral noise suppressor: 50% overlapped sqrt-Hann STFT, per bin noise floor tracked as the minimum
+ * of the smoothed power (instant fall, slow rise), over-subtraction gain smoothed over time and
+ * floored at the configured level. Adds WHISPER_NS_FFT samples of delay, every buffer is part of
+ * the struct.
+ */
+typedef struct {
+	int enabled;
+	float floor;
+
+	uint32_t fill;
+	uint32_t frames;
+	float in[WHISPER_NS_FFT];
+	float ola[WHISPER_NS_FFT];
+	float out[WHISPER_NS_HOP];
+	float re[WHISPER_NS_FFT];
+	float im[WHISPER_NS_FFT];
+	float power[WHISPER_NS_BINS];
+	float noise[WHISPER_NS_BINS];
+	float gain[WHISPER_NS_BINS];
+} whisper_ns_t;
+
+void whisper_ns_defaults(whisper_ns_t *ns);
+switch_bool_t whisper_ns_set_param(whisper_ns_t *ns, const char *param, const char *val);
+void whisper_ns_reset(whisper_ns_t *ns);
+void whisper_ns_process(whisper_ns_t *ns, int16_t *data, uint32_t samples);
+
+/*
+ * Speech onset for barge-in: fires once when the frame rms stays over the threshold for onset_ms,
+ * well before the VAD's voice_ms. Only an energy run, so it is meant to cut a prompt, not to start
+ * an utterance.
+ */
+typedef struct {
+	int enabled;
+	float thresh;
+	uint32_t onset_ms;
+
+	uint32_t run_samples;
+	int fired;
+} whisper_onset_t;
+
+void whisper_onset_defaults(whisper_onset_t *onset);
+switch_bool_t whisper_onset_set_param(whisper_onset_t *onset, const char *param, const char *val);
+void whisper_onset_reset(whisper_onset_t *onset);
+switch_bool_t whisper_onset_process(whisper_onset_t *onset, const int16_t *data, uint32_t samples, uint32_t rate);
+
+#endif
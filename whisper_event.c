@@ -0,0 +1,191 @@
+#include "whisper_event.h"
+
+/*
+ * Session events (start/stop talking, partials, transcriptions, corrections, barge-in, connection
+ * errors) are raised on the media and lws threads. Those only take a preallocated record from the
+ * free queue, copy a few fields, headers and the text into it and queue it; the dispatcher thread builds the switch_event_t, looks the channel up when full channel data
+ * was asked for, and fires it. Records go back to the free queue once fired.
+ */
+
+static struct {
+	switch_thread_t *thread;
+	switch_queue_t *free;
+	switch_queue_t *pending;
+	whisper_event_t *records;
+	volatile int running;
+	volatile uint32_t dropped;
+} event_globals;
+
+void whisper_metrics_add(const whisper_metrics_t *metrics, switch_event_t *event)
+{
+	if (metrics->profile) {
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "ASR-Profile", metrics->profile);
+	}
+	switch_event_add_header(event, SWITCH_STACK_BOTTOM, "ASR-Chunk-Bytes", "%u", metrics->chunk_bytes);
+	switch_event_add_header(event, SWITCH_STACK_BOTTOM, "ASR-Chunk-Ms", "%u", metrics->chunk_ms);
+	if (metrics->rtt_ms) {
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, "ASR-RTT-Ms", "%u", metrics->rtt_ms);
+	}
+	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "ASR-Send-Mode", metrics->send_mode);
+	switch_event_add_header(event, SWITCH_STACK_BOTTOM, "ASR-Frames-Sent", "%u", metrics->frames_sent);
+	switch_event_add_header(event, SWITCH_STACK_BOTTOM, "ASR-Bytes-Sent", "%" SWITCH_SIZE_T_FMT, metrics->bytes_sent);
+	switch_event_add_header(event, SWITCH_STACK_BOTTOM, "ASR-Busy-Ms", "%" SWITCH_TIME_T_FMT, metrics->busy_ms);
+	if (metrics->route) {
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "ASR-Route", metrics->route);
+	}
+}
+
+static void whisper_latency_header(switch_event_t *event, const char *name, int ms)
+{
+	if (ms >= 0) {
+		switch_event_add_header(event, SWITCH_STACK_BOTTOM, name, "%d", ms);
+	}
+}
+
+static void whisper_event_dispatch(whisper_event_t *ev)
+{
+	switch_event_t *event = NULL;
+	switch_core_session_t *session;
+	uint32_t i;
+
+	if (switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, ev->subclass) != SWITCH_STATUS_SUCCESS) {
+		return;
+	}
+
+	if (ev->channel_data && *ev->uuid && (session = switch_core_session_locate(ev->uuid))) {
+		switch_channel_event_set_data(switch_core_session_get_channel(session), event);
+		switch_core_session_rwunlock(session);
+	} else if (*ev->uuid) {
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", ev->uuid);
+	}
+
+	if (ev->stop_reason) {
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Stop-Reason", ev->stop_reason);
+	}
+
+	for (i = 0; i < ev->headers; i++) {
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, ev->header[i].name, ev->header[i].value);
+	}
+
+	if (ev->has_metrics) {
+		whisper_metrics_add(&ev->metrics, event);
+	}
+
+	if (ev->has_latency) {
+		whisper_latency_header(event, "Latency-Speech-Ms", ev->latency.speech);
+		whisper_latency_header(event, "Latency-VAD-Hangover-Ms", ev->latency.vad_hangover);
+		whisper_latency_header(event, "Latency-Send-Ms", ev->latency.send);
+		whisper_latency_header(event, "Latency-EOF-Ms", ev->latency.eof);
+		whisper_latency_header(event, "Latency-First-Partial-Ms", ev->latency.first_partial);
+		whisper_latency_header(event, "Latency-Decode-Ms", ev->latency.decode);
+		whisper_latency_header(event, "Latency-Result-Ms", ev->latency.result);
+		whisper_latency_header(event, "Latency-Consume-Ms", ev->latency.consume);
+		whisper_latency_header(event, "Latency-Total-Ms", ev->latency.total);
+	}
+
+	if (ev->body_len) {
+		switch_event_add_body(event, "%.*s", (int) ev->body_len, ev->body);
+	}
+
+	switch_event_fire(&event);
+}
+
+static void *SWITCH_THREAD_FUNC whisper_event_thread_run(switch_thread_t *thread, void *obj)
+{
+	uint32_t dropped;
+	void *pop;
+
+	/* what was queued before stop is still fired */
+	while (event_globals.running || switch_queue_size(event_globals.pending)) {
+		if (switch_queue_pop_timeout(event_globals.pending, &pop, WHISPER_EVENT_WAIT_US) != SWITCH_STATUS_SUCCESS) {
+			continue;
+		}
+
+		whisper_event_dispatch((whisper_event_t *) pop);
+		switch_queue_push(event_globals.free, pop);
+
+		if ((dropped = __atomic_exchange_n(&event_globals.dropped, 0, __ATOMIC_RELAXED))) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "%u whisper events dropped, the dispatcher is behind\n", dropped);
+		}
+	}
+
+	return NULL;
+}
+
+switch_status_t whisper_event_start(switch_memory_pool_t *pool)
+{
+	switch_threadattr_t *thd_attr = NULL;
+	uint32_t i;
+
+	if (!(event_globals.records = switch_core_alloc(pool, WHISPER_EVENT_RECORDS * sizeof(whisper_event_t))) ||
+		switch_queue_create(&event_globals.free, WHISPER_EVENT_RECORDS, pool) != SWITCH_STATUS_SUCCESS ||
+		switch_queue_create(&event_globals.pending, WHISPER_EVENT_RECORDS, pool) != SWITCH_STATUS_SUCCESS) {
+		return SWITCH_STATUS_MEMERR;
+	}
+
+	for (i = 0; i < WHISPER_EVENT_RECORDS; i++) {
+		switch_queue_push(event_globals.free, &event_globals.records[i]);
+	}
+
+	event_globals.running = 1;
+
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	return switch_thread_create(&event_globals.thread, thd_attr, whisper_event_thread_run, NULL, pool);
+}
+
+/* sessions are gone by now, the records still queued are fired before the thread ends */
+void whisper_event_stop(void)
+{
+	switch_status_t st;
+
+	if (!event_globals.thread) {
+		return;
+	}
+
+	event_globals.running = 0;
+	switch_thread_join(&st, event_globals.thread);
+	event_globals.thread = NULL;
+}
+
+whisper_event_t *whisper_event_alloc(void)
+{
+	void *pop = NULL;
+
+	if (!event_globals.running || switch_queue_trypop(event_globals.free, &pop) != SWITCH_STATUS_SUCCESS) {
+		__atomic_add_fetch(&event_globals.dropped, 1, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	memset(pop, 0, sizeof(whisper_event_t));
+
+	return (whisper_event_t *) pop;
+}
+
+/* both queues hold every record, so this push cannot fail */
+void whisper_event_queue(whisper_event_t *ev)
+{
+	switch_queue_trypush(event_globals.pending, ev);
+}
+
+void whisper_event_header(whisper_event_t *ev, const char *name, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (ev->headers >= WHISPER_EVENT_HEADERS) {
+		return;
+	}
+
+	ev->header[ev->headers].name = name;
+	va_start(ap, fmt);
+	switch_vsnprintf(ev->header[ev->headers].value, sizeof(ev->header[ev->headers].value), fmt, ap);
+	va_end(ap);
+	ev->headers++;
+}
+
+void whisper_event_body(whisper_event_t *ev, const char *text, switch_size_t len)
+{
+	ev->body_len = switch_min(len, sizeof(ev->body));
+	memcpy(ev->body, text, ev->body_len);
+}
@@ -0,0 +1,74 @@
+#ifndef __WHISPER_EVENT_H__
+#define __WHISPER_EVENT_H__
+
+#include <switch.h>
+
+#define WHISPER_EVENT_RECORDS 1024
+#define WHISPER_EVENT_WAIT_US 100000
+#define WHISPER_EVENT_HEADERS 6
+#define WHISPER_EVENT_VALUE 64
+#define WHISPER_EVENT_BODY 4096		/* a transcript is cut there, one whisper segment is far shorter */
+
+/* transport figures of a session, copied when the event is queued (ASR-* headers) */
+typedef struct {
+	const char *profile;
+	const char *send_mode;
+	const char *route;
+	uint32_t chunk_bytes;
+	uint32_t chunk_ms;
+	uint32_t rtt_ms;
+	uint32_t frames_sent;
+	switch_size_t bytes_sent;
+	switch_time_t busy_ms;
+} whisper_metrics_t;
+
+/* durations of one utterance in ms (Latency-* headers), -1 for the stages it did not reach */
+typedef struct {
+	int speech;				/* onset to VAD stop, hangover included */
+	int vad_hangover;		/* last frame over the VAD threshold to VAD stop, not on speech timeouts */
+	int send;				/* VAD stop to the last audio frame sent */
+	int eof;				/* VAD stop to the eof sent */
+	int first_partial;		/* onset to the first partial received */
+	int decode;				/* eof sent to the result received: network and server */
+	int result;				/* VAD stop to the result received */
+	int consume;			/* result received to get_results */
+	int total;				/* VAD stop to get_results */
+} whisper_latency_t;
+
+/* a header only some events have, the name is static and the value copied */
+typedef struct {
+	const char *name;
+	char value[WHISPER_EVENT_VALUE];
+} whisper_event_header_t;
+
+/* one queued event, strings other than uuid, header values and body have to be static or live as long as the module */
+typedef struct {
+	const char *subclass;
+	char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+	const char *stop_reason;
+	int channel_data;		/* add every channel variable, looked up on the dispatcher thread */
+	int has_metrics;
+	whisper_metrics_t metrics;
+	int has_latency;
+	whisper_latency_t latency;
+	uint32_t headers;
+	whisper_event_header_t header[WHISPER_EVENT_HEADERS];
+	switch_size_t body_len;
+	char body[WHISPER_EVENT_BODY];
+} whisper_event_t;
+
+/* module level dispatcher thread, one for all sessions */
+switch_status_t whisper_event_start(switch_memory_pool_t *pool);
+void whisper_event_stop(void);
+
+/* any thread, neither blocks nor allocates: NULL (the event is dropped) when all records are queued */
+whisper_event_t *whisper_event_alloc(void);
+void whisper_event_queue(whisper_event_t *ev);
+
+/* filling an allocated record: a header past WHISPER_EVENT_HEADERS is left out, the body is cut at WHISPER_EVENT_BODY */
+void whisper_event_header(whisper_event_t *ev, const char *name, const char *fmt, ...);
+void whisper_event_body(whisper_event_t *ev, const char *text, switch_size_t len);
+
+void whisper_metrics_add(const whisper_metrics_t *metrics, switch_event_t *event);
+
+#endif
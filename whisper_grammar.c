@@ -0,0 +1,343 @@
+#include "mod_whisper.h"
+#include "whisper_grammar.h"
+
+/*
+ * Grammars are uploaded to a backend once and referred to by id afterwards, the id being a 64 bit
+ * FNV-1a of the text. Each entry remembers the backends that have it (one bit per backend URL).
+ * Entries nobody holds stay cached on an LRU list; once there are more than grammar-cache-size
+ * entries the oldest idle one is dropped, and its id is queued to be evicted on every backend
+ * that has it with the next grammar message sent there.
+ */
+
+struct whisper_grammar_s {
+	char id[17];
+	char *text;
+	switch_size_t len;
+	uint32_t refs;
+	uint32_t alternatives;		/* whisper_grammar_classify, once per entry */
+	uint32_t backends;			/* bit i: backends[i] has it */
+	whisper_grammar_t *prev;	/* idle LRU, oldest first, while refs is 0 */
+	whisper_grammar_t *next;
+};
+
+typedef struct {
+	char *url;
+	char evict[WHISPER_GRAMMAR_EVICT_MAX][17];
+	uint32_t nevict;
+} whisper_grammar_backend_t;
+
+static struct {
+	switch_mutex_t *mutex;
+	switch_hash_t *grammars;
+	uint32_t count;
+	whisper_grammar_t *idle_head;
+	whisper_grammar_t *idle_tail;
+	whisper_grammar_backend_t backends[WHISPER_GRAMMAR_BACKENDS];
+	uint32_t nbackends;
+	switch_memory_pool_t *pool;
+} grammar_globals;
+
+static void whisper_grammar_hash(const char *text, switch_size_t len, char *id)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	switch_size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) text[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	switch_snprintf(id, 17, "%016" PRIx64, h);
+}
+
+static void whisper_grammar_idle_unlink(whisper_grammar_t *grammar)
+{
+	if (grammar->prev) {
+		grammar->prev->next = grammar->next;
+	} else if (grammar_globals.idle_head == grammar) {
+		grammar_globals.idle_head = grammar->next;
+	}
+
+	if (grammar->next) {
+		grammar->next->prev = grammar->prev;
+	} else if (grammar_globals.idle_tail == grammar) {
+		grammar_globals.idle_tail = grammar->prev;
+	}
+
+	grammar->prev = grammar->next = NULL;
+}
+
+/* the index of the backend, registered on first use, -1 once all slots are taken (no caching there) */
+static int whisper_grammar_backend(const char *url)
+{
+	uint32_t i;
+
+	if (zstr(url)) {
+		return -1;
+	}
+
+	for (i = 0; i < grammar_globals.nbackends; i++) {
+		if (!strcmp(grammar_globals.backends[i].url, url)) {
+			return i;
+		}
+	}
+
+	if (grammar_globals.nbackends == WHISPER_GRAMMAR_BACKENDS) {
+		return -1;
+	}
+
+	grammar_globals.backends[i].url = switch_core_strdup(grammar_globals.pool, url);
+	grammar_globals.backends[i].nevict = 0;
+
+	return grammar_globals.nbackends++;
+}
+
+static void whisper_grammar_free(whisper_grammar_t *grammar)
+{
+	switch_safe_free(grammar->text);
+	free(grammar);
+}
+
+/* drops idle entries over the cache size, their ids go to the backends that have them */
+static void whisper_grammar_trim(void)
+{
+	uint32_t max = whisper_globals.grammar_cache_size ? whisper_globals.grammar_cache_size : WHISPER_GRAMMAR_CACHE_SIZE;
+	whisper_grammar_t *grammar;
+	uint32_t i;
+
+	while (grammar_globals.count > max && (grammar = grammar_globals.idle_head)) {
+		whisper_grammar_idle_unlink(grammar);
+		switch_core_hash_delete(grammar_globals.grammars, grammar->id);
+		grammar_globals.count--;
+
+		for (i = 0; i < grammar_globals.nbackends; i++) {
+			whisper_grammar_backend_t *backend = &grammar_globals.backends[i];
+
+			if (!(grammar->backends & (1U << i))) {
+				continue;
+			}
+
+			/* the backend's own cache bound covers whatever does not fit */
+			if (backend->nevict < WHISPER_GRAMMAR_EVICT_MAX) {
+				switch_copy_string(backend->evict[backend->nevict++], grammar->id, sizeof(backend->evict[0]));
+			}
+		}
+
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Grammar %s evicted\n", grammar->id);
+		whisper_grammar_free(grammar);
+	}
+}
+
+void whisper_grammar_init(switch_memory_pool_t *pool)
+{
+	memset(&grammar_globals, 0, sizeof(grammar_globals));
+	grammar_globals.pool = pool;
+	switch_mutex_init(&grammar_globals.mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_core_hash_init(&grammar_globals.grammars);
+}
+
+void whisper_grammar_shutdown(void)
+{
+	switch_hash_index_t *hi;
+
+	if (!grammar_globals.grammars) {
+		return;
+	}
+
+	switch_mutex_lock(grammar_globals.mutex);
+	while ((hi = switch_core_hash_first(grammar_globals.grammars))) {
+		void *val;
+
+		switch_core_hash_this(hi, NULL, NULL, &val);
+		switch_safe_free(hi);
+		switch_core_hash_delete(grammar_globals.grammars, ((whisper_grammar_t *) val)->id);
+		whisper_grammar_free((whisper_grammar_t *) val);
+	}
+	switch_core_hash_destroy(&grammar_globals.grammars);
+	switch_mutex_unlock(grammar_globals.mutex);
+}
+
+whisper_grammar_t *whisper_grammar_ref(const char *text)
+{
+	switch_size_t len = strlen(text);
+	whisper_grammar_t *grammar;
+	char id[17];
+
+	whisper_grammar_hash(text, len, id);
+
+	switch_mutex_lock(grammar_globals.mutex);
+
+	if ((grammar = switch_core_hash_find(grammar_globals.grammars, id))) {
+		if (grammar->len != len || memcmp(grammar->text, text, len)) {
+			switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "Grammar hash collision on %s, not caching\n", id);
+			grammar = NULL;
+		} else if (!grammar->refs++) {
+			whisper_grammar_idle_unlink(grammar);
+		}
+	} else if ((grammar = calloc(1, sizeof(*grammar))) && (grammar->text = strdup(text))) {
+		switch_copy_string(grammar->id, id, sizeof(grammar->id));
+		grammar->len = len;
+		grammar->refs = 1;
+		grammar->alternatives = whisper_grammar_classify(text);
+		switch_core_hash_insert(grammar_globals.grammars, grammar->id, grammar);
+		grammar_globals.count++;
+		whisper_grammar_trim();
+	} else {
+		switch_safe_free(grammar);
+	}
+
+	switch_mutex_unlock(grammar_globals.mutex);
+
+	return grammar;
+}
+
+void whisper_grammar_unref(whisper_grammar_t **grammar)
+{
+	whisper_grammar_t *g = *grammar;
+
+	if (!g) {
+		return;
+	}
+
+	*grammar = NULL;
+
+	switch_mutex_lock(grammar_globals.mutex);
+	if (!--g->refs) {
+		/* kept for the next turn, most recently used last */
+		if ((g->prev = grammar_globals.idle_tail)) {
+			g->prev->next = g;
+		} else {
+			grammar_globals.idle_head = g;
+		}
+		grammar_globals.idle_tail = g;
+		whisper_grammar_trim();
+	}
+	switch_mutex_unlock(grammar_globals.mutex);
+}
+
+const char *whisper_grammar_id(whisper_grammar_t *grammar)
+{
+	return grammar->id;
+}
+
+/* words in [p, end), 0 when there is nothing but blanks */
+static uint32_t whisper_grammar_words(const char *p, const char *end)
+{
+	uint32_t words = 0;
+	int in_word = 0;
+
+	for (; p < end; p++) {
+		int blank = *p == ' ' || *p == '\t' || *p == '\r';
+
+		if (!blank && !in_word) {
+			words++;
+		}
+		in_word = !blank;
+	}
+
+	return words;
+}
+
+uint32_t whisper_grammar_classify(const char *text)
+{
+	uint32_t max = whisper_globals.closed_set_max ? whisper_globals.closed_set_max : WHISPER_GRAMMAR_CLOSED_MAX;
+	uint32_t alternatives = 0, words;
+	const char *p = text, *start = text;
+
+	if (!strncasecmp(text, "builtin:", 8)) {
+		return 1;
+	}
+
+	if (strstr(text, "<one-of")) {
+		for (p = text; (p = strstr(p, "<item")); p += 5) {
+			alternatives++;
+		}
+		return alternatives <= max ? alternatives : 0;
+	}
+
+	for (;; p++) {
+		int sep = !*p || *p == '|' || *p == ',' || *p == ';' || *p == '\n';
+		int or = !strncasecmp(p, " or ", 4);
+
+		if (!sep && !or) {
+			continue;
+		}
+
+		if ((words = whisper_grammar_words(start, p))) {
+			if (words > WHISPER_GRAMMAR_ALT_WORDS || ++alternatives > max) {
+				return 0;
+			}
+		}
+
+		if (!*p) {
+			break;
+		}
+		if (or) {
+			p += 3;
+		}
+		start = p + 1;
+	}
+
+	return alternatives >= 2 ? alternatives : 0;
+}
+
+uint32_t whisper_grammar_closed_set(whisper_grammar_t *grammar)
+{
+	return grammar->alternatives;
+}
+
+char *whisper_grammar_request(whisper_grammar_t *grammar, const char *url, switch_memory_pool_t *pool)
+{
+	switch_stream_handle_t stream = { 0 };
+	int upload = 1;
+	char *req;
+	uint32_t i;
+	int b;
+
+	SWITCH_STANDARD_STREAM(stream);
+	stream.write_function(&stream, "{\"grammar_id\": \"%s\"", grammar->id);
+
+	switch_mutex_lock(grammar_globals.mutex);
+
+	if ((b = whisper_grammar_backend(url)) >= 0) {
+		whisper_grammar_backend_t *backend = &grammar_globals.backends[b];
+
+		upload = !(grammar->backends & (1U << b));
+		/* set now, a miss reply clears it again */
+		grammar->backends |= 1U << b;
+
+		if (backend->nevict) {
+			stream.write_function(&stream, ", \"grammar_evict\": [");
+			for (i = 0; i < backend->nevict; i++) {
+				stream.write_function(&stream, "%s\"%s\"", i ? ", " : "", backend->evict[i]);
+			}
+			stream.write_function(&stream, "]");
+			backend->nevict = 0;
+		}
+	}
+
+	if (upload) {
+		stream.write_function(&stream, ", \"grammar\": ");
+		whisper_json_write_string(&stream, grammar->text, grammar->len);
+	}
+
+	switch_mutex_unlock(grammar_globals.mutex);
+
+	stream.write_function(&stream, "}");
+	req = switch_core_strdup(pool, (char *) stream.data);
+	switch_safe_free(stream.data);
+
+	return req;
+}
+
+void whisper_grammar_miss(const char *url, const char *id)
+{
+	whisper_grammar_t *grammar;
+	int b;
+
+	switch_mutex_lock(grammar_globals.mutex);
+	if ((b = whisper_grammar_backend(url)) >= 0 && (grammar = switch_core_hash_find(grammar_globals.grammars, id))) {
+		grammar->backends &= ~(1U << b);
+	}
+	switch_mutex_unlock(grammar_globals.mutex);
+}
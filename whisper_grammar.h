@@ -0,0 +1,40 @@
+#ifndef __WHISPER_GRAMMAR_H__
+#define __WHISPER_GRAMMAR_H__
+
+#include <switch.h>
+
+#define WHISPER_GRAMMAR_CACHE_SIZE 64
+#define WHISPER_GRAMMAR_BACKENDS 32
+#define WHISPER_GRAMMAR_EVICT_MAX 16
+#define WHISPER_GRAMMAR_CLOSED_MAX 20
+#define WHISPER_GRAMMAR_ALT_WORDS 4
+
+typedef struct whisper_grammar_s whisper_grammar_t;
+
+/* module level registry of the grammars in use, keyed by a hash of their text */
+void whisper_grammar_init(switch_memory_pool_t *pool);
+void whisper_grammar_shutdown(void);
+
+/* NULL only on a hash collision, the caller then sends the text without an id */
+whisper_grammar_t *whisper_grammar_ref(const char *text);
+void whisper_grammar_unref(whisper_grammar_t **grammar);
+const char *whisper_grammar_id(whisper_grammar_t *grammar);
+
+/*
+ * Number of alternatives of a closed set grammar, 0 for free form: builtin: grammars, an SRGS
+ * <one-of>, or 2 to closed-set-max short phrases separated by |, comma, semicolon, newline or "or".
+ */
+uint32_t whisper_grammar_classify(const char *text);
+uint32_t whisper_grammar_closed_set(whisper_grammar_t *grammar);
+
+/*
+ * The message loading the grammar on a connection to backend, allocated from pool: the text the
+ * first time this backend gets it, only its id afterwards, and the ids evicted since the last
+ * message to the same backend.
+ */
+char *whisper_grammar_request(whisper_grammar_t *grammar, const char *backend, switch_memory_pool_t *pool);
+
+/* the backend answered grammar_miss (restarted, or evicted it on its own): upload it again next time */
+void whisper_grammar_miss(const char *backend, const char *id);
+
+#endif
@@ -0,0 +1,401 @@
+#include "whisper_json.h"
+
+/*
+ * Reply scanner for the lws thread. It only knows the handful of keys a reply carries and walks the
+ * frame once: strings are unescaped over themselves (an escape is never shorter than what it
+ * stands for) and NUL terminated on their closing quote, numbers are read with strtod, anything
+ * else is skipped. buf[len] has to be a NUL, which the result slots and the handlers' copies have.
+ */
+
+typedef struct {
+	char *p;
+	char *end;
+} whisper_scan_t;
+
+typedef int (*whisper_scan_field_t)(whisper_scan_t *s, const char *key, void *obj);
+
+static void whisper_scan_ws(whisper_scan_t *s)
+{
+	while (s->p < s->end && (*s->p == ' ' || *s->p == '\t' || *s->p == '\r' || *s->p == '\n')) {
+		s->p++;
+	}
+}
+
+static int whisper_scan_hex(const char *p, uint32_t *cp)
+{
+	int i;
+
+	*cp = 0;
+	for (i = 0; i < 4; i++) {
+		char c = p[i];
+
+		*cp <<= 4;
+		if (c >= '0' && c <= '9') {
+			*cp |= c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			*cp |= c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			*cp |= c - 'A' + 10;
+		} else {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static char *whisper_scan_utf8(char *w, uint32_t cp)
+{
+	if (cp < 0x80) {
+		*w++ = (char) cp;
+	} else if (cp < 0x800) {
+		*w++ = (char) (0xc0 | (cp >> 6));
+		*w++ = (char) (0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+		*w++ = (char) (0xe0 | (cp >> 12));
+		*w++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+		*w++ = (char) (0x80 | (cp & 0x3f));
+	} else {
+		*w++ = (char) (0xf0 | (cp >> 18));
+		*w++ = (char) (0x80 | ((cp >> 12) & 0x3f));
+		*w++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+		*w++ = (char) (0x80 | (cp & 0x3f));
+	}
+
+	return w;
+}
+
+/* s->p is on the opening quote, returns the unescaped string or NULL when it is not terminated */
+static char *whisper_scan_string(whisper_scan_t *s, switch_size_t *len)
+{
+	char *start, *w;
+
+	if (s->p >= s->end || *s->p != '"') {
+		return NULL;
+	}
+
+	start = w = ++s->p;
+
+	while (s->p < s->end && *s->p != '"') {
+		char c = *s->p++;
+
+		if (c == '\\' && s->p < s->end) {
+			uint32_t cp, lo;
+
+			switch ((c = *s->p++)) {
+			case 'n': c = '\n'; break;
+			case 't': c = '\t'; break;
+			case 'r': c = '\r'; break;
+			case 'b': c = '\b'; break;
+			case 'f': c = '\f'; break;
+			case 'u':
+				if (s->end - s->p < 4 || !whisper_scan_hex(s->p, &cp)) {
+					return NULL;
+				}
+				s->p += 4;
+				/* a high surrogate followed by its low half is one code point */
+				if (cp >= 0xd800 && cp < 0xdc00 && s->end - s->p >= 6 && s->p[0] == '\\' && s->p[1] == 'u' &&
+					whisper_scan_hex(s->p + 2, &lo) && lo >= 0xdc00 && lo < 0xe000) {
+					cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+					s->p += 6;
+				}
+				w = whisper_scan_utf8(w, cp);
+				continue;
+			default:
+				break;
+			}
+		}
+		*w++ = c;
+	}
+
+	if (s->p >= s->end) {
+		return NULL;
+	}
+
+	s->p++;
+	*w = '\0';
+	*len = w - start;
+
+	return start;
+}
+
+static int whisper_scan_number(whisper_scan_t *s, double *val)
+{
+	char *e;
+
+	*val = strtod(s->p, &e);
+	if (e == s->p || e > s->end) {
+		return 0;
+	}
+	s->p = e;
+
+	return 1;
+}
+
+static int whisper_scan_skip(whisper_scan_t *s)
+{
+	switch_size_t len;
+	int depth = 0;
+
+	whisper_scan_ws(s);
+
+	if (s->p >= s->end) {
+		return 0;
+	}
+
+	if (*s->p == '"') {
+		return whisper_scan_string(s, &len) != NULL;
+	}
+
+	if (*s->p != '{' && *s->p != '[') {
+		/* number, true, false or null */
+		while (s->p < s->end && *s->p != ',' && *s->p != '}' && *s->p != ']' && *s->p != ' ' && *s->p != '\n' && *s->p != '\r' && *s->p != '\t') {
+			s->p++;
+		}
+		return 1;
+	}
+
+	while (s->p < s->end) {
+		if (*s->p == '"') {
+			if (!whisper_scan_string(s, &len)) {
+				return 0;
+			}
+			continue;
+		}
+		if (*s->p == '{' || *s->p == '[') {
+			depth++;
+		} else if ((*s->p == '}' || *s->p == ']') && !--depth) {
+			s->p++;
+			return 1;
+		}
+		s->p++;
+	}
+
+	return 0;
+}
+
+/* calls field for every key, a field it does not consume (returns 0) is skipped */
+static int whisper_scan_object(whisper_scan_t *s, whisper_scan_field_t field, void *obj)
+{
+	whisper_scan_ws(s);
+	if (s->p >= s->end || *s->p != '{') {
+		return 0;
+	}
+	s->p++;
+
+	for (;;) {
+		switch_size_t len;
+		char *key;
+
+		whisper_scan_ws(s);
+		if (s->p < s->end && *s->p == '}') {
+			s->p++;
+			return 1;
+		}
+
+		if (!(key = whisper_scan_string(s, &len))) {
+			return 0;
+		}
+
+		whisper_scan_ws(s);
+		if (s->p >= s->end || *s->p++ != ':') {
+			return 0;
+		}
+		whisper_scan_ws(s);
+
+		if (!field(s, key, obj) && !whisper_scan_skip(s)) {
+			return 0;
+		}
+
+		whisper_scan_ws(s);
+		if (s->p < s->end && *s->p == ',') {
+			s->p++;
+		} else if (s->p >= s->end || *s->p != '}') {
+			return 0;
+		}
+	}
+}
+
+static int whisper_scan_bool(whisper_scan_t *s, int *val)
+{
+	if (s->end - s->p >= 4 && !strncmp(s->p, "true", 4)) {
+		*val = 1;
+		s->p += 4;
+	} else if (s->end - s->p >= 5 && !strncmp(s->p, "false", 5)) {
+		*val = 0;
+		s->p += 5;
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
+
+/* the server sends 0-1, the module reports 0-100 like the confidence param */
+static int whisper_scan_confidence(whisper_scan_t *s, double *confidence)
+{
+	double val;
+
+	if (!whisper_scan_number(s, &val)) {
+		return 0;
+	}
+	*confidence = val < 0 ? 0 : val > 1 ? 100 : val * 100;
+
+	return 1;
+}
+
+static int whisper_scan_hyp(whisper_scan_t *s, const char *key, void *obj)
+{
+	whisper_hyp_t *hyp = (whisper_hyp_t *) obj;
+
+	if (!strcmp(key, "text") && *s->p == '"') {
+		return (hyp->text = whisper_scan_string(s, &hyp->len)) != NULL;
+	} else if (!strcmp(key, "confidence")) {
+		return whisper_scan_confidence(s, &hyp->confidence);
+	}
+
+	return 0;
+}
+
+static int whisper_scan_alternatives(whisper_scan_t *s, whisper_reply_t *reply)
+{
+	if (*s->p != '[') {
+		return 0;
+	}
+	s->p++;
+
+	for (;;) {
+		whisper_hyp_t hyp = { "", 0, -1 };
+
+		whisper_scan_ws(s);
+		if (s->p < s->end && *s->p == ']') {
+			s->p++;
+			return 1;
+		}
+
+		if (!whisper_scan_object(s, whisper_scan_hyp, &hyp)) {
+			return 0;
+		}
+		if (reply->nbest_count < WHISPER_NBEST_MAX) {
+			reply->nbest[reply->nbest_count++] = hyp;
+		}
+
+		whisper_scan_ws(s);
+		if (s->p < s->end && *s->p == ',') {
+			s->p++;
+		} else if (s->p >= s->end || *s->p != ']') {
+			return 0;
+		}
+	}
+}
+
+static int whisper_scan_reply(whisper_scan_t *s, const char *key, void *obj)
+{
+	whisper_reply_t *reply = (whisper_reply_t *) obj;
+	switch_size_t len;
+	double val;
+
+	if (!strcmp(key, "text") || !strcmp(key, "confidence")) {
+		return whisper_scan_hyp(s, key, &reply->best);
+	} else if (!strcmp(key, "language") && *s->p == '"') {
+		return (reply->language = whisper_scan_string(s, &len)) != NULL;
+	} else if (!strcmp(key, "error") && *s->p == '"') {
+		return (reply->error = whisper_scan_string(s, &len)) != NULL;
+	} else if (!strcmp(key, "grammar_id") && *s->p == '"') {
+		return (reply->grammar_id = whisper_scan_string(s, &len)) != NULL;
+	} else if (!strcmp(key, "start") && whisper_scan_number(s, &val)) {
+		reply->start = val;
+		return 1;
+	} else if (!strcmp(key, "end") && whisper_scan_number(s, &val)) {
+		reply->end = val;
+		return 1;
+	} else if (!strcmp(key, "channel") && whisper_scan_number(s, &val)) {
+		reply->channel = (int) val;
+		return 1;
+	} else if (!strcmp(key, "partial")) {
+		return whisper_scan_bool(s, &reply->partial);
+	} else if (!strcmp(key, "alternatives")) {
+		return whisper_scan_alternatives(s, reply);
+	}
+
+	return 0;
+}
+
+void whisper_reply_parse(char *buf, switch_size_t len, whisper_reply_t *reply)
+{
+	whisper_scan_t s = { buf, buf + len };
+
+	memset(reply, 0, sizeof(*reply));
+	reply->best.text = buf;
+	reply->best.len = len;
+	reply->best.confidence = -1;
+	reply->start = -1;
+	reply->end = -1;
+
+	whisper_scan_ws(&s);
+	if (s.p >= s.end || *s.p != '{') {
+		return;
+	}
+
+	reply->best.text = "";
+	reply->best.len = 0;
+	reply->is_json = 1;
+
+	/* a broken object keeps what was read before the error, the raw frame is in the log */
+	whisper_scan_object(&s, whisper_scan_reply, reply);
+}
+
+whisper_return_t whisper_return_mode(const char *val)
+{
+	if (!strcasecmp(val, "nlsml") || atoi(val) == WHISPER_RETURN_NLSML) {
+		return WHISPER_RETURN_NLSML;
+	}
+
+	return !strcasecmp(val, "json") || switch_true(val) || atoi(val) > 0 ? WHISPER_RETURN_JSON : WHISPER_RETURN_TEXT;
+}
+
+void whisper_json_write_string(switch_stream_handle_t *stream, const char *text, switch_size_t len)
+{
+	switch_size_t i, run = 0;
+
+	stream->write_function(stream, "\"");
+
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char) text[i];
+
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		stream->write_function(stream, "%.*s", (int) (i - run), text + run);
+		if (c == '"' || c == '\\') {
+			stream->write_function(stream, "\\%c", c);
+		} else {
+			stream->write_function(stream, "\\u%04x", c);
+		}
+		run = i + 1;
+	}
+
+	stream->write_function(stream, "%.*s\"", (int) (len - run), text + run);
+}
+
+void whisper_xml_write_string(switch_stream_handle_t *stream, const char *text, switch_size_t len)
+{
+	switch_size_t i, run = 0;
+
+	for (i = 0; i < len; i++) {
+		const char *entity;
+
+		switch (text[i]) {
+		case '&': entity = "&amp;"; break;
+		case '<': entity = "&lt;"; break;
+		case '>': entity = "&gt;"; break;
+		case '"': entity = "&quot;"; break;
+		case '\'': entity = "&apos;"; break;
+		default: continue;
+		}
+		stream->write_function(stream, "%.*s%s", (int) (i - run), text + run, entity);
+		run = i + 1;
+	}
+
+	stream->write_function(stream, "%.*s", (int) (len - run), text + run);
+}
@@ -0,0 +1,49 @@
+#ifndef __WHISPER_JSON_H__
+#define __WHISPER_JSON_H__
+
+#include <switch.h>
+
+#define WHISPER_NBEST_MAX 5
+
+typedef enum {
+	WHISPER_RETURN_TEXT = 0,
+	WHISPER_RETURN_JSON,
+	WHISPER_RETURN_NLSML
+} whisper_return_t;
+
+/* one hypothesis, text points into the scanned buffer */
+typedef struct {
+	const char *text;
+	switch_size_t len;
+	double confidence;		/* 0-100, < 0 when the server sent none */
+} whisper_hyp_t;
+
+/*
+ * A server reply, either a JSON object ({"text", "confidence" (0-1), "language", "start", "end",
+ * "channel", "partial", "alternatives": [{"text", "confidence"}], "error", "grammar_id"}) or a plain text frame taken whole
+ * as the text. partial marks an interim hypothesis of the utterance still being spoken.
+ */
+typedef struct {
+	int is_json;
+	int partial;
+	whisper_hyp_t best;
+	whisper_hyp_t nbest[WHISPER_NBEST_MAX];	/* alternatives after the best one */
+	uint32_t nbest_count;
+	const char *language;
+	const char *error;		/* error replies, e.g. grammar_miss for grammar_id */
+	const char *grammar_id;
+	double start;			/* seconds, < 0 when not sent */
+	double end;
+	int channel;
+} whisper_reply_t;
+
+/* scans buf in place: strings are unescaped and NUL terminated where they are, nothing is allocated */
+void whisper_reply_parse(char *buf, switch_size_t len, whisper_reply_t *reply);
+
+whisper_return_t whisper_return_mode(const char *val);
+
+/* escaped string values for the formatted results */
+void whisper_json_write_string(switch_stream_handle_t *stream, const char *text, switch_size_t len);
+void whisper_xml_write_string(switch_stream_handle_t *stream, const char *text, switch_size_t len);
+
+#endif
@@ -0,0 +1,131 @@
+#include "mod_whisper.h"
+#include "whisper_language.h"
+
+/*
+ * Language hints by caller ID, learned from the language of earlier results. Up to
+ * language-cache-size callers are kept, the least recently seen one making room for a new one.
+ */
+
+typedef struct whisper_language_s whisper_language_t;
+
+struct whisper_language_s {
+	char caller[WHISPER_LANGUAGE_CALLER_MAX];
+	char language[WHISPER_LANGUAGE_MAX];
+	whisper_language_t *prev;	/* LRU, oldest first */
+	whisper_language_t *next;
+};
+
+static struct {
+	switch_mutex_t *mutex;
+	switch_hash_t *callers;
+	uint32_t count;
+	whisper_language_t *head;
+	whisper_language_t *tail;
+} language_globals;
+
+static void whisper_language_unlink(whisper_language_t *entry)
+{
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		language_globals.head = entry->next;
+	}
+
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		language_globals.tail = entry->prev;
+	}
+
+	entry->prev = entry->next = NULL;
+}
+
+static void whisper_language_link(whisper_language_t *entry)
+{
+	if ((entry->prev = language_globals.tail)) {
+		entry->prev->next = entry;
+	} else {
+		language_globals.head = entry;
+	}
+	language_globals.tail = entry;
+}
+
+void whisper_language_init(switch_memory_pool_t *pool)
+{
+	memset(&language_globals, 0, sizeof(language_globals));
+	switch_mutex_init(&language_globals.mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_core_hash_init(&language_globals.callers);
+}
+
+void whisper_language_shutdown(void)
+{
+	whisper_language_t *entry;
+
+	if (!language_globals.callers) {
+		return;
+	}
+
+	switch_mutex_lock(language_globals.mutex);
+	while ((entry = language_globals.head)) {
+		whisper_language_unlink(entry);
+		switch_core_hash_delete(language_globals.callers, entry->caller);
+		free(entry);
+	}
+	switch_core_hash_destroy(&language_globals.callers);
+	switch_mutex_unlock(language_globals.mutex);
+}
+
+int whisper_language_lookup(const char *caller, char *language, switch_size_t len)
+{
+	whisper_language_t *entry;
+	int found = 0;
+
+	if (zstr(caller) || !language_globals.callers) {
+		return 0;
+	}
+
+	switch_mutex_lock(language_globals.mutex);
+	if ((entry = switch_core_hash_find(language_globals.callers, caller))) {
+		switch_copy_string(language, entry->language, len);
+		whisper_language_unlink(entry);
+		whisper_language_link(entry);
+		found = 1;
+	}
+	switch_mutex_unlock(language_globals.mutex);
+
+	return found;
+}
+
+void whisper_language_learn(const char *caller, const char *language)
+{
+	uint32_t max = whisper_globals.language_cache_size;
+	whisper_language_t *entry;
+
+	if (zstr(caller) || zstr(language) || !max || !language_globals.callers) {
+		return;
+	}
+
+	switch_mutex_lock(language_globals.mutex);
+
+	if ((entry = switch_core_hash_find(language_globals.callers, caller))) {
+		whisper_language_unlink(entry);
+	} else {
+		if (language_globals.count >= max && (entry = language_globals.head)) {
+			/* the oldest caller's entry is reused */
+			whisper_language_unlink(entry);
+			switch_core_hash_delete(language_globals.callers, entry->caller);
+		} else if ((entry = calloc(1, sizeof(*entry)))) {
+			language_globals.count++;
+		} else {
+			switch_mutex_unlock(language_globals.mutex);
+			return;
+		}
+		switch_copy_string(entry->caller, caller, sizeof(entry->caller));
+		switch_core_hash_insert(language_globals.callers, entry->caller, entry);
+	}
+
+	switch_copy_string(entry->language, language, sizeof(entry->language));
+	whisper_language_link(entry);
+
+	switch_mutex_unlock(language_globals.mutex);
+}
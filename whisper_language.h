@@ -0,0 +1,18 @@
+#ifndef __WHISPER_LANGUAGE_H__
+#define __WHISPER_LANGUAGE_H__
+
+#include <switch.h>
+
+#define WHISPER_LANGUAGE_CACHE_SIZE 10000
+#define WHISPER_LANGUAGE_CALLER_MAX 64
+#define WHISPER_LANGUAGE_MAX 16
+
+/* module level LRU of the language last recognized for a caller ID */
+void whisper_language_init(switch_memory_pool_t *pool);
+void whisper_language_shutdown(void);
+
+/* copies the cached language of caller into language, 0 when it has none */
+int whisper_language_lookup(const char *caller, char *language, switch_size_t len);
+void whisper_language_learn(const char *caller, const char *language);
+
+#endif
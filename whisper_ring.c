@@ -0,0 +1,129 @@
+#include "whisper_ring.h"
+
+static void *whisper_ring_align(void *ptr)
+{
+	return (void *)(((uintptr_t)ptr + WHISPER_CACHE_LINE - 1) & ~((uintptr_t)WHISPER_CACHE_LINE - 1));
+}
+
+switch_status_t whisper_ring_create(whisper_ring_t **ring, switch_size_t capacity, switch_size_t mirror, switch_memory_pool_t *pool)
+{
+	whisper_ring_t *r;
+	void *mem;
+	switch_size_t size = WHISPER_CACHE_LINE;
+
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	if (mirror > size) {
+		mirror = size;
+	}
+
+	if (!(mem = switch_core_alloc(pool, sizeof(*r) + WHISPER_CACHE_LINE))) {
+		return SWITCH_STATUS_MEMERR;
+	}
+
+	r = whisper_ring_align(mem);
+
+	if (!(mem = switch_core_alloc(pool, size + mirror + WHISPER_CACHE_LINE))) {
+		return SWITCH_STATUS_MEMERR;
+	}
+
+	r->data = whisper_ring_align(mem);
+	r->size = size;
+	r->mask = size - 1;
+	r->mirror = mirror;
+	r->head = 0;
+	r->tail = 0;
+
+	*ring = r;
+
+	return SWITCH_STATUS_SUCCESS;
+}
+
+switch_size_t whisper_ring_space(whisper_ring_t *ring)
+{
+	return ring->size - (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE));
+}
+
+/* All or nothing: a write that does not fit is refused so records and frames are never split. */
+switch_size_t whisper_ring_write(whisper_ring_t *ring, const void *data, switch_size_t len)
+{
+	const uint8_t *src = (const uint8_t *) data;
+	switch_size_t head = ring->head;
+	switch_size_t off, first;
+
+	if (len == 0 || len > whisper_ring_space(ring)) {
+		return 0;
+	}
+
+	off = head & ring->mask;
+	first = switch_min(len, ring->size - off);
+
+	memcpy(ring->data + off, src, first);
+	if (first < len) {
+		memcpy(ring->data, src + first, len - first);
+	}
+
+	if (ring->mirror) {
+		if (off < ring->mirror) {
+			memcpy(ring->data + ring->size + off, src, switch_min(first, ring->mirror - off));
+		}
+		if (first < len) {
+			memcpy(ring->data + ring->size, src + first, switch_min(len - first, ring->mirror));
+		}
+	}
+
+	__atomic_store_n(&ring->head, head + len, __ATOMIC_RELEASE);
+
+	return len;
+}
+
+/*
+ * Returns how many bytes can be read in place starting at *data, which is everything up to the
+ * physical end of the storage plus the mirrored region. Callers framing at most `mirror` bytes
+ * therefore always get a whole frame when one is buffered.
+ */
+switch_size_t whisper_ring_peek(whisper_ring_t *ring, const void **data)
+{
+	switch_size_t tail = ring->tail;
+	switch_size_t inuse = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+	switch_size_t off = tail & ring->mask;
+
+	*data = ring->data + off;
+
+	return switch_min(inuse, ring->size - off + ring->mirror);
+}
+
+void whisper_ring_consume(whisper_ring_t *ring, switch_size_t len)
+{
+	__atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_RELEASE);
+}
+
+switch_size_t whisper_ring_read(whisper_ring_t *ring, void *data, switch_size_t len)
+{
+	uint8_t *dst = (uint8_t *) data;
+	switch_size_t tail = ring->tail;
+	switch_size_t inuse = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - tail;
+	switch_size_t off, first;
+
+	if (len > inuse) {
+		len = inuse;
+	}
+
+	if (len == 0) {
+		return 0;
+	}
+
+	off = tail & ring->mask;
+	first = switch_min(len, ring->size - off);
+
+	memcpy(dst, ring->data + off, first);
+	if (first < len) {
+		memcpy(dst + first, ring->data, len - first);
+	}
+
+	__atomic_store_n(&ring->tail, tail + len, __ATOMIC_RELEASE);
+
+	return len;
+}
@@ -0,0 +1,54 @@
+#ifndef __WHISPER_RING_H__
+#define __WHISPER_RING_H__
+
+#include <switch.h>
+
+#define WHISPER_CACHE_LINE 64
+
+/*
+ * Fixed capacity single-producer/single-consumer byte ring.
+ *
+ * head is only written by the producer and tail only by the consumer, each on its own cache line,
+ * so the two threads never share a lock or a dirty line on the fast path. Positions run freely and
+ * are masked on access, which is why the capacity is always a power of two.
+ *
+ * The first `mirror` bytes of the storage are duplicated past its end, so any read of up to
+ * `mirror` bytes can be taken as one contiguous block even when it wraps (see whisper_ring_peek).
+ */
+typedef struct {
+	volatile switch_size_t head __attribute__((aligned(WHISPER_CACHE_LINE)));
+	volatile switch_size_t tail __attribute__((aligned(WHISPER_CACHE_LINE)));
+	uint8_t *data __attribute__((aligned(WHISPER_CACHE_LINE)));
+	switch_size_t size;
+	switch_size_t mask;
+	switch_size_t mirror;
+} whisper_ring_t;
+
+switch_status_t whisper_ring_create(whisper_ring_t **ring, switch_size_t capacity, switch_size_t mirror, switch_memory_pool_t *pool);
+
+/* producer side */
+switch_size_t whisper_ring_write(whisper_ring_t *ring, const void *data, switch_size_t len);
+switch_size_t whisper_ring_space(whisper_ring_t *ring);
+
+static inline switch_size_t whisper_ring_write_pos(whisper_ring_t *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
+
+/* consumer side */
+switch_size_t whisper_ring_read(whisper_ring_t *ring, void *data, switch_size_t len);
+switch_size_t whisper_ring_peek(whisper_ring_t *ring, const void **data);
+void whisper_ring_consume(whisper_ring_t *ring, switch_size_t len);
+
+static inline switch_size_t whisper_ring_read_pos(whisper_ring_t *ring)
+{
+	return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+/* either side */
+static inline switch_size_t whisper_ring_inuse(whisper_ring_t *ring)
+{
+	return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+#endif
@@ -0,0 +1,282 @@
+#include "mod_whisper.h"
+#include "whisper_slot.h"
+
+/*
+ * Dialplans that run play_and_detect_speech once per prompt open and close an ASR handle every
+ * turn. With reuse-idle-ms set, whisper_close parks the context (connection, lws thread, buffers,
+ * all in a pool of its own) under the channel uuid instead of tearing it down, and the channel's
+ * next whisper_open takes it back. whisper_preconnect parks fresh ASR and TTS connections the same
+ * way, for the first whisper_open and whisper_speech_open. The slot thread frees what is left on
+ * hangup, and what nobody took back in time, checked once a second.
+ */
+
+typedef struct {
+	char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+	whisper_t *asr;
+	whisper_tts_t *tts;
+	switch_time_t idle_at;		/* switch_time_ref, freed by the sweep from then on, reset by every park */
+} whisper_slot_t;
+
+static struct {
+	switch_mutex_t *mutex;
+	switch_hash_t *slots;
+	switch_queue_t *release;
+	switch_thread_t *thread;
+	switch_event_node_t *node;
+	volatile int running;
+} slot_globals;
+
+/* off the hash, so nobody else can reach it */
+static void whisper_slot_free(whisper_slot_t *slot)
+{
+	if (slot->asr) {
+		whisper_asr_free(slot->asr);
+	}
+	if (slot->tts) {
+		whisper_tts_free(slot->tts);
+	}
+	free(slot);
+}
+
+/* joining the lws threads is left to the slot thread, or done here when it is behind */
+static void whisper_slot_release(whisper_slot_t *slot)
+{
+	if (!slot_globals.running || switch_queue_trypush(slot_globals.release, slot) != SWITCH_STATUS_SUCCESS) {
+		whisper_slot_free(slot);
+	}
+}
+
+static void whisper_slot_sweep(void)
+{
+	whisper_slot_t *expired[WHISPER_SLOT_SWEEP_MAX];
+	switch_hash_index_t *hi;
+	switch_time_t now = switch_time_ref();
+	uint32_t n = 0, i;
+
+	switch_mutex_lock(slot_globals.mutex);
+	for (hi = switch_core_hash_first(slot_globals.slots); hi && n < WHISPER_SLOT_SWEEP_MAX; hi = switch_core_hash_next(&hi)) {
+		void *val;
+
+		switch_core_hash_this(hi, NULL, NULL, &val);
+		if (((whisper_slot_t *) val)->idle_at <= now) {
+			expired[n++] = (whisper_slot_t *) val;
+		}
+	}
+	switch_safe_free(hi);
+
+	for (i = 0; i < n; i++) {
+		switch_core_hash_delete(slot_globals.slots, expired[i]->uuid);
+	}
+	switch_mutex_unlock(slot_globals.mutex);
+
+	for (i = 0; i < n; i++) {
+		switch_log_printf(SWITCH_CHANNEL_UUID_LOG(expired[i]->uuid), SWITCH_LOG_DEBUG, "Parked connections idle, closing them\n");
+		whisper_slot_free(expired[i]);
+	}
+}
+
+static void *SWITCH_THREAD_FUNC whisper_slot_thread_run(switch_thread_t *thread, void *obj)
+{
+	switch_time_t swept = switch_time_ref();
+	void *pop;
+
+	while (slot_globals.running) {
+		if (switch_queue_pop_timeout(slot_globals.release, &pop, WHISPER_SLOT_SWEEP_US) == SWITCH_STATUS_SUCCESS && pop) {
+			whisper_slot_free((whisper_slot_t *) pop);
+		}
+
+		if (switch_time_ref() - swept >= WHISPER_SLOT_SWEEP_US) {
+			whisper_slot_sweep();
+			swept = switch_time_ref();
+		}
+	}
+
+	return NULL;
+}
+
+static void whisper_slot_hangup(switch_event_t *event)
+{
+	const char *uuid = switch_event_get_header(event, "Unique-ID");
+	whisper_slot_t *slot;
+
+	if (zstr(uuid)) {
+		return;
+	}
+
+	switch_mutex_lock(slot_globals.mutex);
+	if ((slot = switch_core_hash_find(slot_globals.slots, uuid))) {
+		switch_core_hash_delete(slot_globals.slots, uuid);
+	}
+	switch_mutex_unlock(slot_globals.mutex);
+
+	if (slot) {
+		whisper_slot_release(slot);
+	}
+}
+
+switch_status_t whisper_slot_start(switch_memory_pool_t *pool)
+{
+	switch_threadattr_t *thd_attr = NULL;
+
+	switch_mutex_init(&slot_globals.mutex, SWITCH_MUTEX_NESTED, pool);
+	switch_core_hash_init(&slot_globals.slots);
+
+	if (switch_queue_create(&slot_globals.release, WHISPER_SLOT_QUEUE, pool) != SWITCH_STATUS_SUCCESS) {
+		return SWITCH_STATUS_MEMERR;
+	}
+
+	/* complete: the ASR handles of the channel are closed by then */
+	if (switch_event_bind_removable("mod_whisper", SWITCH_EVENT_CHANNEL_HANGUP_COMPLETE, NULL, whisper_slot_hangup, NULL, &slot_globals.node) != SWITCH_STATUS_SUCCESS) {
+		return SWITCH_STATUS_FALSE;
+	}
+
+	slot_globals.running = 1;
+
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+
+	return switch_thread_create(&slot_globals.thread, thd_attr, whisper_slot_thread_run, NULL, pool);
+}
+
+void whisper_slot_stop(void)
+{
+	switch_hash_index_t *hi;
+	switch_status_t st;
+	void *pop;
+
+	if (slot_globals.node) {
+		switch_event_unbind(&slot_globals.node);
+	}
+
+	if (slot_globals.thread) {
+		slot_globals.running = 0;
+		switch_queue_trypush(slot_globals.release, NULL);
+		switch_thread_join(&st, slot_globals.thread);
+		slot_globals.thread = NULL;
+	}
+
+	while (slot_globals.release && switch_queue_trypop(slot_globals.release, &pop) == SWITCH_STATUS_SUCCESS) {
+		if (pop) {
+			whisper_slot_free((whisper_slot_t *) pop);
+		}
+	}
+
+	if (!slot_globals.slots) {
+		return;
+	}
+
+	switch_mutex_lock(slot_globals.mutex);
+	while ((hi = switch_core_hash_first(slot_globals.slots))) {
+		void *val;
+
+		switch_core_hash_this(hi, NULL, NULL, &val);
+		switch_safe_free(hi);
+		switch_core_hash_delete(slot_globals.slots, ((whisper_slot_t *) val)->uuid);
+		whisper_slot_free((whisper_slot_t *) val);
+	}
+	switch_core_hash_destroy(&slot_globals.slots);
+	switch_mutex_unlock(slot_globals.mutex);
+}
+
+/* asr or tts into the channel's slot, what it replaces is freed */
+static void whisper_slot_put(const char *uuid, whisper_t *asr, whisper_tts_t *tts, uint32_t idle_ms)
+{
+	whisper_slot_t *slot, *old;
+
+	if (!slot_globals.running || zstr(uuid) || !(old = calloc(1, sizeof(*old)))) {
+		if (asr) {
+			whisper_asr_free(asr);
+		}
+		if (tts) {
+			whisper_tts_free(tts);
+		}
+		return;
+	}
+
+	/* logged first, the connection is not ours once it is in the hash */
+	switch_log_printf(SWITCH_CHANNEL_UUID_LOG(uuid), SWITCH_LOG_DEBUG, "%s connection parked for %ums\n", asr ? "ASR" : "TTS", idle_ms);
+
+	switch_mutex_lock(slot_globals.mutex);
+	if (!(slot = switch_core_hash_find(slot_globals.slots, uuid))) {
+		/* the spare one becomes the slot */
+		slot = old;
+		old = NULL;
+		switch_copy_string(slot->uuid, uuid, sizeof(slot->uuid));
+		switch_core_hash_insert(slot_globals.slots, slot->uuid, slot);
+	} else if (asr) {
+		old->asr = slot->asr;
+	} else {
+		old->tts = slot->tts;
+	}
+
+	if (asr) {
+		slot->asr = asr;
+	} else {
+		slot->tts = tts;
+	}
+	slot->idle_at = switch_time_ref() + (switch_time_t) idle_ms * 1000;
+	switch_mutex_unlock(slot_globals.mutex);
+
+	/* two handles open on the same channel, or a second preconnect: the older one is dropped */
+	if (old) {
+		whisper_slot_release(old);
+	}
+}
+
+/* detaches asr or tts from the channel's slot, the slot goes once it is empty */
+static void whisper_slot_get(const char *uuid, whisper_t **asr, whisper_tts_t **tts)
+{
+	whisper_slot_t *slot;
+
+	if (zstr(uuid) || !slot_globals.running) {
+		return;
+	}
+
+	switch_mutex_lock(slot_globals.mutex);
+	if ((slot = switch_core_hash_find(slot_globals.slots, uuid))) {
+		if (asr) {
+			*asr = slot->asr;
+			slot->asr = NULL;
+		} else {
+			*tts = slot->tts;
+			slot->tts = NULL;
+		}
+
+		if (slot->asr || slot->tts) {
+			slot = NULL;
+		} else {
+			switch_core_hash_delete(slot_globals.slots, uuid);
+		}
+	}
+	switch_mutex_unlock(slot_globals.mutex);
+
+	free(slot);
+}
+
+void whisper_slot_park(whisper_t *context, uint32_t idle_ms)
+{
+	whisper_slot_put(context->channel_uuid, context, NULL, idle_ms);
+}
+
+void whisper_slot_park_tts(const char *uuid, whisper_tts_t *tts, uint32_t idle_ms)
+{
+	whisper_slot_put(uuid, NULL, tts, idle_ms);
+}
+
+whisper_t *whisper_slot_take(const char *uuid)
+{
+	whisper_t *context = NULL;
+
+	whisper_slot_get(uuid, &context, NULL);
+
+	return context;
+}
+
+whisper_tts_t *whisper_slot_take_tts(const char *uuid)
+{
+	whisper_tts_t *tts = NULL;
+
+	whisper_slot_get(uuid, NULL, &tts);
+
+	return tts;
+}
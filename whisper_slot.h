@@ -0,0 +1,28 @@
+#ifndef __WHISPER_SLOT_H__
+#define __WHISPER_SLOT_H__
+
+#include "mod_whisper.h"
+
+#define WHISPER_SLOT_SWEEP_US 1000000
+#define WHISPER_SLOT_SWEEP_MAX 64		/* idle slots released per sweep */
+#define WHISPER_SLOT_QUEUE 1024
+
+/* module level slots keeping a channel's connections between handles, and the thread releasing them */
+switch_status_t whisper_slot_start(switch_memory_pool_t *pool);
+void whisper_slot_stop(void);
+
+/*
+ * Parks an ASR context (a closing handle's, or a preconnected one) under its channel-uuid, for
+ * idle_ms. The slot owns it from then on; it is freed with whisper_asr_free on hangup, once idle,
+ * or when another context is parked for the same channel.
+ */
+void whisper_slot_park(whisper_t *context, uint32_t idle_ms);
+
+/* the same for a preconnected TTS connection, freed with whisper_tts_free */
+void whisper_slot_park_tts(const char *uuid, whisper_tts_t *tts, uint32_t idle_ms);
+
+/* what is parked for the channel, NULL if nothing; the caller owns it again */
+whisper_t *whisper_slot_take(const char *uuid);
+whisper_tts_t *whisper_slot_take_tts(const char *uuid);
+
+#endif
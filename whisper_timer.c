@@ -0,0 +1,177 @@
+#include "whisper_timer.h"
+
+/*
+ * Hierarchical timing wheel for the per-session deadlines (no-input, speech, result, connect).
+ *
+ * Level 0 has one slot per tick, each higher level one slot per full turn of the level below.
+ * A timer goes into the lowest level whose range covers it and slides down a level every time the
+ * slot it sits in comes round (the cascade), so arming and cancelling are a list insert / unlink
+ * and a tick only walks the timers that are due. The wheel thread follows the monotonic clock, a
+ * late wakeup runs every tick it missed.
+ */
+
+#define WHISPER_TIMER_MASK (WHISPER_TIMER_SLOTS - 1)
+#define WHISPER_TIMER_MAX_TICKS ((1ULL << (WHISPER_TIMER_BITS * WHISPER_TIMER_LEVELS)) - 1)
+
+static struct {
+	switch_mutex_t *mutex;
+	switch_thread_t *thread;
+	volatile int running;
+	switch_time_t start;
+	uint64_t now;				/* last tick run, guarded by mutex like the slots */
+	whisper_timer_t *slots[WHISPER_TIMER_LEVELS][WHISPER_TIMER_SLOTS];
+} timer_globals;
+
+static void whisper_timer_link(whisper_timer_t *timer)
+{
+	uint64_t delta = timer->expires > timer_globals.now ? timer->expires - timer_globals.now : 0;
+	whisper_timer_t **head;
+	int level = 0;
+
+	while (level < WHISPER_TIMER_LEVELS - 1 && delta >> (WHISPER_TIMER_BITS * (level + 1))) {
+		level++;
+	}
+
+	/* due now only happens on a cascade, which runs right before the level 0 slot of the same tick */
+	if (!delta) {
+		timer->expires = timer_globals.now;
+	}
+
+	head = &timer_globals.slots[level][(timer->expires >> (WHISPER_TIMER_BITS * level)) & WHISPER_TIMER_MASK];
+
+	if ((timer->next = *head)) {
+		timer->next->pprev = &timer->next;
+	}
+	*head = timer;
+	timer->pprev = head;
+}
+
+static void whisper_timer_unlink(whisper_timer_t *timer)
+{
+	if (!timer->pprev) {
+		return;
+	}
+
+	if ((*timer->pprev = timer->next)) {
+		timer->next->pprev = timer->pprev;
+	}
+	timer->next = NULL;
+	timer->pprev = NULL;
+}
+
+/* re-files the timers of one slot of a higher level into the levels below it */
+static void whisper_timer_cascade(int level)
+{
+	whisper_timer_t **head = &timer_globals.slots[level][(timer_globals.now >> (WHISPER_TIMER_BITS * level)) & WHISPER_TIMER_MASK];
+	whisper_timer_t *timer, *list = *head;
+
+	*head = NULL;
+
+	while ((timer = list)) {
+		list = timer->next;
+		timer->pprev = NULL;
+		whisper_timer_link(timer);
+	}
+}
+
+static void whisper_timer_tick(void)
+{
+	whisper_timer_t **head, *timer;
+	int level;
+
+	timer_globals.now++;
+
+	for (level = 1; level < WHISPER_TIMER_LEVELS && !((timer_globals.now >> (WHISPER_TIMER_BITS * (level - 1))) & WHISPER_TIMER_MASK); level++) {
+		whisper_timer_cascade(level);
+	}
+
+	head = &timer_globals.slots[0][timer_globals.now & WHISPER_TIMER_MASK];
+
+	while ((timer = *head)) {
+		whisper_timer_unlink(timer);
+		timer->func(timer, timer->data);
+	}
+}
+
+static void *SWITCH_THREAD_FUNC whisper_timer_thread_run(switch_thread_t *thread, void *obj)
+{
+	while (timer_globals.running) {
+		uint64_t target = (uint64_t) (switch_time_ref() - timer_globals.start) / (WHISPER_TIMER_TICK_MS * 1000);
+
+		switch_mutex_lock(timer_globals.mutex);
+		while (timer_globals.now < target) {
+			whisper_timer_tick();
+		}
+		switch_mutex_unlock(timer_globals.mutex);
+
+		switch_yield(WHISPER_TIMER_TICK_MS * 1000);
+	}
+
+	return NULL;
+}
+
+switch_status_t whisper_timer_start(switch_memory_pool_t *pool)
+{
+	switch_threadattr_t *thd_attr = NULL;
+
+	switch_mutex_init(&timer_globals.mutex, SWITCH_MUTEX_NESTED, pool);
+	timer_globals.start = switch_time_ref();
+	timer_globals.now = 0;
+	timer_globals.running = 1;
+
+	switch_threadattr_create(&thd_attr, pool);
+	switch_threadattr_stacksize_set(thd_attr, SWITCH_THREAD_STACKSIZE);
+	switch_threadattr_priority_set(thd_attr, SWITCH_PRI_REALTIME);
+
+	return switch_thread_create(&timer_globals.thread, thd_attr, whisper_timer_thread_run, NULL, pool);
+}
+
+/* sessions are gone by now, whatever is still armed is simply dropped */
+void whisper_timer_stop(void)
+{
+	switch_status_t st;
+
+	if (!timer_globals.thread) {
+		return;
+	}
+
+	timer_globals.running = 0;
+	switch_thread_join(&st, timer_globals.thread);
+	timer_globals.thread = NULL;
+
+	memset(timer_globals.slots, 0, sizeof(timer_globals.slots));
+}
+
+void whisper_timer_init(whisper_timer_t *timer, whisper_timer_func_t func, void *data)
+{
+	memset(timer, 0, sizeof(*timer));
+	timer->func = func;
+	timer->data = data;
+}
+
+/* (re)arms the timer ms from now, rounded up to the next tick */
+void whisper_timer_arm(whisper_timer_t *timer, uint32_t ms)
+{
+	uint64_t ticks = ((uint64_t) ms + WHISPER_TIMER_TICK_MS - 1) / WHISPER_TIMER_TICK_MS;
+
+	if (!timer_globals.mutex) {
+		return;
+	}
+
+	switch_mutex_lock(timer_globals.mutex);
+	whisper_timer_unlink(timer);
+	timer->expires = timer_globals.now + switch_min(switch_max(ticks, 1), WHISPER_TIMER_MAX_TICKS);
+	whisper_timer_link(timer);
+	switch_mutex_unlock(timer_globals.mutex);
+}
+
+void whisper_timer_cancel(whisper_timer_t *timer)
+{
+	if (!timer_globals.mutex) {
+		return;
+	}
+
+	switch_mutex_lock(timer_globals.mutex);
+	whisper_timer_unlink(timer);
+	switch_mutex_unlock(timer_globals.mutex);
+}
@@ -0,0 +1,34 @@
+#ifndef __WHISPER_TIMER_H__
+#define __WHISPER_TIMER_H__
+
+#include <switch.h>
+
+#define WHISPER_TIMER_TICK_MS 10
+#define WHISPER_TIMER_BITS 6
+#define WHISPER_TIMER_SLOTS (1 << WHISPER_TIMER_BITS)
+#define WHISPER_TIMER_LEVELS 4		/* 64^4 ticks, about 46 hours at 10ms */
+
+typedef struct whisper_timer_s whisper_timer_t;
+
+/* runs on the wheel thread with the wheel locked: it must not block or take a session mutex */
+typedef void (*whisper_timer_func_t)(whisper_timer_t *timer, void *data);
+
+/* embedded in its owner, pprev is NULL while it is not armed */
+struct whisper_timer_s {
+	whisper_timer_t *next;
+	whisper_timer_t **pprev;
+	uint64_t expires;
+	whisper_timer_func_t func;
+	void *data;
+};
+
+/* module level wheel thread, one for all sessions */
+switch_status_t whisper_timer_start(switch_memory_pool_t *pool);
+void whisper_timer_stop(void);
+
+/* O(1), from any thread. Once cancel returns the callback is finished or will not run */
+void whisper_timer_init(whisper_timer_t *timer, whisper_timer_func_t func, void *data);
+void whisper_timer_arm(whisper_timer_t *timer, uint32_t ms);
+void whisper_timer_cancel(whisper_timer_t *timer);
+
+#endif